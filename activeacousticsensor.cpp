@@ -1,190 +1,345 @@
 #include "activeacousticsensor.h"
 
 /*====================================================================================================================================================================================================================================================================================*/
-// Math Functions
+#ifdef AIF
+// スイープジェネレータ
+
+/**
+ * @brief SweepGenerator::SweepGenerator
+ * @param format
+ * @param min_Hz
+ * @param max_Hz
+ * @param duration_ms
+ * @param parent
+ */
 
-// ローパスフィルタ
-QVector<float> lowpass(QVector<float> in, int width = 5)
+SweepGenerator::SweepGenerator(const QAudioFormat &format, int min_Hz, int max_Hz, int duration_ms, QObject *parent)
+    : QIODevice(parent) // 基底クラスのコンストラクタを明示的に呼んでおく
+    , m_format(format) // メンバの初期化(通常はconstをつけたメンバなど関数内で初期化できないものを初期化するための書き方だが、今回はconst無しだった)
+    , m_pos(0) // 同上
+    , current(NULL)
+    , next(NULL)
+    , retired(NULL)
 {
-    QVector<float> out;
-    for(int i = 0; i < in.size(); i++)
-    {
-        float mean = 0;
-        int count = 0;
-        for(int j = qMax(i-width, 0); j < qMin(i+width, in.size()); j++)
-        {
-            if(in.value(j) != 0 )
-            {
-                mean += in[j];
-                count++;
-            }
-        }
-        mean /= (float)count;
-        out.append(mean);
-    }
-    return out;
+    // 従来どおり線形チャープで開始する
+    current = render(PROBE_LINEAR_CHIRP, min_Hz, max_Hz, duration_ms);
+    info = *current;
+    info.pcm.clear();
+}
+
+SweepGenerator::~SweepGenerator()
+{
+    delete current;
+    delete next.fetchAndStoreOrdered(NULL);
+    delete retired.fetchAndStoreOrdered(NULL);
 }
 
-// データ(パワースペクトル)の次元を削減(ダウンサンプリング)
-// stepで指定した間隔ごとにデータを取得して詰め直す
-QVector<float> reduce(QVector<float> in, int step, int offset = 0)
+void SweepGenerator::start()
+{
+    // 出力停止中に変更された波形はここで反映する
+    m_pos = 0;
+    swapPeriod();
+    open(QIODevice::ReadOnly);
+}
+
+void SweepGenerator::stop()
+{
+    m_pos = 0;
+    close();
+}
+
+// 1周期分の波形を生成し、16bitの全チャンネルに同じ値を書いたPCMを2周期分並べる
+// 2周期分あるので、1周期以下の読み出しは読み出し位置によらず折り返さずに1回のmemcpyで済む
+SweepGenerator::Period *SweepGenerator::render(ProbeWaveform type, int min_Hz, int max_Hz, int duration_ms) const
 {
-    QVector<float> out;
-    for(int i = 0; i < in.size(); i++)
+    Period *p = new Period;
+    p->type = type;
+    p->minHz = min_Hz;
+    p->maxHz = max_Hz;
+    p->wave = renderProbe(type, m_format.sampleRate(), min_Hz, max_Hz, (int)(m_format.sampleRate() * duration_ms / 1000.));
+    if(p->wave.isEmpty()) p->wave.fill(0, 1);
+
+    int n = p->wave.size();
+    int channels = qMax(1, m_format.channelCount());
+    p->periodBytes = (qint64)n * channels * 2;
+    p->pcm.resize(2 * p->periodBytes);
+    qint16 *pcm = reinterpret_cast<qint16 *>(p->pcm.data());
+    const float *w = p->wave.constData();
+    for(int i = 0; i < n; i++)
     {
-        if((i+offset) % step == 0 )
-            out.append(in.at(i));
+        qint16 value = qToLittleEndian<qint16>(static_cast<qint16>(w[i] * (SHRT_MAX-1)));
+        for(int j = 0; j < channels; j++) pcm[i * channels + j] = value;
     }
-    return out;
+    memcpy(pcm + n * channels, pcm, p->periodBytes);
+    return p;
 }
 
-// ハミング窓
-QVector<float> hamming(QVector<float> in)
+void SweepGenerator::setWaveform(ProbeWaveform type, int min_Hz, int max_Hz, int duration_ms)
 {
-    QVector<float> out;
-    for(int i = 0; i < in.size(); i++)
+    Period *p = render(type, min_Hz, max_Hz, duration_ms);
     {
-        double ham = 0.54 - 0.46 * cos(2.*M_PI*i/(double)in.size());
-        out.append(ham*in.at(i));
+        QMutexLocker locker(&infoLock);
+        info = *p;
+        info.pcm.clear();
     }
-    return out;
+    // 前回外れた周期を先に解放して、オーディオスレッドが次の差し替えで外す周期の置き場を空けておく
+    delete retired.fetchAndStoreOrdered(NULL);
+    // まだ差し替えられていない前回の周期は出力されることがないので、ここで捨てる
+    delete next.fetchAndStoreOrdered(p);
 }
 
-/*====================================================================================================================================================================================================================================================================================*/
-#ifdef AIF
-// パワースペクトルを求める
-int maGetPowerSpectol2D( fftwf_complex *in, float *out, int cols, int rows )
+void SweepGenerator::swapPeriod()
 {
-    int i,j;
-    int idx; // index of data
-    //double max, min, scale; // max/min of powerspectol
+    // オーディオスレッドではメモリを解放しない。外した周期はretiredに置き、setWaveform()かデストラクタが解放する
+    // 前回外れた周期がまだ置かれていれば(setWaveform()が解放する前なら)、差し替えを次の周期の継ぎ目まで延ばす
+    if(retired.loadAcquire() != NULL || next.loadAcquire() == NULL) return;
+    Period *p = next.fetchAndStoreAcquire(NULL);
+    if(!p) return;
+    retired.storeRelease(current);
+    current = p;
+}
 
-    if( in==NULL || out==NULL ) return false;
-    if( rows<0 || cols<0 )      return false;
+QVector<float> SweepGenerator::waveform() const
+{
+    QMutexLocker locker(&infoLock);
+    return info.wave;
+}
 
-    for( j=0; j<rows; j++ ){
-        for( i=0; i<cols; i++ ){
-            idx = j*cols + i;
-            out[idx] = log10(1 + sqrt(pow(in[idx][0],2) + pow(in[idx][1],2)) );
-        }
-    }
+ProbeWaveform SweepGenerator::waveformType() const
+{
+    QMutexLocker locker(&infoLock);
+    return info.type;
+}
 
-    return true;
+int SweepGenerator::minHz() const
+{
+    QMutexLocker locker(&infoLock);
+    return info.minHz;
 }
 
-// FFT
-QVector<float> fft(QVector<float> in, bool ma = true)
+int SweepGenerator::maxHz() const
 {
+    QMutexLocker locker(&infoLock);
+    return info.maxHz;
+}
 
-    int N = in.size();
-    float *inc = new float[N];
-    memcpy(inc, in.data(), sizeof(float)*N);
+int SweepGenerator::periodSamples() const
+{
+    QMutexLocker locker(&infoLock);
+    return info.wave.size();
+}
 
-    size_t mem_size = sizeof(fftwf_complex)*N;
-    fftwf_complex *out = (fftwf_complex*)fftwf_malloc( mem_size );
-    fftwf_plan p = fftwf_plan_dft_r2c_1d(N, inc, out, FFTW_ESTIMATE);
-    fftwf_execute(p);
-    delete [] inc;
-    QVector<float> o(N/2);
-    if(ma)
-        maGetPowerSpectol2D(out, o.data(), 1, N/2);
-    else
+// QAudioOutputから呼ばれる。1周期以下の要求なら(差し替えの瞬間を除いて)memcpy1回で返す
+qint64 SweepGenerator::readData(char *data, qint64 maxlen)
+{
+    qint64 bytesPerFrame = qMax(1, m_format.channelCount()) * 2;
+    qint64 len = maxlen - maxlen % bytesPerFrame;
+    qint64 total = 0;
+    while(total < len)
     {
-        for(int i = 0; i < o.size(); i++)
+        qint64 chunk = qMin(len - total, current->periodBytes);
+        // 差し替え待ちがあれば、周期の継ぎ目で切って次の周期から新しい波形にする
+        if(next.loadAcquire() && m_pos + chunk > current->periodBytes) chunk = current->periodBytes - m_pos;
+        memcpy(data + total, current->pcm.constData() + m_pos, chunk);
+        total += chunk;
+        m_pos += chunk;
+        if(m_pos >= current->periodBytes)
         {
-            o[i] = sqrt(pow(out[i][0],2) + pow(out[i][1],2));
+            m_pos -= current->periodBytes;
+            if(m_pos == 0) swapPeriod();
         }
     }
-    fftwf_destroy_plan(p);
-    fftwf_free(out);
-    return o;
+    return total;
 }
 
-/*====================================================================================================================================================================================================================================================================================*/
-// スイープジェネレータ
+qint64 SweepGenerator::writeData(const char *data, qint64 len)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(len);
 
-/**
- * @brief SweepGenerator::SweepGenerator
- * @param format
- * @param min_Hz
- * @param max_Hz
- * @param duration_ms
- * @param parent
- */
+    return 0;
+}
 
-SweepGenerator::SweepGenerator(const QAudioFormat &format, int min_Hz, int max_Hz, int duration_ms, QObject *parent = NULL)
-    : QIODevice(parent) // 基底クラスのコンストラクタを明示的に呼んでおく
-    , m_format(format) // メンバの初期化(通常はconstをつけたメンバなど関数内で初期化できないものを初期化するための書き方だが、今回はconst無しだった)
-    , m_pos(0) // 同上
+qint64 SweepGenerator::bytesAvailable() const
 {
-    generateData(format, min_Hz, max_Hz, duration_ms);
+    return current->pcm.size() + QIODevice::bytesAvailable();
 }
 
-void SweepGenerator::start()
+/*====================================================================================================================================================================================================================================================================================*/
+// キャプチャ(オーディオスレッド)
+
+CaptureDevice::CaptureDevice(QObject *parent)
+    : QIODevice(parent)
+    , pending(0)
+    , overrunCount(0)
+    , arrivalTime(-1)
+    , channelCount(2)
+    , count(0)
+    , hasCarry(false)
+    , carry(0)
 {
-    open(QIODevice::ReadOnly);
+    setChannelCount(2);
 }
 
-void SweepGenerator::stop()
+void CaptureDevice::setChannelCount(int _channelCount)
 {
-    m_pos = 0;
-    close();
+    channelCount = qMax(1, _channelCount);
+    slotOf.fill(-1, channelCount);
+    rings.clear();
+    readies.clear();
+    scratch.clear();
+    pending = 0;
+    count = 0;
+    hasCarry = false;
 }
 
-void SweepGenerator::generateData(const QAudioFormat &format, int min_Hz, int max_Hz, int duration_ms)
+void CaptureDevice::addChannel(int input, RingBuffer<float> *ring, QSemaphore *ready)
 {
-    max_sample = format.sampleRate() * duration_ms / 1000.;
-    float df = (float)(max_Hz-min_Hz)/(float)max_sample;
-    float noise_filter = 1;
-    double fi = 0;
+    if(input < 0 || input >= channelCount) return;
+    slotOf[input] = rings.size();
+    rings.append(ring);
+    readies.append(ready);
+    // 変換済みサンプルの置き場はここで確保しておき、writeData()では確保しない
+    scratch.resize(rings.size() * CHUNK);
+}
 
-    m_buffer.clear();
-    m_buffer.resize(max_sample * format.bytesPerFrame());
-    unsigned char *ptr = reinterpret_cast<unsigned char *>(m_buffer.data());
+qint64 CaptureDevice::readData(char *data, qint64 maxlen)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxlen);
 
-    for(qint64 p = 0; p < max_sample; p++)
+    return 0;
+}
+
+// scratchに溜まったpending点を各チャンネルのリングバッファに積む
+// どれか1つでも満杯に近ければ、全チャンネルで同じ点数だけ積んで残りは捨てる(チャンネル間の時刻を揃えるため)
+void CaptureDevice::flush()
+{
+    int n = pending;
+    for(int k = 0; k < rings.size(); k++)
+    {
+        n = qMin(n, rings[k]->capacity() - rings[k]->size());
+    }
+    for(int k = 0; k < rings.size(); k++)
     {
-        double f = min_Hz + df * p;
+        rings[k]->push(scratch.constData() + k * CHUNK, n);
+    }
+    if(n < pending) overrunCount.fetchAndAddRelaxed(pending - n);
+    pending = 0;
+}
+
+// QAudioInputから呼ばれる。ここではロックもメモリ確保もせず、変換してリングバッファに積むだけにする
+qint64 CaptureDevice::writeData(const char *data, qint64 len)
+{
+    // 到着時刻はリングバッファに積む前に記録する(DSPスレッドが取り出した後に読めば、このコールバック以降の時刻になる)
+    LatencyProbe *probe = LatencyProbe::instance();
+    qint64 arrival = probe->now();
+    arrivalTime.store(arrival);
+
+    float *samples = scratch.data();
+    unsigned char pair[2];
 
-        if(p < max_sample/10)
-            noise_filter = (float)p/(max_sample/10.);
-        else if((max_sample-p) < max_sample/10)
-            noise_filter = (float)(max_sample-p)/(max_sample/10.);
+    qint64 i = 0;
+    while(i < len)
+    {
+        qint16 sample;
+        if(hasCarry)
+        {
+            pair[0] = carry;
+            pair[1] = data[i];
+            sample = qFromLittleEndian<qint16>(pair);
+            hasCarry = false;
+            i += 1;
+        }
+        else if(len - i >= 2)
+        {
+            sample = qFromLittleEndian<qint16>(reinterpret_cast<const uchar *>(data + i));
+            i += 2;
+        }
         else
-            noise_filter = 1;
-        qint16 value = static_cast<qint16>(qSin(fi)* noise_filter * (SHRT_MAX-1));
-        for(int j = 0; j < format.channelCount(); j++)
         {
-            qToLittleEndian<qint16>(value, ptr);
-            ptr += 2;
+            carry = data[i];
+            hasCarry = true;
+            break;
+        }
+
+        int slot = slotOf[count]; // countが0なら1ch, 1なら2ch
+        if(slot >= 0)
+        {
+            samples[slot * CHUNK + pending] = sample/(float)SHRT_MAX*10;
+        }
+        count++;
+        if(count == channelCount)
+        {
+            // 全チャンネル分が揃った
+            count = 0;
+            if(++pending == CHUNK) flush();
         }
-        fi += 2 * M_PI * f * (1./(double)format.sampleRate());
     }
+    if(pending > 0)
+    {
+        int complete = pending;
+        flush();
+        // 途中まで受け取ったサンプル組(コールバックの境界で分断されたもの)は先頭に移して続きを待つ
+        if(count > 0)
+        {
+            for(int k = 0; k < rings.size(); k++) samples[k * CHUNK] = samples[k * CHUNK + complete];
+        }
+    }
+
+    // DSPスレッドを起こす(releaseはブロックしない)
+    for(int k = 0; k < readies.size(); k++) readies[k]->release();
+    probe->record(LatencyProbe::STAGE_CAPTURE, probe->now() - arrival);
+    return len;
 }
 
-qint64 SweepGenerator::readData(char *data, qint64 maxlen)
+void AudioThread::setup(const QAudioDeviceInfo &_inputDevice, const QAudioDeviceInfo &_outputDevice, const QAudioFormat &_format,
+                        CaptureDevice *_sink, SweepGenerator *_sweep)
 {
-    qint64 total = 0;
-    while (maxlen - total > 0) {
-        const qint64 chunk = qMin((m_buffer.size() - m_pos), maxlen - total);
-        memcpy(data + total, m_buffer.constData() + m_pos, chunk);
-        m_pos = (m_pos + chunk) % m_buffer.size();
-        total += chunk;
-    }
-    return total;
+    inputDevice = _inputDevice;
+    outputDevice = _outputDevice;
+    format = _format;
+    sink = _sink;
+    sweep = _sweep;
 }
 
-qint64 SweepGenerator::writeData(const char *data, qint64 len)
+// IN/OUTのインスタンスをこのスレッドで生成し、イベントループを回す
+// (Qtのオーディオバックエンドは生成したスレッドのイベントループでバッファを受け渡すため)
+void AudioThread::run()
 {
-    Q_UNUSED(data);
-    Q_UNUSED(len);
+    QAudioInput input(inputDevice, format);
+    // バッファサイズを設定
+    input.setBufferSize(10000); // 10000
+    QAudioOutput output(outputDevice, format);
 
-    return 0;
+    sink->open(QIODevice::WriteOnly);
+    input.start(sink);
+    sweep->start();
+    output.start(sweep);
+
+    exec();
+
+    input.stop();
+    output.stop();
+    sink->close();
+    sweep->stop();
+
+    // 次回のstart()で再び移せるように、GUIスレッドに返しておく
+    sink->moveToThread(QCoreApplication::instance()->thread());
+    sweep->moveToThread(QCoreApplication::instance()->thread());
 }
 
-qint64 SweepGenerator::bytesAvailable() const
+void FeatureThread::run()
 {
-    return m_buffer.size() + QIODevice::bytesAvailable();
+    while(!isInterruptionRequested())
+    {
+        // サンプルが届くまで待つ(stop()は中断を要求してからreleaseするので、ここで止まったままにはならない)
+        ready->acquire();
+        if(isInterruptionRequested()) break;
+        // 複数回起こされていても、まとめて一度に処理する
+        ready->tryAcquire(ready->available());
+        sensor->readData(channel);
+    }
 }
 
 /*====================================================================================================================================================================================================================================================================================*/
@@ -195,16 +350,34 @@ qint64 SweepGenerator::bytesAvailable() const
 AIFActiveAcousticSensor::AIFActiveAcousticSensor(QString inputDeviceName, QString outputDeviceName, QObject *parent)
     : ActiveAcousticSensor(parent)
     , frame_width(3840) // 3840
+    , requestedHop(960) // 75%オーバーラップ(96kHzで10ms毎に1フレーム)
+    , windowType(WINDOW_HAMMING)
+    , windowBeta(8.6f)
+    , planMode(FFTEngine::MEASURE)
+    , spectralMode(FeaturePipeline::SPECTRUM_AUTO)
+    , bandBins(0)
+    , featureMode(FeaturePipeline::FEATURE_SPECTRUM)
+    , featureModeSize(64)
+    , syncEnabled(false)
+    , syncAverages(1)
+    , settingsVersion(0)
+    , externalWake(NULL)
+    , completedFrame(-1)
+    , completedArrival(-1)
+    , completedReady(-1)
+    , channelFeatureSize(0)
+    , dataFrame(-1)
+    , dataArrival(-1)
+    , dataReady(-1)
+    , emittedFrame(-1)
+    , framePending(0)
 {
-    senseBuffer.resize(frame_width);
-
     // サンプリングレート
     format.setSampleRate(96000);
     format.setCodec("audio/pcm");
     format.setSampleType(QAudioFormat::SignedInt);
 
     // IN/OUTオーディオデバイスを設定
-    QAudioDeviceInfo inputDevice, outputDevice;
     foreach(QAudioDeviceInfo info, QAudioDeviceInfo::availableDevices(QAudio::AudioInput))
     {
         if(info.deviceName().startsWith(inputDeviceName))
@@ -217,21 +390,22 @@ AIFActiveAcousticSensor::AIFActiveAcousticSensor(QString inputDeviceName, QStrin
     }
 
     // INのフォーマットを設定
+    // IN/OUTのインスタンスはオーディオスレッドの開始時に生成する(AudioThread::run())
     format = inputDevice.preferredFormat();
     format.setSampleSize(16);
-    // INのインスタンスを生成
-    input = new QAudioInput(inputDevice, format);
-    // バッファサイズを設定
-    input->setBufferSize(10000); // 10000
-    // OUTのインスタンスを生成
-    output = new QAudioOutput(outputDevice, format);
 
     // 周波数レンジを設定して、スイープジェネレータを生成
     _min_Hz = 20000;
     _max_Hz = 40000; // 82000より上で不可解な可聴ノイズ発生
+    bandMinHz = _min_Hz;
+    bandMaxHz = _max_Hz;
     sweepGenerator = new SweepGenerator(format, _min_Hz, _max_Hz, 20);
     //sweepGenerator = new SweepGenerator(format, 20000, 40000, 20); // 20kHz~40kHz
 
+    // 入力の書き込み先。既定では2ch目(index 1)のみを使う
+    sink = new CaptureDevice;
+    buildChannels(QList<int>() << 1);
+
     // タイマのタイムアウトイベントをデータ更新のトリガーに設定。タイマの設定はAIFActiveAcousticSensor::start()にて行われる。
     // 当該フレームの特徴ベクトルをdataとして添えて、データ更新シグナルupgateData(data)を発行。この実装はヘッダにて記述。
     // このシグナルは、シリアル版でMainTabにキャッチされているのと同様に、本AIF版ではmainWindowにてキャッチされる
@@ -240,67 +414,416 @@ AIFActiveAcousticSensor::AIFActiveAcousticSensor(QString inputDeviceName, QStrin
 AIFActiveAcousticSensor::~AIFActiveAcousticSensor()
 {
     stop();
+    qDeleteAll(channels);
+    delete sink;
+    delete sweepGenerator;
+}
+
+// 選択したチャンネルごとにリングバッファ・フレーム切り出し・特徴抽出・DSPスレッドを作り、CaptureDeviceにつなぐ
+// (オーディオスレッドとDSPスレッドの停止中に呼ぶ)
+QString AIFActiveAcousticSensor::buildChannels(QList<int> inputs)
+{
+    qDeleteAll(channels);
+    channels.clear();
+    int available = format.channelCount();
+    sink->setChannelCount(available);
+
+    // 入力に無いチャンネルは黙って捨てずに、メッセージで知らせる
+    QList<int> valid;
+    QStringList missing;
+    foreach(int input, inputs)
+    {
+        if(input >= 0 && input < available) valid.append(input);
+        else missing.append(QString::number(input + 1));
+    }
+    QString status = "OK";
+    if(!missing.isEmpty())
+    {
+        status = QString("input channel %1 not available (device has %2 channels)").arg(missing.join(",")).arg(available);
+    }
+    if(valid.isEmpty() && available > 0)
+    {
+        valid.append(qMin(1, available - 1));
+        if(missing.isEmpty()) status = "no input channel selected";
+        status += QString(", using channel %1").arg(valid.first() + 1);
+    }
+    if(status != "OK") qDebug() << status;
+
+    foreach(int input, valid)
+    {
+        SenseChannel *c = new SenseChannel(this, channels.size(), input);
+        c->framer.setup(frame_width, requestedHop.load());
+        c->senseBuffer.resize(frame_width);
+        // FFTのプランと作業バッファはここで一度だけ作成し、以降のフレームでは使い回す
+        c->pipeline.configure(frame_width, format.sampleRate(), _min_Hz, _max_Hz);
+        c->feature.resize(c->pipeline.featureSize());
+        sink->addChannel(input, &c->ring, externalWake ? externalWake : &c->ready);
+        channels.append(c);
+    }
+
+    QMutexLocker locker(&frameLock);
+    latestFrame.clear();
+    resetFrameSlots();
+    completedFrame = -1;
+    return status;
+}
+
+void AIFActiveAcousticSensor::resetFrameSlots()
+{
+    for(int i = 0; i < FRAME_SLOTS; i++)
+    {
+        frameSlots[i].frame = -1;
+        frameSlots[i].written = 0;
+    }
+}
+
+void AIFActiveAcousticSensor::setExternalWake(QSemaphore *wake)
+{
+    if(wake == externalWake) return;
+    bool running = audioThread.isRunning();
+    if(running) stop();
+    externalWake = wake;
+    buildChannels(inputChannels());
+    if(running) start();
+}
+
+qint64 AIFActiveAcousticSensor::copyLatestFrame(QVector<float> &dst)
+{
+    QMutexLocker locker(&frameLock);
+    if(completedFrame < 0) return -1;
+    if(dst.size() != latestFrame.size()) dst.resize(latestFrame.size());
+    memcpy(dst.data(), latestFrame.constData(), sizeof(float) * latestFrame.size());
+    return completedFrame;
+}
+
+QString AIFActiveAcousticSensor::setInputChannels(QList<int> inputs)
+{
+    bool running = audioThread.isRunning();
+    if(running) stop();
+    QString status = buildChannels(inputs);
+    if(running) start();
+    return status;
+}
+
+QList<int> AIFActiveAcousticSensor::inputChannels() const
+{
+    QList<int> inputs;
+    foreach(SenseChannel *c, channels) inputs.append(c->input);
+    return inputs;
+}
+
+int AIFActiveAcousticSensor::ringOccupancy() const
+{
+    int occupancy = 0;
+    foreach(SenseChannel *c, channels) occupancy = qMax(occupancy, c->ring.size());
+    return occupancy;
+}
+
+int AIFActiveAcousticSensor::ringCapacity() const
+{
+    return channels.isEmpty() ? 0 : channels.first()->ring.capacity();
 }
 
 
 // mainWindowから叩かれてルーチンスタート
 QString AIFActiveAcousticSensor::start()
 {
-    if(input->state() != QAudio::ActiveState)
+    if(!audioThread.isRunning())
     {
-        inputBuffer = input->start();
-        // 受信シグナルをreadyRead()を受けたらreadDataでデータ読み込みを行うように設定
-        connect(inputBuffer, SIGNAL(readyRead()), SLOT(readData()));
-        inputBuffer->open(QIODevice::ReadOnly);
-        // senseDataChanged()シグナルを発行する更新間隔を設定
-        t.start(33);
+        // DSPスレッドは停止中なので、チャンネル間のフレーム番号もここで揃え直す
+        foreach(SenseChannel *c, channels)
+        {
+            c->ring.clear();
+            c->framer.reset();
+            c->sweepFramer.reset();
+            c->syncOffset.store(-1);
+            c->frameIndex = 0;
+        }
+        frameLock.lock();
+        resetFrameSlots();
+        completedFrame = -1;
+        frameLock.unlock();
+        dataFrame = emittedFrame = -1;
+        // デバイスの読み書きはオーディオスレッドで行うので、所属スレッドを移してから開始する
+        sink->moveToThread(&audioThread);
+        sweepGenerator->moveToThread(&audioThread);
+        audioThread.setup(inputDevice, outputDevice, format, sink, sweepGenerator);
+        audioThread.start(QThread::TimeCriticalPriority);
     }
-    if(output->state() != QAudio::ActiveState)
+    // チャンネルごとのDSPスレッドはOSが別々のコアに割り振る(ワーカープールから処理する場合は起動しない)
+    foreach(SenseChannel *c, channels)
     {
-        sweepGenerator->start();
-        output->start(sweepGenerator);
-        t.start(33);
+        if(!externalWake && !c->thread.isRunning()) c->thread.start(QThread::HighPriority);
     }
+    // senseDataChanged()シグナルを発行する更新間隔を設定
+    t.start(33);
 
     return "OK";
 }
 void AIFActiveAcousticSensor::stop()
 {
-    inputBuffer->close();
-    inputBuffer->disconnect(SIGNAL(readyRead()));
-    input->stop();
+    t.stop();
+
+    audioThread.quit();
+    audioThread.wait();
 
-    sweepGenerator->close();
-    output->stop();
+    foreach(SenseChannel *c, channels)
+    {
+        c->thread.requestInterruption();
+        c->ready.release();
+    }
+    foreach(SenseChannel *c, channels)
+    {
+        c->thread.wait();
+    }
 }
 
 
-// AIFからの入力バッファから一定時間内の音声データ(時間領域)を取得し、これをFFTしてパワースペクトルに変換後、データの加工を行う
-void AIFActiveAcousticSensor::readData()
+// リングバッファに溜まった音声データ(時間領域)を取得してフレームに切り出し、DSPスレッドで特徴ベクトルを計算する
+// hop点ごとに1フレームを出力するので、コールバックの大きさによらずフレームレートは一定になる
+void AIFActiveAcousticSensor::readData(int index)
 {
-    QDataStream ds(inputBuffer->readAll());
-    ds.setByteOrder(QDataStream::LittleEndian);
+    SenseChannel *c = channels[index];
+    applySettings(c);
 
-    short sample;
-    int count = 0;
-    while(!ds.atEnd())
+    const int CHUNK = 1024;
+    float samples[CHUNK];
+    int n;
+    for(;;)
     {
-        ds >> sample;
-        if(count % input->format().channelCount() == 1) // 0は1ch, 1は2ch
+        // リングバッファがあふれてサンプルが欠けたら、スイープとの位相がずれるので遅延を測り直す
+        // 溜まっている分(欠ける前のサンプル)と途中まで取り込んだ周期は捨て、測り直した直後の1周期も出力しない
+        int overruns = sink->overruns();
+        if(overruns != c->seenOverruns)
         {
-            senseBuffer.takeFirst();
-            senseBuffer.append(sample/(float)SHRT_MAX*10);
+            c->seenOverruns = overruns;
+            if(c->sync)
+            {
+                c->ring.clear();
+                c->sweepFramer.resync();
+            }
         }
-        count++;
+        n = c->ring.pop(samples, CHUNK);
+        if(n <= 0) break;
+
+        c->arrival = sink->lastArrival();
+        const float *p = samples;
+        while(n > 0)
+        {
+            if(c->sync)
+            {
+                int used = c->sweepFramer.write(p, n);
+                p += used;
+                n -= used;
+                if(!c->sweepFramer.frameReady()) continue;
+                c->sweepFramer.read(c->senseBuffer.data());
+            }
+            else
+            {
+                int used = c->framer.write(p, n);
+                p += used;
+                n -= used;
+                if(!c->framer.frameReady()) continue;
+                c->framer.read(c->senseBuffer.data());
+            }
+            processFrame(index);
+        }
+    }
+    c->syncOffset.store(c->sync && c->sweepFramer.locked() ? c->sweepFramer.offset() : -1);
+}
+
+// GUIスレッドから変更された設定を反映する(係数表・プラン・同期用の相関はここで一度だけ作られる)
+void AIFActiveAcousticSensor::applySettings(SenseChannel *c)
+{
+    int h = requestedHop.load();
+    if(h != c->framer.hop() || c->framer.width() != frame_width)
+    {
+        c->framer.setup(frame_width, h);
+    }
+
+    int version = settingsVersion.loadAcquire();
+    if(version == c->settingsVersion) return;
+
+    QMutexLocker locker(&settingsLock);
+    c->sync = syncEnabled;
+    int width = frame_width;
+    if(c->sync)
+    {
+        // 出力中(差し替え待ちなら次)のスイープ1周期をフレームとする
+        c->sweepFramer.setup(sweepGenerator->waveform(), syncAverages);
+        width = c->sweepFramer.width();
+    }
+    c->senseBuffer.resize(width);
+    c->pipeline.configure(width, format.sampleRate(), bandMinHz, bandMaxHz);
+    c->pipeline.setWindow(windowType, windowBeta);
+    c->pipeline.setPlanMode(planMode);
+    c->pipeline.setSpectralMode(spectralMode, bandBins);
+    // 整合フィルタはスイープ同期と同じく、差し替え待ちがあればその波形を使う
+    if(featureMode == FeaturePipeline::FEATURE_SPECTRUM)
+        c->pipeline.setFeatureMode(featureMode);
+    else
+        c->pipeline.setFeatureMode(featureMode, sweepGenerator->waveform(), featureModeSize);
+    c->feature.resize(c->pipeline.featureSize());
+    c->settingsVersion = version;
+}
+
+// senseBufferに切り出された1フレームから特徴ベクトルを求めてGUIスレッドへ渡す
+void AIFActiveAcousticSensor::processFrame(int index)
+{
+    SenseChannel *c = channels[index];
+
+    // 読み込んだデータ(この時点ではまだ時間領域)に窓関数(既定はハミング窓)を掛けて不連続性を軽減し(http://www.logical-arts.jp/?p=124)、これをfftして周波数領域(パワースペクトル)に変換。
+    // 必要な周波数レンジのデータのみを取り出し、次元を1/2に削減(間引き)してからローパスフィルタを掛け、これを加工済みデータとする。
+    // 全て確保済みのバッファの上で行い、結果はfeatureに直接書き込まれる
+    c->pipeline.process(c->senseBuffer.constData(), c->feature.data());
+    qint64 frame = c->frameIndex++;
+    qint64 ready = LatencyProbe::instance()->now();
+
+    // GUIスレッドへ非同期に渡す。GUIが詰まっていても通知は1件しか積まれず、最新のフレームだけが取り込まれる
+    // latestFrameはGUI側でも要素をコピーして受け取るので共有されず、ここでは確保済みの領域に上書きするだけになる
+    // 各チャンネルは同じサンプル数ずつ受け取るので同じ番号のフレームは同じ時刻のもの。最後に書いたチャンネルが通知する
+    int size = c->feature.size();
+    bool complete = false;
+    frameLock.lock();
+    FrameSlot &slot = frameSlots[frame % FRAME_SLOTS];
+    if(slot.frame < frame)
+    {
+        // FRAME_SLOTS前のフレームがそろわないまま残っていれば、遅れているチャンネルのものは捨てる
+        slot.frame = frame;
+        slot.written = 0;
+    }
+    if(slot.frame == frame)
+    {
+        if(slot.features.size() != size * channels.size()) slot.features.resize(size * channels.size());
+        memcpy(slot.features.data() + size * index, c->feature.constData(), sizeof(float) * size);
+        complete = ++slot.written == channels.size() && frame > completedFrame;
+    }
+    if(complete)
+    {
+        if(latestFrame.size() != slot.features.size()) latestFrame.resize(slot.features.size());
+        memcpy(latestFrame.data(), slot.features.constData(), sizeof(float) * slot.features.size());
+        // フレームの時刻は最後に書き終えたチャンネルのもの
+        completedFrame = frame;
+        completedArrival = c->arrival;
+        completedReady = ready;
+    }
+    frameLock.unlock();
+    if(complete && framePending.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "takeFrame", Qt::QueuedConnection);
+}
+
+void AIFActiveAcousticSensor::takeFrame()
+{
+    framePending.store(0);
+    QMutexLocker locker(&frameLock);
+    // 前に発行したベクトル(受け取った側がまだ持っているかもしれない)とは別の領域に、要素をコピーする
+    // 2つの領域を交互に使うので、受け取った側が次のフレームまでに手放していれば確保もデタッチも起きない
+    data.swap(spareData);
+    if(data.size() != latestFrame.size()) data.resize(latestFrame.size());
+    memcpy(data.data(), latestFrame.constData(), sizeof(float) * latestFrame.size());
+    channelFeatureSize = channels.isEmpty() ? 0 : latestFrame.size() / channels.size();
+    dataFrame = completedFrame;
+    dataArrival = completedArrival;
+    dataReady = completedReady;
+}
+
+void AIFActiveAcousticSensor::updateData()
+{
+    // 同じフレームを再び発行するとき(タイマの間に新しいフレームがなかった)は、遅延を数えない
+    if(dataFrame >= 0 && dataFrame != emittedFrame)
+    {
+        emittedFrame = dataFrame;
+        LatencyProbe::instance()->frameEmitted(dataArrival, dataReady);
     }
-    
-    // 読み込んだデータ(この時点ではまだ時間領域)にハミング窓を掛けて不連続性を軽減し(http://www.logical-arts.jp/?p=124)、これをfftして周波数領域(パワースペクトル)に変換。
-    // この中から必要な周波数レンジのデータのみをmidを用いて取り出す(コピー操作であることに注意)。第1引数は取り出し開始位置、第2引数はそこからの幅
-    //QVector<float> rawData = fft(hamming(senseBuffer)).mid(hz2idx(20000), hz2idx(40000)-hz2idx(20000));
-    QVector<float> rawData = fft(hamming(senseBuffer)).mid(hz2idx(_min_Hz), hz2idx(_max_Hz)-hz2idx(_min_Hz));
-    
-    // パワースペクトルの次元を1/2に削減してからローパスフィルタを掛け、これを加工済みデータとする
-    data = lowpass(reduce(rawData,2));
+    emit senseDataChanged(data);
+    if(channels.size() > 1)
+    {
+        for(int k = 0; k < channels.size(); k++) emit channelDataChanged(k, getChannelData(k));
+    }
+}
+
+QVector<float> AIFActiveAcousticSensor::getChannelData(int index) const
+{
+    if(index < 0 || channelFeatureSize == 0 || (index + 1) * channelFeatureSize > data.size()) return QVector<float>();
+    return data.mid(index * channelFeatureSize, channelFeatureSize);
+}
+
+
+// フレームの切り出し間隔(サンプル数)を設定。0以下ならオーバーラップなし
+void AIFActiveAcousticSensor::setHop(int hop)
+{
+    requestedHop.store(hop <= 0 ? frame_width : qMin(hop, frame_width));
+}
+
+// 窓関数を切り替える。betaはKaiser窓のときのみ使われる
+void AIFActiveAcousticSensor::setWindow(WindowType type, float beta)
+{
+    QMutexLocker locker(&settingsLock);
+    windowType = type;
+    windowBeta = beta;
+    settingsVersion.fetchAndAddOrdered(1);
+}
+
+// スペクトルの求め方と帯域内の分解能を切り替える
+void AIFActiveAcousticSensor::setSpectralMode(FeaturePipeline::SpectralMode mode, int bins)
+{
+    QMutexLocker locker(&settingsLock);
+    spectralMode = mode;
+    bandBins = bins;
+    settingsVersion.fetchAndAddOrdered(1);
+}
+
+// 特徴の種類を切り替える
+void AIFActiveAcousticSensor::setFeatureMode(FeaturePipeline::FeatureMode mode, int size)
+{
+    QMutexLocker locker(&settingsLock);
+    featureMode = mode;
+    featureModeSize = size;
+    settingsVersion.fetchAndAddOrdered(1);
+}
+
+// スイープの波形と帯域を切り替える。新しい波形の生成はこのスレッドで行い、オーディオスレッドは周期の継ぎ目で差し替えるだけ
+void AIFActiveAcousticSensor::setSweep(ProbeWaveform type, int min_Hz, int max_Hz, int duration_ms)
+{
+    sweepGenerator->setWaveform(type, min_Hz, max_Hz, duration_ms);
+    _min_Hz = min_Hz;
+    _max_Hz = max_Hz;
+
+    QMutexLocker locker(&settingsLock);
+    bandMinHz = min_Hz;
+    bandMaxHz = max_Hz;
+    settingsVersion.fetchAndAddOrdered(1);
+}
+
+// スイープ同期のフレーム切り出しと同期加算の回数を切り替える
+void AIFActiveAcousticSensor::setSweepSync(bool enable, int averages)
+{
+    QMutexLocker locker(&settingsLock);
+    syncEnabled = enable;
+    syncAverages = qMax(1, averages);
+    settingsVersion.fetchAndAddOrdered(1);
+}
+
+int AIFActiveAcousticSensor::sweepOffset(int index) const
+{
+    if(index < 0 || index >= channels.size()) return -1;
+    // SweepFramerはDSPスレッドが書き換えているので、DSPスレッドが処理の区切りで書いた値を読む
+    return channels[index]->syncOffset.load();
+}
+
+// FFTプランの最適化レベルを切り替える
+void AIFActiveAcousticSensor::setPlanMode(FFTEngine::PlanMode mode)
+{
+    QMutexLocker locker(&settingsLock);
+    planMode = mode;
+    settingsVersion.fetchAndAddOrdered(1);
+}
+
+// フレーム間のオーバーラップ率(0以上1未満)を設定
+void AIFActiveAcousticSensor::setOverlap(float overlap)
+{
+    overlap = qBound(0.f, overlap, 0.99f);
+    setHop(qMax(1, (int)(frame_width * (1 - overlap) + 0.5f)));
 }
 
 
@@ -312,6 +835,366 @@ void AIFActiveAcousticSensor::setVolume(int value)
 #endif
 
 
+/*====================================================================================================================================================================================================================================================================================*/
+// ファイル再生版AAS
+
+ReplayActiveAcousticSensor::ReplayActiveAcousticSensor(QString fileName, QObject *parent)
+    : ActiveAcousticSensor(parent)
+    , fileName(fileName)
+    , dataOffset(0)
+    , dataSize(0)
+    , rate(96000)
+    , channels(2)
+    , rawRate(96000)
+    , rawChannels(2)
+    , channel(1)
+    , pacing(REALTIME)
+    , speed(1.0)
+    , hop(960)
+    , frame_width(3840)
+    , _min_Hz(20000)
+    , _max_Hz(40000)
+    , thread(this)
+    , externalWake(NULL)
+    , started(0)
+    , stopRequested(0)
+    , remaining(0)
+    , consumed(0)
+    , frames(0)
+    , elapsedNs(0)
+    , readNs(0)
+    , framingNs(0)
+    , publishNs(0)
+    , done(0)
+    , completedFrame(-1)
+    , framePending(0)
+{
+    // senseDataChangedを他のスレッドの受け取り側へキューイング接続で送るため
+    qRegisterMetaType<QVector<float> >("QVector<float>");
+}
+
+ReplayActiveAcousticSensor::~ReplayActiveAcousticSensor()
+{
+    stop();
+}
+
+bool ReplayActiveAcousticSensor::setRawFormat(int sampleRate, int channelCount)
+{
+    if(sampleRate <= 0 || channelCount <= 0) return false;
+    rawRate = sampleRate;
+    rawChannels = channelCount;
+    return true;
+}
+
+// WAVならヘッダを読んでフォーマットとデータ部の位置を得る。それ以外はraw PCMとして扱う
+bool ReplayActiveAcousticSensor::openFile(QString *error)
+{
+    file.setFileName(fileName);
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        *error = file.errorString();
+        return false;
+    }
+
+    rate = rawRate;
+    channels = rawChannels;
+    dataOffset = 0;
+    dataSize = file.size();
+    if(!fileName.endsWith(".wav", Qt::CaseInsensitive)) return true;
+
+    QByteArray riff = file.read(12);
+    if(riff.size() < 12 || !riff.startsWith("RIFF") || riff.mid(8, 4) != "WAVE")
+    {
+        *error = "not a RIFF/WAVE file.";
+        return false;
+    }
+    bool hasFormat = false;
+    while(!file.atEnd())
+    {
+        QByteArray header = file.read(8);
+        if(header.size() < 8) break;
+        const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+        quint32 size = qFromLittleEndian<quint32>(h + 4);
+        if(header.startsWith("fmt "))
+        {
+            QByteArray fmt = file.read(size);
+            const uchar *f = reinterpret_cast<const uchar *>(fmt.constData());
+            if(fmt.size() < 16)
+            {
+                *error = "broken fmt chunk.";
+                return false;
+            }
+            quint16 tag = qFromLittleEndian<quint16>(f);
+            channels = qFromLittleEndian<quint16>(f + 2);
+            rate = qFromLittleEndian<quint32>(f + 4);
+            quint16 blockAlign = qFromLittleEndian<quint16>(f + 12);
+            quint16 bits = qFromLittleEndian<quint16>(f + 14);
+            // 1: PCM, 0xFFFE: WAVE_FORMAT_EXTENSIBLE
+            if((tag != 1 && tag != 0xFFFE) || bits != 16)
+            {
+                *error = "only 16bit PCM is supported.";
+                return false;
+            }
+            // 以降はチャンネル数で割り、周波数で時刻を求めるので、壊れたヘッダはここで弾く
+            if(channels <= 0 || rate <= 0 || blockAlign != 2 * channels)
+            {
+                *error = "broken fmt chunk.";
+                return false;
+            }
+            hasFormat = true;
+        }
+        else if(header.startsWith("data"))
+        {
+            dataOffset = file.pos();
+            dataSize = qMin((qint64)size, file.size() - dataOffset);
+            if(!hasFormat) *error = "data chunk before fmt chunk.";
+            return hasFormat;
+        }
+        else
+        {
+            file.seek(file.pos() + size);
+        }
+        // チャンクは2バイト境界に揃えられている
+        if(size & 1) file.seek(file.pos() + 1);
+    }
+    *error = "no data chunk.";
+    return false;
+}
+
+QString ReplayActiveAcousticSensor::start()
+{
+    if(thread.isRunning() || started.load()) return "OK";
+
+    QString error;
+    if(!openFile(&error))
+    {
+        file.close();
+        return error;
+    }
+    if(channel < 0 || channel >= channels) channel = channels - 1;
+
+    // AIF版と同じ設定でフレーム切り出しと特徴抽出を行う
+    framer.setup(frame_width, hop);
+    senseBuffer.resize(frame_width);
+    pipeline.configure(frame_width, rate, _min_Hz, _max_Hz);
+    feature.resize(pipeline.featureSize());
+    pipeline.resetProfile();
+    pipeline.setProfiling(true);
+
+    const int BLOCK = 4096; // 1回に読むフレーム(全チャンネル分のサンプル組)の数
+    raw.resize(BLOCK * 2 * channels);
+    samples.resize(BLOCK);
+    file.seek(dataOffset);
+    remaining = dataSize;
+    consumed.store(0);
+
+    frames.store(0);
+    elapsedNs.store(0);
+    readNs = framingNs = publishNs = 0;
+    done.store(0);
+    frameLock.lock();
+    completedFrame = -1;
+    frameLock.unlock();
+    stopRequested.store(0);
+    paced.tryAcquire(paced.available());
+    started.store(1);
+    total.start();
+    if(externalWake)
+    {
+        externalWake->release(); // 以降はワーカープールがrunWork()で進める
+        if(pacing != AS_FAST_AS_POSSIBLE) thread.start();
+    }
+    else
+    {
+        thread.start();
+    }
+    return "OK";
+}
+
+void ReplayActiveAcousticSensor::stop()
+{
+    stopRequested.store(1);
+    paced.release();
+    thread.wait();
+    // ワーカープールから再生していた場合(呼び出し側はrunWork()を止めてから呼ぶ)
+    if(started.load()) finish();
+    file.close();
+}
+
+void ReplayThread::run()
+{
+    if(sensor->externalWake)
+        sensor->pace();
+    else
+        sensor->replay();
+}
+
+qint64 ReplayActiveAcousticSensor::targetTime() const
+{
+    double rateScale = pacing == SPEED && speed > 0 ? speed : 1.0;
+    return (qint64)(consumed.load() * 1e9 / rate / rateScale);
+}
+
+// 再生スレッドで実行される
+void ReplayActiveAcousticSensor::replay()
+{
+    while(!stopRequested.load() && replayBlock()) {}
+    finish();
+}
+
+void ReplayActiveAcousticSensor::pace()
+{
+    while(!stopRequested.load() && started.load())
+    {
+        qint64 ahead = targetTime() - total.nsecsElapsed();
+        if(ahead > 0)
+        {
+            // 次のブロックの時刻まで眠る(stop()か、先にブロックが処理されたら起きて測り直す)
+            paced.tryAcquire(1, (int)((ahead + 999999) / 1000000));
+            continue;
+        }
+        // 次のブロックの時刻になったので1回だけ起こし、処理が終わるまで待つ
+        externalWake->release();
+        paced.acquire();
+    }
+}
+
+bool ReplayActiveAcousticSensor::hasWork(int index) const
+{
+    Q_UNUSED(index);
+    if(!started.load()) return false;
+    // 録音時の時刻(をspeed倍したもの)に達するまでは次のブロックを処理しない
+    return pacing == AS_FAST_AS_POSSIBLE || total.nsecsElapsed() >= targetTime();
+}
+
+void ReplayActiveAcousticSensor::runWork(int index)
+{
+    Q_UNUSED(index);
+    if(!started.load()) return;
+    if(stopRequested.load() || !replayBlock())
+    {
+        finish();
+        file.close();
+    }
+    if(pacing != AS_FAST_AS_POSSIBLE) paced.release();
+}
+
+// 1ブロック分を読み込み、フレームに切り出して特徴抽出する
+bool ReplayActiveAcousticSensor::replayBlock()
+{
+    int bytesPerFrame = 2 * channels;
+    if(remaining < bytesPerFrame) return false;
+
+    QElapsedTimer lap;
+    lap.start();
+    qint64 len = file.read(raw.data(), qMin((qint64)raw.size(), remaining - remaining % bytesPerFrame));
+    if(len < bytesPerFrame) return false;
+    remaining -= len;
+    int n = len / bytesPerFrame;
+    const uchar *p = reinterpret_cast<const uchar *>(raw.constData()) + 2 * channel;
+    for(int i = 0; i < n; i++)
+    {
+        // AIF版(CaptureDevice)と同じスケーリング
+        samples[i] = qFromLittleEndian<qint16>(p + i * bytesPerFrame)/(float)SHRT_MAX*10;
+    }
+    readNs += lap.nsecsElapsed();
+
+    const float *s = samples.constData();
+    while(n > 0)
+    {
+        lap.start();
+        int used = framer.write(s, n);
+        s += used;
+        n -= used;
+        consumed.fetchAndAddRelaxed(used);
+        if(!framer.frameReady())
+        {
+            framingNs += lap.nsecsElapsed();
+            continue;
+        }
+        framer.read(senseBuffer.data());
+        framingNs += lap.nsecsElapsed();
+
+        pipeline.process(senseBuffer.constData(), feature.data());
+        frames.fetchAndAddRelaxed(1);
+
+        lap.start();
+        publish();
+        publishNs += lap.nsecsElapsed();
+
+        // 録音時の時刻(をspeed倍したもの)に追いつくまで待つ(ワーカープールではhasWork()で待つのでここでは待たない)
+        if(pacing != AS_FAST_AS_POSSIBLE && !externalWake)
+        {
+            qint64 ahead = targetTime() - total.nsecsElapsed();
+            if(ahead > 1000) QThread::usleep(ahead / 1000);
+        }
+    }
+    return true;
+}
+
+void ReplayActiveAcousticSensor::finish()
+{
+    elapsedNs.store(total.nsecsElapsed());
+    done.storeRelease(1);
+    started.store(0);
+
+    qDebug().noquote() << summary();
+    emit finished();
+}
+
+qint64 ReplayActiveAcousticSensor::copyLatestFrame(QVector<float> &dst)
+{
+    QMutexLocker locker(&frameLock);
+    if(completedFrame < 0) return -1;
+    if(dst.size() != latestFrame.size()) dst.resize(latestFrame.size());
+    memcpy(dst.data(), latestFrame.constData(), sizeof(float) * latestFrame.size());
+    return completedFrame;
+}
+
+// 特徴ベクトルを渡す。senseDataChangedはGUIスレッドのtakeFrame()から発行する
+// (再生スレッドから直接発行すると、受け取り側とfeatureを共有して次のフレームで上書きしてしまう)
+void ReplayActiveAcousticSensor::publish()
+{
+    frameLock.lock();
+    if(latestFrame.size() != feature.size()) latestFrame.resize(feature.size());
+    memcpy(latestFrame.data(), feature.constData(), sizeof(float) * feature.size());
+    completedFrame = frames.load() - 1;
+    frameLock.unlock();
+    if(framePending.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "takeFrame", Qt::QueuedConnection);
+}
+
+void ReplayActiveAcousticSensor::takeFrame()
+{
+    framePending.store(0);
+    frameLock.lock();
+    // AIF版と同じく、前に発行したベクトルとは別の領域にコピーする
+    data.swap(spareData);
+    if(data.size() != latestFrame.size()) data.resize(latestFrame.size());
+    memcpy(data.data(), latestFrame.constData(), sizeof(float) * latestFrame.size());
+    frameLock.unlock();
+    emit senseDataChanged(data);
+}
+
+QString ReplayActiveAcousticSensor::summary() const
+{
+    QString s;
+    s += QString("replay: %1 frames in %2 s (%3 frames/s)\n")
+            .arg(framesProcessed()).arg(elapsedSeconds(), 0, 'f', 3).arg(framesPerSecond(), 0, 'f', 1);
+    qint64 n = qMax((qint64)1, framesProcessed());
+    s += QString("  %1: %2 us/frame\n").arg("read", -12).arg(readNs / 1e3 / n, 0, 'f', 2);
+    s += QString("  %1: %2 us/frame\n").arg("framing", -12).arg(framingNs / 1e3 / n, 0, 'f', 2);
+    for(int i = 0; i < FeaturePipeline::STAGE_COUNT; i++)
+    {
+        FeaturePipeline::Stage stage = (FeaturePipeline::Stage)i;
+        s += QString("  %1: %2 us/frame\n").arg(FeaturePipeline::stageName(stage), -12)
+                .arg(pipeline.stageNanoseconds(stage) / 1e3 / n, 0, 'f', 2);
+    }
+    s += QString("  %1: %2 us/frame").arg("publish", -12).arg(publishNs / 1e3 / n, 0, 'f', 2);
+    return s;
+}
+
+
 /*====================================================================================================================================================================================================================================================================================*/
 // シリアル通信版AAS(USB/Bluetooth版)
 // 本AIF版において以下のコードは使用されていないと考えられる
@@ -421,7 +1304,8 @@ void SerialActiveAcousticSensor::readData()
         }
         // 生データにローパスを掛けて、加工済みデータdata(QVector<float>型)とする。
         // dataはその瞬間(フレーム)の特徴ベクトルであり、スイープの段階分の次元を持つ
-        data = lowpass(ldata,2);
+        lowpass(ldata.data(), ldata.size(), 2);
+        data = ldata;
         
         // 前のフレームの特徴ベクトルが今回の物と同じサイズならば…何をしている？
         if(previousVector.size() == data.size())
@@ -11,12 +11,18 @@
 #ifdef AIF
 #include <QtMultimedia>
 #include <fftw3.h>
+#include "ringbuffer.h"
 #endif
-#include <QInputDialog>
-#include <QSlider>
+#include "dsp.h"
+#include "featurepipeline.h"
+#include "latencyprobe.h"
 #include <QThread>
+#include <QSemaphore>
+#include <QMutex>
 #include <math.h>
 #include <QTimer>
+#include <QFile>
+#include <QElapsedTimer>
 
 
 // AIF版とシリアル(USB/Bluetooth)版の基底クラス
@@ -37,6 +43,20 @@ public slots:
     virtual void calib() = 0;
     QVector<float> getData() { return data; }
 
+public:
+    // ワーカープール(SensorManager)から特徴抽出を行うためのインターフェース
+    // setExternalWake()でセマフォを渡すと、start()後も自前のDSPスレッドを動かさず、処理すべきデータが届くたびにそのセマフォをreleaseする
+    // 呼び出し側はworkCount()個の独立した仕事(AIF版は選択したチャンネルごと)のうち、hasWork()が真のものをrunWork()で処理する
+    // 同じ番号のrunWork()を同時に呼んではいけない。既定の実装(シリアル版)は仕事を持たず、特徴ベクトルはsenseDataChangedで届く
+    // setExternalWake()は停止中に呼ぶこと(NULLで自前のスレッドに戻す)
+    virtual void setExternalWake(QSemaphore *wake) { Q_UNUSED(wake); }
+    virtual int workCount() const { return 0; }
+    virtual bool hasWork(int index) const { Q_UNUSED(index); return false; }
+    virtual void runWork(int index) { Q_UNUSED(index); }
+    // DSP側で最後に完成したフレームの特徴ベクトルをdstにコピーし、その通し番号を返す(まだなければ-1)
+    // dstの大きさが同じなら確保し直さない。どのスレッドから呼んでもよい
+    virtual qint64 copyLatestFrame(QVector<float> &dst) { Q_UNUSED(dst); return -1; }
+
 protected:
     QVector<float> data;
 
@@ -47,11 +67,14 @@ protected:
 // AIF版ならば
 #ifdef AIF
 // スイープジェネレートをソフト側で行う
+// 1周期分の波形を事前に生成し、2周期分つなげたPCMから読み出すので、readData()は通常1回のmemcpyで済む
+// 波形と周波数帯域は出力中でも変更でき、新しい周期は別のバッファに生成してから周期の継ぎ目で差し替える
 class SweepGenerator : public QIODevice
 {
     Q_OBJECT
 public:
-    SweepGenerator(const QAudioFormat &format, int min_Hz, int max_Hz, int duration_ms, QObject *parent);
+    SweepGenerator(const QAudioFormat &format, int min_Hz, int max_Hz, int duration_ms, QObject *parent = NULL);
+    ~SweepGenerator();
 
     void start();
     void stop();
@@ -59,22 +82,163 @@ public:
     qint64 writeData(const char *data, qint64 len);
     qint64 bytesAvailable() const;
 
-public:
-    qint64 max_sample;
+    // 波形と周波数帯域・周期を変更する(どのスレッドから呼んでもよい)
+    // 波形の生成は呼んだスレッドで行い、オーディオスレッドは出力中の周期が終わったところでポインタを差し替えるだけ(QAudioOutputは止めない)
+    void setWaveform(ProbeWaveform type, int min_Hz, int max_Hz, int duration_ms);
+    // 最後に設定した波形の1周期分(振幅±1)とその設定
+    QVector<float> waveform() const;
+    ProbeWaveform waveformType() const;
+    int minHz() const;
+    int maxHz() const;
+    // 1周期のサンプル数(MLSでは2^m-1)
+    int periodSamples() const;
 
 private:
-    void generateData(const QAudioFormat &format, int min_Hz, int max_Hz, int duration_ms);
+    // 1周期分の波形と、それを2周期分並べたPCM
+    struct Period
+    {
+        ProbeWaveform type;
+        int minHz, maxHz;
+        QVector<float> wave;
+        QByteArray pcm;
+        qint64 periodBytes;
+    };
+    Period *render(ProbeWaveform type, int min_Hz, int max_Hz, int duration_ms) const;
+    // 差し替え待ちの周期があれば差し替える(オーディオスレッド。確保も解放もしない)
+    void swapPeriod();
 
 private:
     QAudioFormat m_format;
-    qint64 m_pos;
-    QByteArray m_buffer;
+    qint64 m_pos;                   // current->pcm上の読み出し位置 (0 <= m_pos < periodBytes)
+    Period *current;                // 出力中の周期(オーディオスレッドのみが触る)
+    QAtomicPointer<Period> next;    // 差し替え待ちの周期
+    QAtomicPointer<Period> retired; // 差し替えで外れた周期。解放はsetWaveform()とデストラクタで行う
+    mutable QMutex infoLock;        // 以下は最後に設定した波形の情報
+    Period info;
+};
+
+// 入力デバイスから書き込まれたインターリーブのPCMを、使用するチャンネルごとにfloatに変換してそれぞれのリングバッファに積む
+// QAudioInputのプッシュモードの書き込み先として使い、オーディオスレッド上で呼ばれる
+// 全チャンネルのリングバッファには常に同じ数のサンプルを積む(満杯のときは全チャンネルで同じだけ捨てる)ので、
+// チャンネル間でフレームの時刻がずれない
+class CaptureDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    CaptureDevice(QObject *parent = 0);
+
+    // 入力のチャンネル数を設定し、出力先を全て外す
+    void setChannelCount(int channelCount);
+    // 入力チャンネルinput(0が1ch)のサンプルをringに積み、積むたびにreadyをreleaseする
+    // オーディオスレッドの停止中にのみ呼ぶこと
+    void addChannel(int input, RingBuffer<float> *ring, QSemaphore *ready);
+    qint64 readData(char *data, qint64 maxlen);
+    qint64 writeData(const char *data, qint64 len);
+
+    // リングバッファが満杯で捨てたサンプル数(1チャンネルあたり)
+    int overruns() const { return overrunCount.load(); }
+    void resetOverruns() { overrunCount.store(0); }
+    // 最後にwriteData()が呼ばれた時刻(LatencyProbe::now())。リングバッファから取り出した後に読めば、取り出したサンプル以降の到着時刻になる
+    qint64 lastArrival() const { return arrivalTime.load(); }
+
+private:
+    void flush();
+
+private:
+    static const int CHUNK = 512;
+    QVector<RingBuffer<float> *> rings;
+    QVector<QSemaphore *> readies;
+    QVector<int> slotOf;    // 入力チャンネル -> 出力先の番号(-1は使用しない)
+    QVector<float> scratch; // 出力先ごとにCHUNK点の変換済みサンプル
+    int pending;            // scratchに溜まっている(全チャンネル揃った)サンプル数
+    QAtomicInt overrunCount;
+    QAtomicInteger<qint64> arrivalTime;
+    int channelCount;
+    int count;              // 次のサンプルの入力チャンネル
+    // コールバックの境界で分断された16bitサンプルの下位バイト
+    bool hasCarry;
+    char carry;
+};
+
+// QAudioInput/QAudioOutputを所有するオーディオスレッド
+// GUIスレッドの再描画やSVM学習で入出力が止まらないように、デバイスはこのスレッドの中で生成して動かす
+class AudioThread : public QThread
+{
+    Q_OBJECT
+public:
+    AudioThread(QObject *parent = 0) : QThread(parent), sink(NULL), sweep(NULL) {}
+
+    void setup(const QAudioDeviceInfo &inputDevice, const QAudioDeviceInfo &outputDevice, const QAudioFormat &format,
+               CaptureDevice *sink, SweepGenerator *sweep);
+
+protected:
+    void run();
+
+private:
+    QAudioDeviceInfo inputDevice, outputDevice;
+    QAudioFormat format;
+    CaptureDevice *sink;
+    SweepGenerator *sweep;
+};
+
+class AIFActiveAcousticSensor;
+
+// リングバッファからサンプルを取り出して特徴ベクトルを計算するDSPスレッド(選択したチャンネルごとに1本)
+class FeatureThread : public QThread
+{
+    Q_OBJECT
+public:
+    FeatureThread(AIFActiveAcousticSensor *sensor, int channel, QSemaphore *ready, QObject *parent = 0)
+        : QThread(parent), sensor(sensor), channel(channel), ready(ready) {}
+
+protected:
+    void run();
+
+private:
+    AIFActiveAcousticSensor *sensor;
+    int channel;
+    QSemaphore *ready;
+};
+
+// 選択した入力チャンネル1つ分の処理系
+// オーディオスレッド -> DSPスレッドの受け渡しと、フレーム切り出し・特徴抽出をチャンネルごとに独立に持つ
+struct SenseChannel
+{
+    SenseChannel(AIFActiveAcousticSensor *sensor, int index, int input)
+        : input(input)
+        , ring(1 << 17) // 96kHzで約1.3秒分
+        , sync(false)
+        , seenOverruns(0)
+        , syncOffset(-1)
+        , frameIndex(0)
+        , arrival(-1)
+        , settingsVersion(-1)
+        , thread(sensor, index, &ready)
+    {
+    }
+
+    int input;                // 入力デバイス上のチャンネル番号(0が1ch)
+    RingBuffer<float> ring;
+    QSemaphore ready;
+    // 以下はこのチャンネルのDSPスレッドのみが触る
+    STFTFramer framer;
+    FeaturePipeline pipeline;
+    QVector<float> senseBuffer, feature;
+    SweepFramer sweepFramer;  // スイープ同期のフレーム切り出し(syncのとき)
+    bool sync;
+    int seenOverruns;
+    QAtomicInt syncOffset;    // スイープ同期で測った遅延(同期していなければ-1)。DSPスレッドが書き、GUIスレッドが読む
+    qint64 frameIndex;        // 処理したフレーム数
+    qint64 arrival;           // 処理中のフレームの最後のサンプルの到着時刻(遅延の計測用)
+    int settingsVersion;      // pipelineに反映済みの設定の版
+    FeatureThread thread;
 };
 
 // AIF版 (AAS継承)
 class AIFActiveAcousticSensor : public ActiveAcousticSensor
 {
     Q_OBJECT
+    friend class FeatureThread;
 public:
     AIFActiveAcousticSensor(QString inputDeviceName, QString outputDeviceName, QObject *parent = 0);
     ~AIFActiveAcousticSensor();
@@ -85,25 +249,124 @@ public slots:
     void setVolume(int value);
     void calib() {}
 
+public:
+    // FFTプランの最適化レベルを切り替える(次フレームでプランを作り直す)
+    void setPlanMode(FFTEngine::PlanMode mode);
+
+    // リングバッファの状態(どのスレッドから呼んでもよい)。複数チャンネルでは最も溜まっているチャンネルの値
+    int ringOccupancy() const;
+    int ringCapacity() const;
+    int ringOverruns() const { return sink->overruns(); }
+
+    // STFTのホップ幅(サンプル数)とオーバーラップ率。どちらか一方を設定すればよい
+    void setHop(int hop);
+    void setOverlap(float overlap);
+    int hop() const { return requestedHop.load(); }
+
+    // 分析窓の種類(ハミング/ハン/ブラックマン・ハリス/カイザー)。次のフレームから反映される
+    void setWindow(WindowType type, float beta = 8.6f);
+    // スペクトルの求め方(全体FFT/帯域限定解析)と帯域内の分解能。bandBinsを変えると特徴ベクトルの次元も変わる
+    void setSpectralMode(FeaturePipeline::SpectralMode mode, int bandBins = 0);
+    // 特徴の種類(スペクトル/インパルス応答/伝達関数)。IMPULSE/TRANSFERは出力中のスイープとの整合フィルタで求め、
+    // sizeが1チャンネルあたりの特徴ベクトルの次元になる。フレーム幅(既定3840点)はスイープ周期(既定1920点)の倍数であること
+    // (スイープ同期を有効にすれば常に1周期になる)
+    void setFeatureMode(FeaturePipeline::FeatureMode mode, int size = 64);
+
+    // 出力するプローブ信号と周波数帯域を変更する。出力は止めずに次の周期から切り替わり、
+    // 特徴抽出の帯域も次のフレームから追従する(特徴ベクトルの次元が変わるので識別器は学習し直すこと)
+    void setSweep(ProbeWaveform type, int min_Hz, int max_Hz, int duration_ms = 20);
+    SweepGenerator *sweep() const { return sweepGenerator; }
+
+    // スイープ同期のフレーム切り出し
+    // 有効にすると、出力したスイープとの相互相関で再生から録音までの遅延をチャンネルごとに測り、
+    // STFTの代わりにスイープの周期(既定20ms)の先頭に揃えて1周期ずつ切り出す(フレーム幅が周期になるので特徴ベクトルの次元も変わる)
+    // averagesが2以上なら直近averages周期を同期加算平均してからFFTする。ホップ幅の設定は使われない
+    void setSweepSync(bool enable, int averages = 1);
+    // index番目のチャンネルで測定した遅延[サンプル]。同期していなければ-1
+    int sweepOffset(int index) const;
+
+    // 特徴を求める入力チャンネル(0が1ch)。既定は{1}(2ch目のみ)
+    // 複数選ぶとチャンネルごとのDSPスレッドで並列に処理し、dataは選んだ順に各チャンネルの特徴ベクトルを連結したものになる
+    // (SVMClassifierはこの連結したベクトルをそのまま学習・識別に使える)。動作中に呼ぶと入出力を再起動する
+    // 入力デバイスに無いチャンネルは使わず、1つも残らなければ既定のチャンネル(モノラルの入力なら1ch目)を使う。
+    // そのときは表示用のメッセージを、全て使えれば"OK"を返す
+    QString setInputChannels(QList<int> inputs);
+    QList<int> inputChannels() const;
+    int channelCount() const { return channels.size(); }
+    // dataのうちindex番目(setInputChannelsで選んだ順)のチャンネルの部分
+    QVector<float> getChannelData(int index) const;
+
+    // ワーカープールからの特徴抽出(仕事はチャンネルごと)
+    void setExternalWake(QSemaphore *wake);
+    int workCount() const { return channels.size(); }
+    bool hasWork(int index) const { return channels[index]->ring.size() > 0; }
+    void runWork(int index) { readData(index); }
+    qint64 copyLatestFrame(QVector<float> &dst);
+
+signals:
+    // senseDataChangedと同時に、チャンネルごとの特徴ベクトルを通知する
+    void channelDataChanged(int index, QVector<float> data);
+
 private slots:
-    void readData();
-    void updateData() { emit senseDataChanged(data); }
+    // DSPスレッドで計算された最新の特徴ベクトルをGUIスレッド側のdataに取り込む
+    void takeFrame();
+    void updateData();
 private:
-    // 周波数からインデックスに変換
-    inline int hz2idx(int hz)
-    {
-        return (frame_width/2 * (hz/(float)(format.sampleRate()/2)));
-    }
+    // setInputChannels()の本体(戻り値も同じ)
+    QString buildChannels(QList<int> inputs);
+    // index番目のチャンネルのリングバッファに溜まったサンプルを処理する(そのチャンネルのDSPスレッドから呼ばれる)
+    void readData(int index);
+    void applySettings(SenseChannel *c);
+    void processFrame(int index);
+    // フレームの組み立て場所を空にする(frameLockを取ってから呼ぶ)
+    void resetFrameSlots();
 
 private:
     QTimer t;
-    QVector<float> senseBuffer, anotherBuffer;
     int frame_width;
+    QAtomicInt requestedHop;
+    // GUIスレッドから要求された窓関数とプランモード(各DSPスレッドが次のフレームで取り込む)
+    QMutex settingsLock;
+    WindowType windowType;
+    float windowBeta;
+    FFTEngine::PlanMode planMode;
+    FeaturePipeline::SpectralMode spectralMode;
+    int bandBins;
+    FeaturePipeline::FeatureMode featureMode;
+    int featureModeSize;
+    int bandMinHz, bandMaxHz;   // 特徴抽出に使う帯域(スイープの帯域に追従する)
+    bool syncEnabled;
+    int syncAverages;
+    QAtomicInt settingsVersion; // 設定を変えるたびに増やす
     QAudioFormat format;
-    QAudioInput *input;
-    QAudioOutput *output;
-    QIODevice *inputBuffer;
+    QAudioDeviceInfo inputDevice, outputDevice;
     SweepGenerator *sweepGenerator;
+    // 選択したチャンネルごとの処理系(オーディオとDSPスレッドの停止中にのみ作り直す)
+    QList<SenseChannel *> channels;
+    QSemaphore *externalWake; // NULLでなければDSPスレッドの代わりにこれを起こす
+    CaptureDevice *sink;
+    AudioThread audioThread;
+    // DSPスレッド -> GUIスレッドの特徴ベクトル受け渡し
+    // latestFrameは全チャンネルの特徴ベクトルを連結したもの。全チャンネルが同じフレームを書き終えたときにGUIへ通知する
+    // 各チャンネルはフレーム番号 % FRAME_SLOTS 番の組み立て場所に書き、全チャンネルがそろった組み立て場所だけをlatestFrameへ写す
+    // (先に進んだチャンネルは次の組み立て場所に書くので、latestFrameに別のフレームが混ざらない)
+    struct FrameSlot
+    {
+        qint64 frame;           // 組み立て中のフレーム番号(-1は空)
+        int written;            // 書き終えたチャンネル数
+        QVector<float> features;
+    };
+    static const int FRAME_SLOTS = 4;
+    QMutex frameLock;
+    QVector<float> latestFrame;
+    FrameSlot frameSlots[FRAME_SLOTS];
+    QVector<float> spareData;       // dataと交互に使う受け取り先(GUIスレッド)
+    qint64 completedFrame;          // 全チャンネルが書き終えた最新のフレーム番号
+    qint64 completedArrival, completedReady; // そのフレームの到着時刻と、特徴ベクトルが揃った時刻(LatencyProbe)
+    int channelFeatureSize;         // dataの1チャンネルあたりの次元(GUIスレッド)
+    // dataのフレーム番号と時刻、最後にsenseDataChangedで発行したフレーム番号(GUIスレッド)
+    qint64 dataFrame, dataArrival, dataReady, emittedFrame;
+    QAtomicInt framePending;
     // 周波数レンジがハードコーディングされていたので変数を追加
     int _min_Hz;
     int _max_Hz;
@@ -111,6 +374,135 @@ private:
 #endif
 
 
+/*====================================================================================================================================================================================================================================================================================*/
+// ファイル再生版 (AAS継承)
+// 16bitインターリーブのWAV/raw PCMを読み込み、AIF版と同じフレーム切り出しと特徴抽出(FeaturePipeline)を通す。
+// サウンドカードのない環境でのプロファイルや、録音済みセッションを使った回帰テストに使う
+class ReplayActiveAcousticSensor;
+
+class ReplayThread : public QThread
+{
+    Q_OBJECT
+public:
+    ReplayThread(ReplayActiveAcousticSensor *sensor, QObject *parent = 0) : QThread(parent), sensor(sensor) {}
+
+protected:
+    void run();
+
+private:
+    ReplayActiveAcousticSensor *sensor;
+};
+
+class ReplayActiveAcousticSensor : public ActiveAcousticSensor
+{
+    Q_OBJECT
+    friend class ReplayThread;
+public:
+    // 再生速度
+    enum Pacing {
+        REALTIME,       // 録音時と同じ速さ
+        SPEED,          // speed倍の速さ
+        AS_FAST_AS_POSSIBLE
+    };
+
+    explicit ReplayActiveAcousticSensor(QString fileName, QObject *parent = 0);
+    ~ReplayActiveAcousticSensor();
+
+    // 拡張子が.wavでないファイルはヘッダ無しのraw PCMとして読む。その際のフォーマット
+    // サンプリング周波数かチャンネル数が正でなければ設定せずにfalseを返す
+    bool setRawFormat(int sampleRate, int channelCount);
+    // 使用するチャンネル(既定はAIF版と同じ2ch目 = index 1、モノラルなら0)
+    void setChannel(int ch) { channel = ch; }
+    void setPacing(Pacing mode, double speed = 1.0) { pacing = mode; this->speed = speed; }
+    void setHop(int hop) { this->hop = hop; }
+    FeaturePipeline &featurePipeline() { return pipeline; }
+
+    // 再生結果(再生中に他のスレッドから読んでよい。経過時間は終わるまで0)
+    qint64 framesProcessed() const { return frames.load(); }
+    double elapsedSeconds() const { return elapsedNs.load() / 1e9; }
+    double framesPerSecond() const { qint64 ns = elapsedNs.load(); return ns > 0 ? frames.load() / (ns / 1e9) : 0; }
+    // 段ごとの処理時間(1フレームあたりの平均, マイクロ秒)を含む概要
+    QString summary() const;
+    bool isFinished() const { return done.loadAcquire() != 0; }
+
+    // ワーカープールからの再生(仕事は1つ。runWork()は1ブロックずつ進め、ペーシングの待ちはhasWork()で表す)
+    // ペーシングする場合は再生スレッドが時計の代わりになり、次のブロックの時刻になるとセマフォをreleaseする
+    void setExternalWake(QSemaphore *wake) { externalWake = wake; }
+    int workCount() const { return 1; }
+    bool hasWork(int index) const;
+    void runWork(int index);
+    qint64 copyLatestFrame(QVector<float> &dst);
+
+signals:
+    // ファイルの終端まで再生したか、stop()された
+    void finished();
+
+public slots:
+    QString start();
+    void stop();
+    void setVolume(int value) { Q_UNUSED(value); }
+    void calib() {}
+
+private slots:
+    void takeFrame();
+
+private:
+    bool openFile(QString *error);
+    void replay();
+    // ワーカープールから再生するときに、ペーシングの時刻ごとにexternalWakeを1回起こす(再生スレッドで実行される)
+    // 起こした後はブロックの処理が終わる(paced)まで眠る。遅れているときの続きはSensorManager::runWork()が起こす
+    void pace();
+    // 1ブロック読んで処理する。終端に達したらfalse
+    bool replayBlock();
+    void finish();
+    // consumed点目を出力すべき時刻(再生開始からのns)
+    qint64 targetTime() const;
+    void publish();
+
+private:
+    QString fileName;
+    QFile file;
+    qint64 dataOffset, dataSize;
+    int rate, channels;
+    int rawRate, rawChannels;
+    int channel;
+    Pacing pacing;
+    double speed;
+    int hop;
+    int frame_width;
+    int _min_Hz, _max_Hz;
+
+    STFTFramer framer;
+    FeaturePipeline pipeline;
+    QVector<float> senseBuffer, feature;
+    ReplayThread thread;
+    QSemaphore *externalWake;
+    QSemaphore paced;         // ワーカープールでブロックを処理するか止めるたびにreleaseし、pace()を起こす
+    QAtomicInt started;       // start()からfinish()まで1
+    QAtomicInt stopRequested;
+
+    // 再生位置(再生中のスレッドのみが触る)
+    QByteArray raw;
+    QVector<float> samples;
+    qint64 remaining;
+    QAtomicInteger<qint64> consumed; // 読み込んだサンプル数(1チャンネル分)。ペーシングの判定で他のスレッドからも読む
+    QElapsedTimer total;
+
+    // 計測(frames・elapsedNs・doneは再生中のスレッドが書き、GUIスレッドが読む)
+    QAtomicInteger<qint64> frames;
+    QAtomicInteger<qint64> elapsedNs;
+    qint64 readNs, framingNs, publishNs;
+    QAtomicInt done;
+
+    // 再生スレッド -> GUIスレッドの特徴ベクトル受け渡し(AIF版と同じ)
+    QMutex frameLock;
+    QVector<float> latestFrame;
+    QVector<float> spareData;       // dataと交互に使う受け取り先(GUIスレッド)
+    qint64 completedFrame;
+    QAtomicInt framePending;
+};
+
+
 /*====================================================================================================================================================================================================================================================================================*/
 // シリアル(USB/Bluetooth)版 (AAS継承)
 // 本AIF版では未使用
@@ -0,0 +1,124 @@
+#include "alloccounter.h"
+
+#ifdef STETHOS_COUNT_ALLOCATIONS
+#include <new>
+#include <stdlib.h>
+
+// スレッドごとの計数(AllocationCounterの入れ子の深さと、数えている間の確保回数)
+static thread_local int countingDepth = 0;
+static thread_local int allocationCount = 0;
+
+static inline void countAllocation()
+{
+    if(countingDepth > 0) allocationCount++;
+}
+
+// glibcではoperator newの中のmallocで数えるので、ここでは数えない(二重に数えないため)
+static inline void countNew()
+{
+#ifndef __GLIBC__
+    countAllocation();
+#endif
+}
+
+void *operator new(std::size_t size)
+{
+    countNew();
+    void *p = malloc(size == 0 ? 1 : size);
+    if(p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t size)
+{
+    countNew();
+    void *p = malloc(size == 0 ? 1 : size);
+    if(p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    countNew();
+    return malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    countNew();
+    return malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, std::size_t) noexcept { free(p); }
+void operator delete[](void *p, std::size_t) noexcept { free(p); }
+
+#ifdef __GLIBC__
+// glibcは実行ファイルで定義したmallocを優先するので、数えてから本体(__libc_*)を呼ぶ
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    countAllocation();
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+    countAllocation();
+    return __libc_realloc(p, size);
+}
+#endif
+
+AllocationCounter::AllocationCounter()
+    : start(allocationCount)
+{
+    countingDepth++;
+}
+
+AllocationCounter::~AllocationCounter()
+{
+    countingDepth--;
+}
+
+int AllocationCounter::count() const
+{
+    return allocationCount - start;
+}
+
+bool AllocationCounter::enabled()
+{
+    return true;
+}
+
+#else
+
+AllocationCounter::AllocationCounter()
+    : start(0)
+{
+}
+
+AllocationCounter::~AllocationCounter()
+{
+}
+
+int AllocationCounter::count() const
+{
+    return 0;
+}
+
+bool AllocationCounter::enabled()
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef ALLOCCOUNTER_H
+#define ALLOCCOUNTER_H
+
+// ヒープ確保の計数(デバッグ・ベンチマーク用)
+// STETHOS_COUNT_ALLOCATIONSを定義したビルド(stethos-bench.pro)では、operator new/new[]と、glibcではmalloc/calloc/reallocを
+// 数える版に置き換え、AllocationCounterを作ったスレッドで、それが生きている間に呼ばれた回数を数える
+// (QVectorの確保・デタッチもmallocを通るので数えられる。glibc以外ではoperator newのみ)
+// 定義しないビルドでは何も置き換えず、count()は常に0になる
+class AllocationCounter
+{
+public:
+    // このスレッドで数え始める(入れ子にしてよい)
+    AllocationCounter();
+    ~AllocationCounter();
+
+    // 数え始めてからこのスレッドで発生した確保の回数
+    int count() const;
+    // 確保を実際に数えるビルドか
+    static bool enabled();
+
+private:
+    int start;
+
+    AllocationCounter(const AllocationCounter &);
+    AllocationCounter &operator=(const AllocationCounter &);
+};
+
+#endif // ALLOCCOUNTER_H
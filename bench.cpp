@@ -0,0 +1,637 @@
+// ヘッドレスベンチマーク
+// ウィジェットを使わずに、特徴抽出(DSP)と識別器の各処理、およびフレーム処理全体のスループットを計測し、
+// 結果をJSONで出力する(リリース間の性能比較用)
+//
+//   stethos-bench [-o result.json] [--replay session.wav] [--min-time 0.2]
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QTextStream>
+#include <string.h>
+#include <math.h>
+#include "activeacousticsensor.h"
+#include "featurepipeline.h"
+#include "svmclassifier.h"
+#include "linearclassifier.h"
+#include "sensormanager.h"
+#include <QTemporaryFile>
+#include <QDir>
+#include <QtEndian>
+#include <QtNumeric>
+#include <QRandomGenerator>
+
+// AIF版と同じ設定
+#define FRAME_WIDTH 3840
+#define SAMPLE_RATE 96000
+#define MIN_HZ 20000
+#define MAX_HZ 40000
+#define HOP 960
+
+static double minTime = 0.2; // 1項目あたりの最低計測時間[s]
+
+// fnを最低minTime秒繰り返し、1回あたりの平均時間を記録する
+template <typename F>
+static QJsonObject measure(const QString &name, F fn)
+{
+    fn(); // ウォームアップ
+    QElapsedTimer t;
+    qint64 iterations = 0;
+    t.start();
+    while(t.nsecsElapsed() < minTime * 1e9)
+    {
+        fn();
+        iterations++;
+    }
+    double ns = t.nsecsElapsed() / (double)iterations;
+
+    QJsonObject o;
+    o["name"] = name;
+    o["iterations"] = (double)iterations;
+    o["ns_per_op"] = ns;
+    o["ops_per_sec"] = 1e9 / ns;
+    QTextStream(stderr) << QString("%1 %2 ns/op\n").arg(name, -32).arg(ns, 0, 'f', 1);
+    return o;
+}
+
+// 1回だけ実行する処理(学習など)の時間を記録する
+static QJsonObject single(const QString &name, double ns)
+{
+    QJsonObject o;
+    o["name"] = name;
+    o["iterations"] = 1;
+    o["ns_per_op"] = ns;
+    o["ops_per_sec"] = 1e9 / ns;
+    QTextStream(stderr) << QString("%1 %2 ns/op\n").arg(name, -32).arg(ns, 0, 'f', 1);
+    return o;
+}
+
+// 合成入力: 20-40kHzのスイープ(20ms周期)に、遅延した反射と雑音を足したもの
+static QVector<float> syntheticSignal(int samples, double echo = 0.3)
+{
+    QVector<float> x(samples);
+    int period = SAMPLE_RATE / 50;
+    // 実行ごとに同じ入力になるよう、固定のシードで作る(グローバルな乱数の状態は使わない)
+    QRandomGenerator gen(1);
+    for(int i = 0; i < samples; i++)
+    {
+        double t = (i % period) / (double)SAMPLE_RATE;
+        double T = period / (double)SAMPLE_RATE;
+        double ph = 2 * M_PI * (MIN_HZ * t + (MAX_HZ - MIN_HZ) * t * t / (2 * T));
+        double td = ((i + 37) % period) / (double)SAMPLE_RATE;
+        double phd = 2 * M_PI * (MIN_HZ * td + (MAX_HZ - MIN_HZ) * td * td / (2 * T));
+        x[i] = sin(ph) + echo * sin(phd) + 0.05 * (gen.generateDouble() - 0.5);
+    }
+    return x;
+}
+
+// logMagnitude()の近似版(スカラー・SSE2・AVX2)の、exact版に対する最大の絶対誤差を求める
+// |X|は1e-3〜1e6を対数で等間隔に、位相は乱数で選ぶ。dsp.hに書いた誤差の上限(1e-6)を超えないことを確かめる
+#define LOG_MAGNITUDE_TOLERANCE 1e-6
+
+static QJsonObject logMagnitudeError()
+{
+    const int N = 1 << 16;
+    QVector<float> spectrum(2 * N);
+    QRandomGenerator gen(7);
+    for(int i = 0; i < N; i++)
+    {
+        double magnitude = pow(10.0, -3 + 9.0 * i / N);
+        double phase = 2 * M_PI * gen.generateDouble();
+        spectrum[2*i] = magnitude * cos(phase);
+        spectrum[2*i + 1] = magnitude * sin(phase);
+    }
+    const fftwf_complex *in = reinterpret_cast<const fftwf_complex *>(spectrum.constData());
+    QVector<float> exact(N), approx(N);
+    logMagnitude(in, exact.data(), N, true);
+
+    const char *names[] = { "none", "sse2", "avx2" };
+    SimdLevel supported = simdLevel();
+    QJsonObject errors;
+    bool ok = true;
+    for(int level = SIMD_NONE; level <= supported; level++)
+    {
+        limitSimdLevel((SimdLevel)level);
+        logMagnitude(in, approx.data(), N);
+        double maxError = 0;
+        for(int i = 0; i < N; i++) maxError = qMax(maxError, (double)fabs(approx[i] - exact[i]));
+        errors[names[level]] = maxError;
+        ok = ok && maxError <= LOG_MAGNITUDE_TOLERANCE;
+    }
+    limitSimdLevel(SIMD_AVX2);
+
+    QJsonObject o;
+    o["name"] = "log_magnitude_error";
+    o["max_abs_error"] = errors;
+    o["min_magnitude"] = 1e-3;
+    o["max_magnitude"] = 1e6;
+    o["tolerance"] = LOG_MAGNITUDE_TOLERANCE;
+    o["ok"] = ok;
+    QTextStream(stderr) << QString("%1 %2\n").arg("log_magnitude_error", -32).arg(ok ? "ok" : "FAILED");
+    return o;
+}
+
+static QJsonArray microBenchmarks()
+{
+    QJsonArray results;
+    QVector<float> frame = syntheticSignal(FRAME_WIDTH);
+    QVector<float> out(FRAME_WIDTH);
+
+    FFTEngine engine;
+    engine.resize(FRAME_WIDTH);
+    results.append(measure("fft", [&]() { engine.spectrum(frame.constData(), out.data()); }));
+
+    WindowTable hamming;
+    hamming.setup(WINDOW_HAMMING, FRAME_WIDTH);
+    results.append(measure("hamming", [&]() { hamming.apply(frame.constData(), out.data()); }));
+
+    engine.transform(frame.constData());
+    results.append(measure("log_magnitude_simd", [&]() { logMagnitude(engine.output(), out.data(), FRAME_WIDTH/2); }));
+    results.append(measure("log_magnitude_exact", [&]() { logMagnitude(engine.output(), out.data(), FRAME_WIDTH/2, true); }));
+    results.append(logMagnitudeError());
+
+    // 帯域内のスペクトル(次元800)に対する後処理
+    QVector<float> band(800), work(800);
+    for(int i = 0; i < band.size(); i++) band[i] = out[400 + i];
+    results.append(measure("reduce", [&]() {
+        memcpy(work.data(), band.constData(), sizeof(float) * band.size());
+        reduce(work.data(), work.size(), 2);
+    }));
+    results.append(measure("lowpass", [&]() {
+        memcpy(work.data(), band.constData(), sizeof(float) * 400);
+        lowpass(work.data(), 400, 5);
+    }));
+
+    const char *modes[] = { "pipeline_full_fft", "pipeline_band" };
+    for(int m = 0; m < 2; m++)
+    {
+        FeaturePipeline pipeline;
+        pipeline.configure(FRAME_WIDTH, SAMPLE_RATE, MIN_HZ, MAX_HZ);
+        pipeline.setSpectralMode(m == 0 ? FeaturePipeline::SPECTRUM_FULL : FeaturePipeline::SPECTRUM_BAND);
+        QVector<float> feature(pipeline.featureSize());
+        results.append(measure(modes[m], [&]() { pipeline.process(frame.constData(), feature.data()); }));
+    }
+    return results;
+}
+
+// TrainLabelと同じ形(ラベル -> テイク -> buffer_size個のフレーム)の合成学習データ
+static QList<QList<QVector<float> > > syntheticTrainData(int labels, int takes, int frames, int dimension)
+{
+    QList<QList<QVector<float> > > data;
+    QRandomGenerator gen(2);
+    for(int l = 0; l < labels; l++)
+    {
+        QList<QVector<float> > labelData;
+        for(int t = 0; t < takes * frames; t++)
+        {
+            QVector<float> v(dimension);
+            for(int j = 0; j < dimension; j++)
+            {
+                // ラベルごとに異なる周波数特性 + 雑音
+                v[j] = 1 + 0.5 * sin(j * 0.05 * (l + 1)) + 0.1 * gen.generateDouble();
+            }
+            labelData.append(v);
+        }
+        data.append(labelData);
+    }
+    return data;
+}
+
+// SVMClassifierの識別(RBFカーネルならSIMDのカーネルで、libsvmを通さない)が、同じモデルと入力のsvm_predict_probability()と一致するかを確かめる
+// 学習データの全フレームについてラベルと確率を比べる。カーネルを単精度で求めるので確率は完全には一致しないが、
+// 確率の差はSVM_DENSE_TOLERANCE以下で、ラベルはlibsvmの上位2クラスの確率の差がそれより大きいフレームでは一致すること
+#define SVM_DENSE_TOLERANCE 1e-3
+
+static QJsonObject svmDenseAgreement(const SVMClassifier &svm, const QList<QList<QVector<float> > > &trainData, int labels)
+{
+    QSharedPointer<const SVMModel> model = svm.model();
+    int dimension = trainData.first().first().size();
+    QVector<svm_node> nodes(dimension + 1);
+    QVector<double> dense(labels), reference(labels);
+    ClassifierWorkspace workspace;
+    int frames = 0, mismatches = 0, ties = 0;
+    double maxDiff = 0;
+    for(int l = 0; model && l < trainData.size(); l++)
+    {
+        for(int t = 0; t < trainData[l].size(); t++)
+        {
+            const QVector<float> &x = trainData[l][t];
+            for(int j = 0; j < dimension; j++)
+            {
+                nodes[j].index = j + 1;
+                nodes[j].value = model->scaleA[j] * x[j] + model->scaleB[j];
+            }
+            nodes[dimension].index = -1;
+            double expected = svm_predict_probability(model->model, nodes.data(), reference.data());
+            double label = svm.predict(x.constData(), x.size(), dense.data(), workspace);
+            double first = 0, second = 0;
+            for(int k = 0; k < labels; k++)
+            {
+                maxDiff = qMax(maxDiff, fabs(dense[k] - reference[k]));
+                if(reference[k] > first) { second = first; first = reference[k]; }
+                else if(reference[k] > second) second = reference[k];
+            }
+            if(label != expected)
+            {
+                // 確率がほぼ等しい2クラスの間で分かれたものは、丸めの違いとして数えるだけにする
+                if(first - second <= SVM_DENSE_TOLERANCE) ties++;
+                else mismatches++;
+            }
+            frames++;
+        }
+    }
+    bool ok = model && frames > 0 && mismatches == 0 && maxDiff <= SVM_DENSE_TOLERANCE;
+
+    QJsonObject o;
+    o["name"] = QString("svm_dense_agreement_%1labels").arg(labels);
+    o["dense"] = model && model->kernelSV != NULL;
+    o["frames"] = frames;
+    o["label_mismatches"] = mismatches;
+    o["label_ties"] = ties;
+    o["max_probability_diff"] = maxDiff;
+    o["tolerance"] = SVM_DENSE_TOLERANCE;
+    o["ok"] = ok;
+    QTextStream(stderr) << QString("%1 %2\n").arg(o["name"].toString(), -32).arg(ok ? "ok" : "FAILED");
+    return o;
+}
+
+static QJsonArray classifierBenchmarks()
+{
+    QJsonArray results;
+    FeaturePipeline pipeline;
+    pipeline.configure(FRAME_WIDTH, SAMPLE_RATE, MIN_HZ, MAX_HZ);
+    int dimension = pipeline.featureSize();
+
+    const int labelCounts[] = { 3, 7, 20 };
+    for(int i = 0; i < 3; i++)
+    {
+        int labels = labelCounts[i];
+        QList<QList<QVector<float> > > trainData = syntheticTrainData(labels, 3, 20, dimension);
+        QList<QPair<double, QVector<float> > > problems = Classifier::makeProblems(trainData);
+
+        SVMClassifier svm;
+        QElapsedTimer t;
+        t.start();
+        svm.train(problems);
+        results.append(single(QString("svm_train_%1labels").arg(labels), t.nsecsElapsed()));
+
+        // 自動調整(グリッドサーチ全体、格子点は全コアで並列に調べる)
+        SVMClassifier tuner;
+        t.restart();
+        QList<SVMGridPoint> points = tuner.tune(Classifier::makeView(problems));
+        QJsonObject tuneResult = single(QString("svm_tune_%1labels").arg(labels), t.nsecsElapsed());
+        tuneResult["grid_points"] = points.size();
+        results.append(tuneResult);
+
+        QVector<float> sample = trainData[labels/2][5];
+        QVector<double> probability(labels);
+        results.append(measure(QString("svm_predict_%1labels").arg(labels), [&]() { svm.predict(sample, probability.data()); }));
+
+        // 比較用: 同じモデルと入力をlibsvm(svm_predict_probability)で識別する
+        QSharedPointer<const SVMModel> model = svm.model();
+        if(model)
+        {
+            QVector<svm_node> nodes(dimension + 1);
+            for(int j = 0; j < dimension; j++)
+            {
+                nodes[j].index = j + 1;
+                nodes[j].value = model->scaleA[j] * sample[j] + model->scaleB[j];
+            }
+            nodes[dimension].index = -1;
+            results.append(measure(QString("svm_predict_libsvm_%1labels").arg(labels), [&]() { svm_predict_probability(model->model, nodes.data(), probability.data()); }));
+        }
+        results.append(svmDenseAgreement(svm, trainData, labels));
+
+        // 録音を評価するときのように、多数のフレームをまとめて識別する(全コア、1行あたりの時間)
+        const int batchRows = 8192;
+        QVector<float> matrix(batchRows * dimension);
+        for(int r = 0; r < batchRows; r++)
+        {
+            const QList<QVector<float> > &frames = trainData[r % labels];
+            memcpy(matrix.data() + r * dimension, frames[(r / labels) % frames.size()].constData(), sizeof(float) * dimension);
+        }
+        QVector<double> batchLabels(batchRows), batchProbability(batchRows * labels);
+        t.restart();
+        svm.predictBatch(matrix.constData(), batchRows, dimension, batchLabels.data(), batchProbability.data());
+        QJsonObject batchResult = single(QString("svm_predict_batch_%1labels").arg(labels), t.nsecsElapsed() / (double)batchRows);
+        batchResult["rows"] = batchRows;
+        results.append(batchResult);
+
+        // 保存したモデルを起動時と同じように読み込む(マップして差し替えるまで)
+        QTemporaryFile modelFile(QDir::tempPath() + "/stethos-bench-XXXXXX.stsv");
+        if(modelFile.open() && svm.save(modelFile.fileName()))
+        {
+            SVMClassifier loaded;
+            results.append(measure(QString("svm_load_%1labels").arg(labels), [&]() { loaded.load(modelFile.fileName()); }));
+        }
+
+        // 線形の識別器(識別はラベル数×次元の内積だけ)
+        for(int type = Classifier::TYPE_LINEAR; type <= Classifier::TYPE_CENTROID; type++)
+        {
+            Classifier *c = Classifier::create((Classifier::Type)type);
+            QString name = Classifier::typeName((Classifier::Type)type);
+            t.restart();
+            c->train(Classifier::makeView(problems));
+            results.append(single(QString("%1_train_%2labels").arg(name).arg(labels), t.nsecsElapsed()));
+            results.append(measure(QString("%1_predict_%2labels").arg(name).arg(labels), [&]() { c->predict(sample, probability.data()); }));
+            delete c;
+        }
+    }
+    return results;
+}
+
+static QJsonObject endToEndSynthetic()
+{
+    // 10秒分の合成入力を、AIF版と同じフレーム切り出しと特徴抽出に通す
+    QVector<float> signal = syntheticSignal(SAMPLE_RATE * 10);
+    STFTFramer framer(FRAME_WIDTH, HOP);
+    FeaturePipeline pipeline;
+    pipeline.configure(FRAME_WIDTH, SAMPLE_RATE, MIN_HZ, MAX_HZ);
+    QVector<float> frame(FRAME_WIDTH), feature(pipeline.featureSize());
+
+    QElapsedTimer t;
+    t.start();
+    qint64 frames = 0;
+    const float *p = signal.constData();
+    int n = signal.size();
+    while(n > 0)
+    {
+        int used = framer.write(p, qMin(n, 512)); // 512サンプルずつのコールバックを模擬
+        p += used;
+        n -= used;
+        if(framer.frameReady())
+        {
+            framer.read(frame.data());
+            pipeline.process(frame.constData(), feature.data());
+            frames++;
+        }
+    }
+    double sec = t.nsecsElapsed() / 1e9;
+
+    QJsonObject o;
+    o["name"] = "end_to_end_synthetic";
+    o["frames"] = (double)frames;
+    o["seconds"] = sec;
+    o["frames_per_sec"] = frames / sec;
+    o["realtime_factor"] = (signal.size() / (double)SAMPLE_RATE) / sec;
+    // 設定を変えていないフレームのprocess()で実際に起きたヒープ確保(operator new/malloc)の回数。0であること
+    o["steady_state_allocations"] = pipeline.steadyStateAllocations();
+    QTextStream(stderr) << QString("%1 %2 frames/s\n").arg("end_to_end_synthetic", -32).arg(frames / sec, 0, 'f', 1);
+    return o;
+}
+
+static QJsonObject sweepSyncOverrun()
+{
+    // スイープ同期の切り出しが、入力の途切れ(リングバッファのあふれ)の後に新しい遅延で測り直せるかを確かめる
+    // AIF版のreadData()と同じく途切れたらresync()し、切り出したフレームは実際のFFTEngineを使う特徴抽出に通す
+    const int P = SAMPLE_RATE / 50;
+    const int DELAY = 300, GAP = 517, PERIODS = 40;
+    QVector<float> probe = renderProbe(PROBE_LINEAR_CHIRP, SAMPLE_RATE, MIN_HZ, MAX_HZ, P);
+    QVector<float> signal(P * PERIODS);
+    for(int i = 0; i < signal.size(); i++)
+    {
+        signal[i] = probe[(i + P - DELAY) % P] + 0.3f * probe[(i + 2 * P - DELAY - 37) % P];
+    }
+
+    SweepFramer framer;
+    framer.setup(probe, 4);
+    FeaturePipeline pipeline;
+    pipeline.configure(P, SAMPLE_RATE, MIN_HZ, MAX_HZ);
+    QVector<float> frame(P), feature(pipeline.featureSize());
+    bool finite = true;
+    auto feed = [&](int from, int to) {
+        int frames = 0;
+        const float *p = signal.constData() + from;
+        int n = to - from;
+        while(n > 0)
+        {
+            int used = framer.write(p, qMin(n, 512));
+            p += used;
+            n -= used;
+            if(!framer.frameReady()) continue;
+            framer.read(frame.data());
+            pipeline.process(frame.constData(), feature.data());
+            for(int i = 0; i < feature.size(); i++) finite = finite && qIsFinite(feature[i]);
+            frames++;
+        }
+        return frames;
+    };
+
+    int half = P * PERIODS / 2 + 123;
+    feed(0, half);
+    int offsetBefore = framer.locked() ? framer.offset() : -1;
+    // GAP点が欠けたものとして測り直す。以降の入力の0点目はsignalのhalf+GAP点目
+    framer.resync();
+    int framesAfter = feed(half + GAP, signal.size());
+    int offsetAfter = framer.locked() ? framer.offset() : -1;
+    int expectedAfter = ((DELAY - half - GAP) % P + P) % P;
+    // ロックに4周期、先頭まで読み捨てるのにexpectedAfter点、測り直した直後の1周期は出力しない
+    int expectedFrames = (signal.size() - half - GAP - 4 * P - expectedAfter) / P - 1;
+    bool ok = offsetBefore == DELAY && offsetAfter == expectedAfter && framesAfter == expectedFrames && finite;
+
+    QJsonObject o;
+    o["name"] = "sweep_sync_overrun";
+    o["offset_before"] = offsetBefore;
+    o["expected_before"] = DELAY;
+    o["offset_after"] = offsetAfter;
+    o["expected_after"] = expectedAfter;
+    o["frames_after"] = framesAfter;
+    o["expected_frames_after"] = expectedFrames;
+    o["ok"] = ok;
+    QTextStream(stderr) << QString("%1 %2\n").arg("sweep_sync_overrun", -32).arg(ok ? "ok" : "FAILED");
+    return o;
+}
+
+static QJsonObject endToEndReplay(const QString &fileName)
+{
+    ReplayActiveAcousticSensor sensor(fileName);
+    sensor.setPacing(ReplayActiveAcousticSensor::AS_FAST_AS_POSSIBLE);
+    QEventLoop loop;
+    QObject::connect(&sensor, SIGNAL(finished()), &loop, SLOT(quit()), Qt::QueuedConnection);
+
+    QJsonObject o;
+    o["name"] = "end_to_end_replay";
+    o["file"] = fileName;
+    QString ret = sensor.start();
+    if(ret != "OK")
+    {
+        o["error"] = ret;
+        return o;
+    }
+    loop.exec();
+
+    o["frames"] = (double)sensor.framesProcessed();
+    o["seconds"] = sensor.elapsedSeconds();
+    o["frames_per_sec"] = sensor.framesPerSecond();
+    QJsonObject stages;
+    qint64 n = qMax((qint64)1, sensor.framesProcessed());
+    for(int i = 0; i < FeaturePipeline::STAGE_COUNT; i++)
+    {
+        FeaturePipeline::Stage stage = (FeaturePipeline::Stage)i;
+        stages[FeaturePipeline::stageName(stage)] = sensor.featurePipeline().stageNanoseconds(stage) / (double)n;
+    }
+    o["stage_ns_per_frame"] = stages;
+    return o;
+}
+
+// 合成入力を2chの16bit WAVとして書き出す(SensorManagerのスケーリング計測でファイル再生版センサに読ませる)
+static bool writeSyntheticWav(QFile &f, int seconds)
+{
+    QVector<float> x = syntheticSignal(SAMPLE_RATE * seconds);
+    QByteArray pcm(x.size() * 4, 0);
+    uchar *p = reinterpret_cast<uchar *>(pcm.data());
+    for(int i = 0; i < x.size(); i++)
+    {
+        qint16 v = (qint16)qBound(-32767.f, x[i] / 10 * SHRT_MAX, 32767.f);
+        qToLittleEndian<qint16>(v, p + 4 * i);
+        qToLittleEndian<qint16>(v, p + 4 * i + 2);
+    }
+    QByteArray header(44, 0);
+    uchar *h = reinterpret_cast<uchar *>(header.data());
+    memcpy(h, "RIFF", 4);
+    qToLittleEndian<quint32>(36 + pcm.size(), h + 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    qToLittleEndian<quint32>(16, h + 16);
+    qToLittleEndian<quint16>(1, h + 20);                // PCM
+    qToLittleEndian<quint16>(2, h + 22);                // 2ch
+    qToLittleEndian<quint32>(SAMPLE_RATE, h + 24);
+    qToLittleEndian<quint32>(SAMPLE_RATE * 4, h + 28);
+    qToLittleEndian<quint16>(4, h + 32);
+    qToLittleEndian<quint16>(16, h + 34);
+    memcpy(h + 36, "data", 4);
+    qToLittleEndian<quint32>(pcm.size(), h + 40);
+    return f.write(header) == header.size() && f.write(pcm) == pcm.size();
+}
+
+// SensorManagerで複数のセンサ(ファイル再生版, 最速)を同時に処理したときの全体のフレームレート
+// センサ数をコア数の2倍まで増やし、コア数までほぼ線形に伸びるかを見る
+static QJsonArray managerScaling()
+{
+    QJsonArray results;
+    QTemporaryFile wav(QDir::tempPath() + "/stethos-bench-XXXXXX.wav");
+    if(!wav.open() || !writeSyntheticWav(wav, 5)) return results;
+    wav.close();
+
+    int cores = QThread::idealThreadCount();
+    for(int sensors = 1; sensors <= 2 * cores; sensors *= 2)
+    {
+        SensorManager manager;
+        for(int i = 0; i < sensors; i++)
+        {
+            ReplayActiveAcousticSensor *sensor = new ReplayActiveAcousticSensor(wav.fileName());
+            sensor->setPacing(ReplayActiveAcousticSensor::AS_FAST_AS_POSSIBLE);
+            manager.addSensor(sensor);
+        }
+        QElapsedTimer t;
+        t.start();
+        // 開始できなかったセンサは終わらないので、待たずにこの構成を飛ばす
+        QString error = manager.startAll();
+        if(error != "OK")
+        {
+            manager.stopAll();
+            QJsonObject o;
+            o["name"] = QString("manager_%1sensors").arg(sensors);
+            o["sensors"] = sensors;
+            o["error"] = error;
+            QTextStream(stderr) << QString("%1 FAILED: %2\n").arg(o["name"].toString(), -32).arg(error);
+            results.append(o);
+            continue;
+        }
+        bool finished = false;
+        while(!finished)
+        {
+            QThread::msleep(5);
+            QCoreApplication::processEvents();
+            finished = true;
+            for(int i = 0; i < sensors; i++)
+            {
+                if(!static_cast<ReplayActiveAcousticSensor *>(manager.sensor(i))->isFinished()) finished = false;
+            }
+        }
+        double sec = t.nsecsElapsed() / 1e9;
+        qint64 frames = 0;
+        double latency = 0;
+        for(int i = 0; i < sensors; i++)
+        {
+            SensorStats st = manager.stats(i);
+            frames += st.frames;
+            latency += st.meanLatencyUs / sensors;
+        }
+        manager.stopAll();
+
+        QJsonObject o;
+        o["name"] = QString("manager_%1sensors").arg(sensors);
+        o["sensors"] = sensors;
+        o["threads"] = manager.threadCount();
+        o["frames"] = (double)frames;
+        o["seconds"] = sec;
+        o["frames_per_sec"] = frames / sec;
+        o["mean_latency_us"] = latency;
+        QTextStream(stderr) << QString("%1 %2 frames/s\n").arg(o["name"].toString(), -32).arg(frames / sec, 0, 'f', 1);
+        results.append(o);
+    }
+    return results;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("stethos-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless benchmark for the stethos sensing pipeline.");
+    parser.addHelpOption();
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "Write JSON results to <file> (default: stdout).", "file");
+    QCommandLineOption replayOption("replay", "Also run end-to-end on a recorded 16bit WAV/raw session.", "file");
+    QCommandLineOption minTimeOption("min-time", "Minimum measuring time per benchmark in seconds.", "sec", "0.2");
+    parser.addOption(outputOption);
+    parser.addOption(replayOption);
+    parser.addOption(minTimeOption);
+    parser.process(a);
+    minTime = parser.value(minTimeOption).toDouble();
+
+    QJsonObject root;
+    root["version"] = 1;
+    root["timestamp"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    root["qt"] = QString(qVersion());
+    root["simd"] = simdLevel() == SIMD_AVX2 ? "avx2" : simdLevel() == SIMD_SSE2 ? "sse2" : "none";
+    QJsonObject config;
+    config["frame_width"] = FRAME_WIDTH;
+    config["sample_rate"] = SAMPLE_RATE;
+    config["min_hz"] = MIN_HZ;
+    config["max_hz"] = MAX_HZ;
+    config["hop"] = HOP;
+    root["config"] = config;
+
+    root["micro"] = microBenchmarks();
+    root["classifier"] = classifierBenchmarks();
+    QJsonArray macro;
+    macro.append(endToEndSynthetic());
+    macro.append(sweepSyncOverrun());
+    if(parser.isSet(replayOption)) macro.append(endToEndReplay(parser.value(replayOption)));
+    root["macro"] = macro;
+    root["scaling"] = managerScaling();
+
+    QByteArray json = QJsonDocument(root).toJson();
+    if(parser.isSet(outputOption))
+    {
+        QFile f(parser.value(outputOption));
+        if(!f.open(QIODevice::WriteOnly))
+        {
+            QTextStream(stderr) << f.errorString() << "\n";
+            return 1;
+        }
+        f.write(json);
+    }
+    else
+    {
+        QTextStream(stdout) << json;
+    }
+    return 0;
+}
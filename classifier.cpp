@@ -0,0 +1,279 @@
+#include "classifier.h"
+#include "svmclassifier.h"
+#include "linearclassifier.h"
+#include "workerpool.h"
+#include "framestore.h"
+#include <QRunnable>
+#include <QAtomicInt>
+#include <QThread>
+
+#define PREDICT_BATCH_CHUNK 64        // 作業スレッドが一度に取る行数
+#define PREDICT_BATCH_MIN_ROWS 256    // これより少なければ呼び出したスレッドだけで識別する
+
+Classifier *Classifier::create(Type type, QObject *parent)
+{
+    switch(type)
+    {
+    case TYPE_LINEAR:
+        return new LinearClassifier(parent);
+    case TYPE_CENTROID:
+        return new CentroidClassifier(parent);
+    default:
+        return new SVMClassifier(parent);
+    }
+}
+
+QString Classifier::typeName(Type type)
+{
+    switch(type)
+    {
+    case TYPE_LINEAR:
+        return "linear";
+    case TYPE_CENTROID:
+        return "centroid";
+    default:
+        return "svm";
+    }
+}
+
+Classifier::Classifier(QObject *parent)
+    : QObject(parent)
+    , generation(0)
+    , publishedGeneration(-1)
+    , pendingGeneration(-1)
+    , trainingJobs(0)
+{
+}
+
+Classifier::~Classifier()
+{
+    waitForTraining();
+}
+
+void Classifier::waitForTraining()
+{
+    generation.fetchAndAddOrdered(1);
+    jobLock.lock();
+    while(trainingJobs.load() > 0) jobsDone.wait(&jobLock);
+    jobLock.unlock();
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 学習データ
+
+QList<QPair<double, QVector<float> > > Classifier::makeProblems(QList<QList<QVector<float> > > labels)
+{
+    QList<QPair<double, QVector<float> > > problems;
+    int id = 0;
+    foreach(QList<QVector<float> > data, labels)
+    {
+        foreach(QVector<float> d, data)
+        {
+            problems.append(QPair<double, QVector<float> >((double)id, d));
+        }
+        id++;
+    }
+    return problems;
+}
+
+ProblemView Classifier::makeProblems(const FrameStore &store, QList<int> labels)
+{
+    ProblemView view;
+    view.dimension = store.dimension();
+    for(int id = 0; id < labels.size(); id++)
+    {
+        QVector<int> rows = store.rows(labels[id]);
+        for(int i = 0; i < rows.size(); i++)
+        {
+            view.x.append(store.features(rows[i]));
+            view.y.append(id);
+        }
+    }
+    return view;
+}
+
+ProblemView Classifier::makeView(const QList<QPair<double, QVector<float> > > &problems)
+{
+    ProblemView view;
+    view.dimension = problems.isEmpty() ? 0 : problems.first().second.size();
+    view.x.resize(problems.size());
+    view.y.resize(problems.size());
+    for(int i = 0; i < problems.size(); i++)
+    {
+        // at()で参照するのでリストもベクトルも複製されない
+        view.x[i] = problems.at(i).second.constData();
+        view.y[i] = problems.at(i).first;
+    }
+    return view;
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// バックグラウンドの学習
+// 学習を始めるか取り消すたびに世代番号を増やし、終わった学習の番号が今の番号と違えば結果を破棄する
+// 取り消しの判定と差し替えは同じロック(modelLock)の中で行うので、取り消した後に古い学習の結果が公開されることはない
+
+class ClassifierTrainTask : public QRunnable
+{
+public:
+    ClassifierTrainTask(Classifier *classifier, const ProblemView &view, QList<QPair<double, QVector<float> > > owned, int generation)
+        : classifier(classifier), view(view), owned(owned), generation(generation) {}
+
+    void run()
+    {
+        bool success = !classifier->cancelled(generation) && classifier->build(view, generation);
+        QMetaObject::invokeMethod(classifier, "finishTraining", Qt::QueuedConnection, Q_ARG(int, generation), Q_ARG(bool, success));
+
+        // ここで数を減らした後はclassifierが破棄され得るので、以降は触らない
+        classifier->jobLock.lock();
+        classifier->trainingJobs.deref();
+        classifier->jobsDone.wakeAll();
+        classifier->jobLock.unlock();
+    }
+
+private:
+    Classifier *classifier;
+    ProblemView view;
+    QList<QPair<double, QVector<float> > > owned;
+    int generation;
+};
+
+void Classifier::train(const ProblemView &problems)
+{
+    // バックグラウンドの学習中なら取り消す(後から公開されて、この学習の結果を古いモデルで上書きしないように)
+    cancelTraining();
+    build(problems, -1);
+}
+
+void Classifier::trainAsync(const ProblemView &problems)
+{
+    startTraining(problems);
+}
+
+void Classifier::startTraining(const ProblemView &problems, QList<QPair<double, QVector<float> > > owned)
+{
+    if(problems.x.isEmpty()) return;
+    // 前の学習は取り消す(完了は通知しない)
+    int g = generation.fetchAndAddOrdered(1) + 1;
+    trainingJobs.ref();
+    pendingGeneration = g;
+    ClassifierTrainTask *task = new ClassifierTrainTask(this, problems, owned, g);
+    task->setAutoDelete(true);
+    WorkerPool::globalInstance()->submit(task);
+}
+
+void Classifier::cancelTraining()
+{
+    if(!isTraining()) return;
+    // 通知を待っている学習がなければ(取り消し済みか、完了を通知済みなら)何もしない。同じ学習の取り消しは1回だけ通知する
+    // 取り消しの直前に差し替えが済んでいたら、その学習は成功として通知する
+    modelLock.lock();
+    int g = pendingGeneration;
+    bool cancelledNow = g >= 0 && generation.testAndSetOrdered(g, g + 1);
+    bool published = publishedGeneration == g;
+    modelLock.unlock();
+    if(!cancelledNow) return;
+    pendingGeneration = -1;
+    emit trainingFinished(published);
+}
+
+bool Classifier::mayPublish(int g)
+{
+    if(g < 0) return true;
+    if(generation.load() != g) return false;
+    publishedGeneration = g;
+    return true;
+}
+
+void Classifier::progress(int g, int percent) const
+{
+    if(g < 0) return;
+    QMetaObject::invokeMethod(const_cast<Classifier *>(this), "reportProgress", Qt::QueuedConnection, Q_ARG(int, g), Q_ARG(int, percent));
+}
+
+void Classifier::reportProgress(int g, int percent)
+{
+    if(g == generation.load()) emit trainingProgress(percent);
+}
+
+void Classifier::finishTraining(int g, bool success)
+{
+    // 取り消した学習や、後から始めた学習に追い越された学習の完了は通知しない(取り消しの時点でfalseとみなす)
+    if(g != generation.load()) return;
+    pendingGeneration = -1;
+    if(success) emit trainingProgress(100);
+    emit trainingFinished(success);
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// まとめて識別
+
+// predictBatch()の入出力と、次に識別する行
+struct PredictBatch
+{
+    const float *data;
+    int rows, columns;
+    double *labels;
+    double *probabilities;
+    int labelCount;
+    QAtomicInt next;
+};
+
+// predictBatch()の作業スレッド。PREDICT_BATCH_CHUNK行ずつ取り合うので、行ごとの識別時間が偏っても早く終わったスレッドが残りを引き受ける
+class PredictBatchTask : public QRunnable
+{
+public:
+    PredictBatchTask(const Classifier *classifier, PredictBatch *batch) : classifier(classifier), batch(batch) {}
+    void run();
+
+private:
+    const Classifier *classifier;
+    PredictBatch *batch;
+};
+
+void PredictBatchTask::run()
+{
+    ClassifierWorkspace workspace;
+    for(;;)
+    {
+        int begin = batch->next.fetchAndAddOrdered(PREDICT_BATCH_CHUNK);
+        if(begin >= batch->rows) break;
+        int end = qMin(begin + PREDICT_BATCH_CHUNK, batch->rows);
+        for(int i = begin; i < end; i++)
+        {
+            double *probability = batch->probabilities != NULL ? batch->probabilities + (qint64)i * batch->labelCount : NULL;
+            batch->labels[i] = classifier->predict(batch->data + (qint64)i * batch->columns, batch->columns, probability, workspace);
+        }
+    }
+}
+
+bool Classifier::predictBatch(const float *data, int rows, int columns, double *labels, double *probabilities, int threads) const
+{
+    if(!isTrained()) return false;
+
+    PredictBatch batch;
+    batch.data = data;
+    batch.rows = rows;
+    batch.columns = columns;
+    batch.labels = labels;
+    batch.probabilities = probabilities;
+    batch.labelCount = labelCount();
+    batch.next.store(0);
+
+    if(threads <= 0) threads = QThread::idealThreadCount();
+    threads = qMin(threads, (rows + PREDICT_BATCH_CHUNK - 1) / PREDICT_BATCH_CHUNK);
+    if(rows < PREDICT_BATCH_MIN_ROWS || threads <= 1)
+    {
+        PredictBatchTask task(this, &batch);
+        task.run();
+        return true;
+    }
+
+    // 学習中のタスクと待ち合わせないよう、共有のプールではなくこの呼び出し専用のプールを使う
+    WorkerPool pool(threads);
+    for(int i = 0; i < threads; i++)
+    {
+        pool.submit(new PredictBatchTask(this, &batch));
+    }
+    pool.waitForDone();
+    return true;
+}
@@ -0,0 +1,146 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include <QObject>
+#include <QVector>
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QPair>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include "svm.h"
+
+class FrameStore;
+
+// 識別用の作業領域(正規化した入力とsvm_node列、識別器ごとの途中結果)
+// 一度確保すれば次元が変わらない限り再利用される。呼び出し側がスレッドごとに持てば、同じ識別器を複数スレッドから同時に使える
+struct ClassifierWorkspace
+{
+    QVector<float> scaled;
+    QVector<svm_node> nodes;
+    QVector<float> scores;    // 線形の識別器のラベルごとの値
+    QVector<float> kernel;    // RBFカーネルのSVMのサポートベクタごとのカーネル値
+    QVector<double> decision; // SVMのクラス対ごとの決定値
+    QVector<double> coupling; // SVMのペアごとの確率から各クラスの確率を求める作業領域
+};
+
+// 学習データの参照(コピーしない)。x[i](dimension点)をラベルy[i]として学習する
+struct ProblemView
+{
+    ProblemView() : dimension(0) {}
+    QVector<const float *> x;
+    QVector<double> y;
+    int dimension;
+};
+
+// 識別器の共通インタフェース
+// 学習データ(ラベル番号は0からの連番)から学習し、特徴ベクトルをラベル番号とラベルごとの確率に識別する
+// 学習済みモデルの差し替えは識別と並行してよく、predict()は作業領域を分ければどのスレッドからでも呼べる
+// バックグラウンドの学習(世代番号による取り消しと差し替えの判定、進捗と完了の通知)はここで共通に行い、
+// 実装はモデルを作って公開するbuild()だけを持つ
+class Classifier : public QObject
+{
+    Q_OBJECT
+    friend class ClassifierTrainTask;
+public:
+    // 実装の種類(実行時に選ぶ)
+    enum Type {
+        TYPE_SVM,       // SVMClassifier: RBFカーネルのSVM。識別の計算量はサポートベクタの数に比例する
+        TYPE_LINEAR,    // LinearClassifier: 多クラスのロジスティック回帰。識別はラベルごとの内積だけ
+        TYPE_CENTROID,  // CentroidClassifier: 全ラベル共通の共分散によるマハラノビス距離で、最も近い重心のラベル
+        TYPE_COUNT
+    };
+    static Classifier *create(Type type, QObject *parent = 0);
+    // 設定画面やファイル名に使う名前("svm", "linear", "centroid")
+    static QString typeName(Type type);
+
+    // ラベルごとの学習データ(ラベルの並び順がラベル番号になる)を学習用の問題リストにする
+    static QList<QPair<double, QVector<float> > > makeProblems(QList<QList<QVector<float> > > labels);
+    // FrameStoreのlabelsの行(削除していないもの)を、labelsの並び順をラベル番号として参照する
+    // 参照先はストアを閉じるまで有効で、学習中に行を書き足してもよい
+    static ProblemView makeProblems(const FrameStore &store, QList<int> labels);
+    // 問題リストを参照する(problemsはviewを使い終わるまで保持すること)
+    static ProblemView makeView(const QList<QPair<double, QVector<float> > > &problems);
+
+    explicit Classifier(QObject *parent = 0);
+    virtual ~Classifier();
+
+    virtual Type type() const = 0;
+    // 学習済みモデルのクラス数と入力の次元(未学習なら0)
+    virtual int labelCount() const = 0;
+    virtual int dimension() const = 0;
+    virtual bool isTrained() const = 0;
+    // バックグラウンドで学習中か
+    bool isTraining() const { return trainingJobs.load() > 0; }
+
+    // data(size点)を識別してラベル番号を返す(workspaceの確保後はメモリ確保なし)
+    // probabilityにはlabelCount()点以上の領域を渡す(NULLなら確率を求めない)。未学習なら-1を返す(probabilityは書き換えない)
+    virtual double predict(const float *data, int size, double *probability, ClassifierWorkspace &workspace) const = 0;
+    // 内部の作業領域を使う版(同じ識別器に対して同時に呼んではいけない)
+    double predict(const QVector<float> &data, double *probability = NULL)
+    {
+        return predict(data.constData(), data.size(), probability, workspace);
+    }
+
+    // N×D(rows × columns、行ごとに連続)の特徴行列をまとめて識別する。録音したセッションなどのオフラインの評価用
+    // labelsにはrows点、probabilitiesにはrows × labelCount()点(行ごとに連続、NULLなら確率を求めない)の領域を渡す
+    // 行をthreads本(0以下ならコア数)の作業スレッドで分けて識別し、作業領域はスレッドごとに1つを使い回す。終わるまで戻らない
+    // 識別中にクラス数の違うモデルに差し替えないこと。未学習ならfalseを返し、何も書き換えない
+    bool predictBatch(const float *data, int rows, int columns, double *labels, double *probabilities = NULL, int threads = 0) const;
+
+    // 学習済みモデルの保存と読み込み(形式は実装ごと)。labelNamesはラベル番号順のラベル名で、モデルと一緒に保存される
+    // 読めなければfalseを返し、モデルは変わらない。読めたら学習中のものは取り消される
+    virtual bool save(const QString &path, const QStringList &labelNames = QStringList()) const = 0;
+    virtual bool load(const QString &path, QStringList *labelNames = NULL) = 0;
+
+public slots:
+    // 学習して、終わったらモデルを差し替える(呼び出したスレッドで学習する。バックグラウンドの学習中なら、それは取り消す)
+    void train(const ProblemView &problems);
+    // ワーカープールのスレッドで学習する。学習中も古いモデルで識別を続け、学習が終わってから一度に差し替える
+    // 進捗はtrainingProgress、完了はtrainingFinishedで通知する(どちらもこのオブジェクトのスレッドに届く)
+    // 学習中に再び呼ぶと、前の学習は取り消される。参照先は学習が終わるまで(trainingFinishedまで、またはこのオブジェクトの破棄まで)有効であること
+    void trainAsync(const ProblemView &problems);
+    // 学習を取り消す。学習中のものは終わった時点で破棄され、古いモデルが使われ続ける
+    void cancelTraining();
+
+signals:
+    // 学習の進捗[%]
+    void trainingProgress(int percent);
+    // 学習の完了。取り消されたか、学習できなかったらfalse
+    void trainingFinished(bool success);
+
+protected:
+    // 学習データからモデルを作り、公開できたらtrueを返す(generationが-1なら呼び出したスレッドでの学習、それ以外は作業スレッドから呼ばれる)
+    // 公開はmodelLockを取ってmayPublish(generation)が真のときだけ行う。取り消されたら(cancelled())途中で諦めてよい
+    virtual bool build(const ProblemView &problems, int generation) = 0;
+    // バックグラウンドの学習を始める(ownedはproblemsの参照先を学習が終わるまで保持するためのもの)
+    void startTraining(const ProblemView &problems, QList<QPair<double, QVector<float> > > owned = QList<QPair<double, QVector<float> > >());
+    // generation番目の学習が取り消されたか(-1は呼び出したスレッドでの学習で、取り消されない)
+    bool cancelled(int generation) const { return generation >= 0 && this->generation.load() != generation; }
+    // generation番目の学習の進捗を通知する(どのスレッドから呼んでもよい。-1なら何もしない)
+    void progress(int generation, int percent) const;
+    // modelLockを取ってから呼ぶ。generation番目の学習の結果を公開してよければ、公開したものとして記録してtrueを返す
+    bool mayPublish(int generation);
+    // 学習中のものを取り消し、作業スレッドが終わるまで待つ(build()が呼ばれなくなるように、派生クラスのデストラクタで呼ぶ)
+    void waitForTraining();
+
+    ClassifierWorkspace workspace;
+    // 公開中のモデル(実装ごとに持つ)の差し替えを守るロック。識別側はロックを取って参照を1つ増やすだけ
+    mutable QMutex modelLock;
+
+private slots:
+    void finishTraining(int generation, bool success);
+    void reportProgress(int generation, int percent);
+
+private:
+    QAtomicInt generation;    // 学習を始めるか取り消すたびに増やす。終わった学習の番号と違えば結果を破棄する
+    int publishedGeneration;  // 最後に公開した学習の番号(modelLockで保護)
+    int pendingGeneration;    // trainingFinishedをまだ通知していない学習の番号(なければ-1。学習を始めるスレッドのみが触る)
+    QAtomicInt trainingJobs;  // 実行中(積んだものを含む)の学習の数
+    QMutex jobLock;
+    QWaitCondition jobsDone;
+};
+
+#endif // CLASSIFIER_H
@@ -0,0 +1,1504 @@
+#include "dsp.h"
+#include <QMutex>
+#include <QVarLengthArray>
+#include <math.h>
+#include <string.h>
+#include <limits>
+
+// fftwf_plan_*/fftwf_destroy_planはスレッドセーフでないため、プラン操作はこのロックで直列化する
+static QMutex planLock;
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 特徴ベクトルの後処理
+
+// ローパスフィルタ
+void lowpass(float *data, int n, int width)
+{
+    if(n <= 0) return;
+    if(width <= 0)
+    {
+        // 窓が空になるので、以前と同じく全てNaN(0/0)
+        for(int i = 0; i < n; i++) data[i] = std::numeric_limits<float>::quiet_NaN();
+        return;
+    }
+
+    // 上書きした元の値のうち、まだ窓から外れていないwidth点を退避しておく循環バッファ
+    QVarLengthArray<float, 64> hist(width);
+    double sum = 0;
+    int count = 0;
+
+    // i = 0 の窓 [0, width)
+    for(int j = 0; j < qMin(width, n); j++)
+    {
+        if(data[j] != 0)
+        {
+            sum += data[j];
+            count++;
+        }
+    }
+
+    for(int i = 0; i < n; i++)
+    {
+        float v = data[i];
+        data[i] = (float)sum / (float)count;
+
+        // 窓を [i+1-width, i+1+width) に進める: i+widthを足し、i-widthを引く
+        if(i + width < n)
+        {
+            float a = data[i + width]; // まだ上書きされていない
+            if(a != 0)
+            {
+                sum += a;
+                count++;
+            }
+        }
+        int slot = i % width;
+        if(i - width >= 0)
+        {
+            float r = hist[slot]; // i-width番目の元の値
+            if(r != 0)
+            {
+                sum -= r;
+                count--;
+            }
+        }
+        hist[slot] = v;
+        // 窓が空になったら丸め誤差を持ち越さない
+        if(count == 0) sum = 0;
+    }
+}
+
+// データ(パワースペクトル)の次元を削減(ダウンサンプリング)
+int reduce(float *data, int n, int step, int offset)
+{
+    if(step <= 0 || n <= 0) return 0;
+    // (i+offset) % step == 0 となる最初のi
+    int first = ((step - offset % step) % step + step) % step;
+    int k = 0;
+    for(int i = first; i < n; i += step)
+    {
+        data[k++] = data[i];
+    }
+    return k;
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// パワースペクトルを求める
+int maGetPowerSpectol2D( fftwf_complex *in, float *out, int cols, int rows )
+{
+    int i,j;
+    int idx; // index of data
+    //double max, min, scale; // max/min of powerspectol
+
+    if( in==NULL || out==NULL ) return false;
+    if( rows<0 || cols<0 )      return false;
+
+    for( j=0; j<rows; j++ ){
+        for( i=0; i<cols; i++ ){
+            idx = j*cols + i;
+            out[idx] = log10(1 + sqrt(pow(in[idx][0],2) + pow(in[idx][1],2)) );
+        }
+    }
+
+    return true;
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 対数振幅スペクトル(SIMD)
+//
+// log10(x) (x = 1 + |X| >= 1) を次のように求める
+//   x = m * 2^e (m は [1/√2, √2) に正規化)
+//   ln(m) = 2 * (t + t^3/3 + t^5/5 + t^7/7),  t = (m-1)/(m+1), |t| <= 0.1716
+//   log10(x) = e * log10(2) + ln(m) * log10(e)
+// 打ち切り誤差は ln で 3e-8 程度で、残りは単精度の丸め誤差(数ulp)になる
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DSP_X86
+#include <immintrin.h>
+#endif
+
+#define LOG10_2 0.30102999566398120f
+#define LOG10_E 0.43429448190325182f
+
+// スカラー版(SIMDが使えないCPUでの端数処理と、SIMD非対応環境用)
+static inline float fastLog10p1(float m)
+{
+    union { float f; unsigned int i; } u;
+    u.f = 1 + m;
+    float e = (float)((int)(u.i >> 23) - 127);
+    u.i = (u.i & 0x007fffff) | 0x3f800000;
+    float x = u.f;
+    if(x > (float)M_SQRT2)
+    {
+        x *= 0.5f;
+        e += 1;
+    }
+    float t = (x - 1) / (x + 1);
+    float t2 = t * t;
+    float ln = 2 * t * (1 + t2 * (1/3.f + t2 * (1/5.f + t2 * (1/7.f))));
+    return e * LOG10_2 + ln * LOG10_E;
+}
+
+static void logMagnitudeScalar(const fftwf_complex *in, float *out, int n)
+{
+    for(int i = 0; i < n; i++)
+    {
+        out[i] = fastLog10p1(sqrtf(in[i][0]*in[i][0] + in[i][1]*in[i][1]));
+    }
+}
+
+#ifdef DSP_X86
+// SSE2: 4点ずつ
+static void logMagnitudeSSE2(const fftwf_complex *in, float *out, int n)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 sqrt2 = _mm_set1_ps((float)M_SQRT2);
+    const __m128 c3 = _mm_set1_ps(1/3.f), c5 = _mm_set1_ps(1/5.f), c7 = _mm_set1_ps(1/7.f);
+    const __m128 log10_2 = _mm_set1_ps(LOG10_2), log10_e2 = _mm_set1_ps(2 * LOG10_E);
+    const __m128i mantMask = _mm_set1_epi32(0x007fffff), oneBits = _mm_set1_epi32(0x3f800000), bias = _mm_set1_epi32(127);
+
+    const float *src = &in[0][0];
+    int i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        // [r0 i0 r1 i1], [r2 i2 r3 i3] を2乗して実部と虚部に分けて足す
+        __m128 a = _mm_loadu_ps(src + 2*i);
+        __m128 b = _mm_loadu_ps(src + 2*i + 4);
+        a = _mm_mul_ps(a, a);
+        b = _mm_mul_ps(b, b);
+        __m128 p = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)));
+        __m128 x = _mm_add_ps(one, _mm_sqrt_ps(p));
+
+        __m128i bits = _mm_castps_si128(x);
+        __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), bias));
+        __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, mantMask), oneBits));
+        __m128 big = _mm_cmpgt_ps(m, sqrt2);
+        m = _mm_or_ps(_mm_and_ps(big, _mm_mul_ps(m, half)), _mm_andnot_ps(big, m));
+        e = _mm_add_ps(e, _mm_and_ps(big, one));
+
+        __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+        __m128 t2 = _mm_mul_ps(t, t);
+        __m128 poly = _mm_add_ps(c5, _mm_mul_ps(t2, c7));
+        poly = _mm_add_ps(c3, _mm_mul_ps(t2, poly));
+        poly = _mm_add_ps(one, _mm_mul_ps(t2, poly));
+        __m128 r = _mm_add_ps(_mm_mul_ps(e, log10_2), _mm_mul_ps(_mm_mul_ps(t, poly), log10_e2));
+        _mm_storeu_ps(out + i, r);
+    }
+    logMagnitudeScalar(in + i, out + i, n - i);
+}
+
+// AVX2+FMA: 8点ずつ
+__attribute__((target("avx2,fma")))
+static void logMagnitudeAVX2(const fftwf_complex *in, float *out, int n)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 sqrt2 = _mm256_set1_ps((float)M_SQRT2);
+    const __m256 c3 = _mm256_set1_ps(1/3.f), c5 = _mm256_set1_ps(1/5.f), c7 = _mm256_set1_ps(1/7.f);
+    const __m256 log10_2 = _mm256_set1_ps(LOG10_2), log10_e2 = _mm256_set1_ps(2 * LOG10_E);
+    const __m256i mantMask = _mm256_set1_epi32(0x007fffff), oneBits = _mm256_set1_epi32(0x3f800000), bias = _mm256_set1_epi32(127);
+
+    const float *src = &in[0][0];
+    int i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256 a = _mm256_loadu_ps(src + 2*i);
+        __m256 b = _mm256_loadu_ps(src + 2*i + 8);
+        a = _mm256_mul_ps(a, a);
+        b = _mm256_mul_ps(b, b);
+        // haddは128bitレーン単位なので、結果は [0 1 4 5 2 3 6 7] の順になる。64bit単位で並べ替えて戻す
+        __m256 p = _mm256_hadd_ps(a, b);
+        p = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(p), _MM_SHUFFLE(3,1,2,0)));
+        __m256 x = _mm256_add_ps(one, _mm256_sqrt_ps(p));
+
+        __m256i bits = _mm256_castps_si256(x);
+        __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), bias));
+        __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, mantMask), oneBits));
+        __m256 big = _mm256_cmp_ps(m, sqrt2, _CMP_GT_OQ);
+        m = _mm256_blendv_ps(m, _mm256_mul_ps(m, half), big);
+        e = _mm256_add_ps(e, _mm256_and_ps(big, one));
+
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+        __m256 t2 = _mm256_mul_ps(t, t);
+        __m256 poly = _mm256_fmadd_ps(t2, c7, c5);
+        poly = _mm256_fmadd_ps(t2, poly, c3);
+        poly = _mm256_fmadd_ps(t2, poly, one);
+        __m256 r = _mm256_fmadd_ps(e, log10_2, _mm256_mul_ps(_mm256_mul_ps(t, poly), log10_e2));
+        _mm256_storeu_ps(out + i, r);
+    }
+    logMagnitudeSSE2(in + i, out + i, n - i);
+}
+#endif
+
+static SimdLevel simdLimit = SIMD_AVX2;
+
+SimdLevel simdLevel()
+{
+#ifdef DSP_X86
+    static SimdLevel level = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? SIMD_AVX2
+                           : __builtin_cpu_supports("sse2") ? SIMD_SSE2
+                           : SIMD_NONE;
+    return level < simdLimit ? level : simdLimit;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+void limitSimdLevel(SimdLevel level)
+{
+    simdLimit = level;
+}
+
+void logMagnitude(const fftwf_complex *in, float *out, int n, bool exact)
+{
+    if(exact)
+    {
+        maGetPowerSpectol2D(const_cast<fftwf_complex *>(in), out, 1, n);
+        return;
+    }
+    switch(simdLevel())
+    {
+#ifdef DSP_X86
+    case SIMD_AVX2:
+        logMagnitudeAVX2(in, out, n);
+        break;
+    case SIMD_SSE2:
+        logMagnitudeSSE2(in, out, n);
+        break;
+#endif
+    default:
+        logMagnitudeScalar(in, out, n);
+        break;
+    }
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 要素ごとの1次変換(SIMD)
+
+static void affineScalar(const float *x, const float *a, const float *b, float *out, int n)
+{
+    for(int i = 0; i < n; i++)
+    {
+        out[i] = a[i] * x[i] + b[i];
+    }
+}
+
+#ifdef DSP_X86
+static void affineSSE2(const float *x, const float *a, const float *b, float *out, int n)
+{
+    int i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128 r = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(x + i)), _mm_loadu_ps(b + i));
+        _mm_storeu_ps(out + i, r);
+    }
+    affineScalar(x + i, a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void affineAVX2(const float *x, const float *a, const float *b, float *out, int n)
+{
+    int i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256 r = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(x + i), _mm256_loadu_ps(b + i));
+        _mm256_storeu_ps(out + i, r);
+    }
+    affineSSE2(x + i, a + i, b + i, out + i, n - i);
+}
+#endif
+
+void affine(const float *x, const float *a, const float *b, float *out, int n)
+{
+    switch(simdLevel())
+    {
+#ifdef DSP_X86
+    case SIMD_AVX2:
+        affineAVX2(x, a, b, out, n);
+        break;
+    case SIMD_SSE2:
+        affineSSE2(x, a, b, out, n);
+        break;
+#endif
+    default:
+        affineScalar(x, a, b, out, n);
+        break;
+    }
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 行列とベクトルの積(SIMD)
+
+static float dotScalar(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    for(int i = 0; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#ifdef DSP_X86
+static float dotSSE2(const float *a, const float *b, int n)
+{
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 acc = _mm_add_ps(acc0, acc1);
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc) + dotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float dotAVX2(const float *a, const float *b, int n)
+{
+    // 加算の依存を切るため、2本の累算器で16点ずつ
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s) + dotSSE2(a + i, b + i, n - i);
+}
+#endif
+
+void matVec(const float *w, int rows, int cols, int stride, const float *x, const float *bias, float *out)
+{
+    float (*dot)(const float *, const float *, int) = dotScalar;
+#ifdef DSP_X86
+    switch(simdLevel())
+    {
+    case SIMD_AVX2:
+        dot = dotAVX2;
+        break;
+    case SIMD_SSE2:
+        dot = dotSSE2;
+        break;
+    default:
+        break;
+    }
+#endif
+    for(int k = 0; k < rows; k++)
+    {
+        out[k] = dot(w + (qint64)k * stride, x, cols) + (bias ? bias[k] : 0);
+    }
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// RBFカーネル(SIMD)
+//
+// exp(v) (v <= 0) はCephesのexpfと同じく v = n ln2 + r (|r| <= ln2/2) に分け、
+// e^r を5次の多項式、2^n を指数部のビット操作で求める
+
+#define EXP_LO -87.3f
+#define EXP_C1 0.693359375f
+#define EXP_C2 -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+static void rbfKernelScalar(const float *rows, int count, int cols, int stride, const float *x, float gamma, float *out)
+{
+    for(int i = 0; i < count; i++)
+    {
+        const float *r = rows + (qint64)i * stride;
+        float sum = 0;
+        for(int j = 0; j < cols; j++)
+        {
+            float d = x[j] - r[j];
+            sum += d * d;
+        }
+        out[i] = expf(-gamma * sum);
+    }
+}
+
+#ifdef DSP_X86
+static inline float horizontalSum(__m128 s)
+{
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+static __m128 expSSE2(__m128 v)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    v = _mm_max_ps(v, _mm_set1_ps(EXP_LO));
+    // n = floor(v / ln2 + 0.5)(SSE2には切り捨てがないので、切り詰めてから負の側を補正する)
+    __m128 fx = _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps((float)M_LOG2E)), _mm_set1_ps(0.5f));
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+    fx = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, fx), one));
+    v = _mm_sub_ps(v, _mm_mul_ps(fx, _mm_set1_ps(EXP_C1)));
+    v = _mm_sub_ps(v, _mm_mul_ps(fx, _mm_set1_ps(EXP_C2)));
+    __m128 y = _mm_set1_ps(EXP_P0);
+    y = _mm_add_ps(_mm_mul_ps(y, v), _mm_set1_ps(EXP_P1));
+    y = _mm_add_ps(_mm_mul_ps(y, v), _mm_set1_ps(EXP_P2));
+    y = _mm_add_ps(_mm_mul_ps(y, v), _mm_set1_ps(EXP_P3));
+    y = _mm_add_ps(_mm_mul_ps(y, v), _mm_set1_ps(EXP_P4));
+    y = _mm_add_ps(_mm_mul_ps(y, v), _mm_set1_ps(EXP_P5));
+    y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(y, v), v), v), one);
+    __m128i n = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(n));
+}
+
+static void rbfKernelSSE2(const float *rows, int count, int cols, int stride, const float *x, float gamma, float *out)
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        float d[4];
+        for(int k = 0; k < 4; k++)
+        {
+            const float *r = rows + (qint64)(i + k) * stride;
+            __m128 acc = _mm_setzero_ps();
+            int j = 0;
+            for(; j + 4 <= cols; j += 4)
+            {
+                __m128 diff = _mm_sub_ps(_mm_loadu_ps(x + j), _mm_load_ps(r + j));
+                acc = _mm_add_ps(acc, _mm_mul_ps(diff, diff));
+            }
+            float sum = horizontalSum(acc);
+            for(; j < cols; j++) sum += (x[j] - r[j]) * (x[j] - r[j]);
+            d[k] = sum;
+        }
+        _mm_storeu_ps(out + i, expSSE2(_mm_mul_ps(_mm_set1_ps(-gamma), _mm_loadu_ps(d))));
+    }
+    rbfKernelScalar(rows + (qint64)i * stride, count - i, cols, stride, x, gamma, out + i);
+}
+
+__attribute__((target("avx2,fma")))
+static __m256 expAVX2(__m256 v)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    v = _mm256_max_ps(v, _mm256_set1_ps(EXP_LO));
+    __m256 fx = _mm256_floor_ps(_mm256_fmadd_ps(v, _mm256_set1_ps((float)M_LOG2E), _mm256_set1_ps(0.5f)));
+    v = _mm256_fnmadd_ps(fx, _mm256_set1_ps(EXP_C1), v);
+    v = _mm256_fnmadd_ps(fx, _mm256_set1_ps(EXP_C2), v);
+    __m256 y = _mm256_set1_ps(EXP_P0);
+    y = _mm256_fmadd_ps(y, v, _mm256_set1_ps(EXP_P1));
+    y = _mm256_fmadd_ps(y, v, _mm256_set1_ps(EXP_P2));
+    y = _mm256_fmadd_ps(y, v, _mm256_set1_ps(EXP_P3));
+    y = _mm256_fmadd_ps(y, v, _mm256_set1_ps(EXP_P4));
+    y = _mm256_fmadd_ps(y, v, _mm256_set1_ps(EXP_P5));
+    y = _mm256_add_ps(_mm256_fmadd_ps(_mm256_mul_ps(y, v), v, v), one);
+    __m256i n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+}
+
+__attribute__((target("avx2,fma")))
+static void rbfKernelAVX2(const float *rows, int count, int cols, int stride, const float *x, float gamma, float *out)
+{
+    // 8行ずつ距離を求め、expは8行まとめて1回
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        float d[8];
+        for(int k = 0; k < 8; k++)
+        {
+            const float *r = rows + (qint64)(i + k) * stride;
+            __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+            int j = 0;
+            for(; j + 16 <= cols; j += 16)
+            {
+                __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + j), _mm256_load_ps(r + j));
+                __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(x + j + 8), _mm256_load_ps(r + j + 8));
+                acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+                acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+            }
+            for(; j + 8 <= cols; j += 8)
+            {
+                __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + j), _mm256_load_ps(r + j));
+                acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+            }
+            __m256 acc = _mm256_add_ps(acc0, acc1);
+            float sum = horizontalSum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+            for(; j < cols; j++) sum += (x[j] - r[j]) * (x[j] - r[j]);
+            d[k] = sum;
+        }
+        _mm256_storeu_ps(out + i, expAVX2(_mm256_mul_ps(_mm256_set1_ps(-gamma), _mm256_loadu_ps(d))));
+    }
+    rbfKernelSSE2(rows + (qint64)i * stride, count - i, cols, stride, x, gamma, out + i);
+}
+#endif
+
+void rbfKernel(const float *rows, int count, int cols, int stride, const float *x, float gamma, float *out)
+{
+    // SSE2・AVX2版は行をアラインされた読み込み(_mm_load_ps・_mm256_load_ps)で読む
+    Q_ASSERT(((quintptr)rows & 31) == 0 && stride % 8 == 0);
+    switch(simdLevel())
+    {
+#ifdef DSP_X86
+    case SIMD_AVX2:
+        rbfKernelAVX2(rows, count, cols, stride, x, gamma, out);
+        break;
+    case SIMD_SSE2:
+        rbfKernelSSE2(rows, count, cols, stride, x, gamma, out);
+        break;
+#endif
+    default:
+        rbfKernelScalar(rows, count, cols, stride, x, gamma, out);
+        break;
+    }
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// FFTエンジン
+
+FFTEngine::FFTEngine(PlanMode mode)
+    : mode(mode)
+    , N(0)
+    , dirty(false)
+    , in(NULL)
+    , out(NULL)
+    , p(NULL)
+    , winType(WINDOW_HAMMING)
+    , winBeta(8.6f)
+    , allocCount(0)
+{
+}
+
+FFTEngine::~FFTEngine()
+{
+    release();
+}
+
+void FFTEngine::release()
+{
+    QMutexLocker locker(&planLock);
+    if(p != NULL) fftwf_destroy_plan(p);
+    if(in != NULL) fftwf_free(in);
+    if(out != NULL) fftwf_free(out);
+    p = NULL;
+    in = NULL;
+    out = NULL;
+}
+
+void FFTEngine::resize(int n)
+{
+    if(n == N && !dirty) return;
+    if(n != N)
+    {
+        release();
+        N = n;
+        if(N <= 0)
+        {
+            N = 0;
+            return;
+        }
+        // fftwf_mallocはfftw自身のSIMD(SSE)に合わせた領域を返す(16バイト境界までしか保証されない。fftwの入出力にはそれで足りる)
+        in = (float*)fftwf_malloc(sizeof(float) * N);
+        out = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * (N/2+1));
+        win.setup(winType, N, winBeta);
+        allocCount += 3;
+    }
+    plan();
+}
+
+void FFTEngine::setWindow(WindowType type, float beta)
+{
+    if(type == winType && beta == winBeta) return;
+    winType = type;
+    winBeta = beta;
+    if(N > 0)
+    {
+        win.setup(winType, N, winBeta);
+        allocCount++;
+    }
+}
+
+void FFTEngine::setPlanMode(PlanMode _mode)
+{
+    if(mode == _mode) return;
+    mode = _mode;
+    dirty = true;
+}
+
+void FFTEngine::plan()
+{
+    QMutexLocker locker(&planLock);
+    if(p != NULL) fftwf_destroy_plan(p);
+    // MEASURE/PATIENTはプラン作成中に入力バッファを書き換えるので、作成後にゼロクリアしておく
+    unsigned flags = (mode == PATIENT) ? FFTW_PATIENT : FFTW_MEASURE;
+    p = fftwf_plan_dft_r2c_1d(N, in, out, flags);
+    memset(in, 0, sizeof(float) * N);
+    dirty = false;
+    allocCount++;
+}
+
+void FFTEngine::execute()
+{
+    if(p == NULL) return;
+    fftwf_execute(p);
+}
+
+void FFTEngine::transform(const float *src)
+{
+    if(N == 0) return;
+    // プランの作り直しは入力バッファを書き換えるので、入力を書き込む前に行う
+    if(dirty) resize(N);
+    // 窓掛けとFFT入力へのコピーを1回のループで行う
+    win.apply(src, in);
+    execute();
+}
+
+void FFTEngine::spectrum(const float *src, float *dst, bool ma)
+{
+    if(N == 0) return;
+    transform(src);
+    if(ma)
+        logMagnitude(out, dst, N/2);
+    else
+    {
+        for(int i = 0; i < N/2; i++)
+        {
+            dst[i] = sqrtf(out[i][0]*out[i][0] + out[i][1]*out[i][1]);
+        }
+    }
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// STFTフレーマ
+
+STFTFramer::STFTFramer(int width, int hop)
+    : pos(0)
+    , _hop(0)
+    , count(0)
+    , ready(false)
+{
+    setup(width, hop);
+}
+
+void STFTFramer::setup(int width, int hop)
+{
+    buffer.resize(qMax(0, width));
+    _hop = (hop <= 0 || hop > width) ? width : hop;
+    reset();
+}
+
+void STFTFramer::reset()
+{
+    buffer.fill(0);
+    pos = 0;
+    count = 0;
+    ready = false;
+}
+
+int STFTFramer::write(const float *src, int n)
+{
+    int N = buffer.size();
+    if(N == 0 || ready) return 0;
+
+    // フレームの区切りまでしか取り込まない
+    n = qMin(n, _hop - count);
+    float *b = buffer.data();
+    int done = 0;
+    while(done < n)
+    {
+        // 循環バッファの終端までを一度にコピーする
+        int len = qMin(n - done, N - pos);
+        memcpy(b + pos, src + done, sizeof(float) * len);
+        pos = (pos + len) % N;
+        done += len;
+    }
+    count += n;
+    if(count == _hop)
+    {
+        count = 0;
+        ready = true;
+    }
+    return n;
+}
+
+void STFTFramer::read(float *dst)
+{
+    int N = buffer.size();
+    const float *b = buffer.constData();
+    // pos以降が古い側、pos未満が新しい側
+    memcpy(dst, b + pos, sizeof(float) * (N - pos));
+    memcpy(dst + (N - pos), b, sizeof(float) * pos);
+    ready = false;
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 窓関数
+
+// 第1種変形ベッセル関数 I0(x) (級数展開)
+static double besselI0(double x)
+{
+    double sum = 1, term = 1;
+    double q = x * x / 4;
+    for(int k = 1; k < 64; k++)
+    {
+        term *= q / ((double)k * k);
+        sum += term;
+        if(term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+WindowTable::WindowTable()
+    : _type(WINDOW_RECTANGULAR)
+    , _beta(0)
+    , N(0)
+    , w(NULL)
+{
+}
+
+WindowTable::~WindowTable()
+{
+    if(w != NULL) fftwf_free(w);
+}
+
+void WindowTable::setup(WindowType type, int n, float beta)
+{
+    if(type == _type && n == N && beta == _beta && w != NULL) return;
+    if(n != N || w == NULL)
+    {
+        if(w != NULL) fftwf_free(w);
+        w = NULL;
+        N = qMax(0, n);
+        if(N == 0) return;
+        w = (float*)fftwf_malloc(sizeof(float) * N);
+    }
+    _type = type;
+    _beta = beta;
+
+    // 以前のhamming()と同じく周期窓(分母N)で計算する
+    double i0beta = besselI0(beta);
+    for(int i = 0; i < N; i++)
+    {
+        double x = 2.*M_PI*i/(double)N;
+        double c;
+        switch(type)
+        {
+        case WINDOW_HAMMING:
+            c = 0.54 - 0.46 * cos(x);
+            break;
+        case WINDOW_HANN:
+            c = 0.5 - 0.5 * cos(x);
+            break;
+        case WINDOW_BLACKMAN_HARRIS:
+            c = 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2*x) - 0.01168 * cos(3*x);
+            break;
+        case WINDOW_KAISER:
+        {
+            double r = 2.*i/(double)N - 1;
+            c = besselI0(beta * sqrt(qMax(0., 1 - r*r))) / i0beta;
+            break;
+        }
+        default:
+            c = 1;
+            break;
+        }
+        w[i] = c;
+    }
+}
+
+void WindowTable::apply(const float *src, float *dst) const
+{
+    const float *c = w;
+    for(int i = 0; i < N; i++)
+    {
+        dst[i] = src[i] * c[i];
+    }
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 帯域限定スペクトル解析
+
+// n以上で素因数が2,3,5だけの最小の数(FFTWが速いサイズ)
+static int goodFFTSize(int n)
+{
+    for(int m = qMax(1, n); ; m++)
+    {
+        int r = m;
+        while(r % 2 == 0) r /= 2;
+        while(r % 3 == 0) r /= 3;
+        while(r % 5 == 0) r /= 5;
+        if(r == 1) return m;
+    }
+}
+
+double BandAnalyzer::fullFFTCost(int n, int bins)
+{
+    // 実数FFT(N点) + 帯域内ビンの対数振幅
+    return 2.5 * n * log2((double)qMax(2, n)) + 20. * bins;
+}
+
+double BandAnalyzer::chirpZCost(int n, int bins)
+{
+    // 複素FFT(L点)を往復2回 + チャープの乗算 + 対数振幅
+    int l = goodFFTSize(n + bins - 1);
+    return 2 * 5. * l * log2((double)qMax(2, l)) + 6. * (n + l + bins) + 20. * bins;
+}
+
+double BandAnalyzer::goertzelCost(int n, int bins)
+{
+    // ビンごとにN回の漸化式(乗算1回・加算2回)
+    return 3. * n * bins + 20. * bins;
+}
+
+BandAnalyzer::BandAnalyzer()
+    : N(0)
+    , M(0)
+    , L(0)
+    , rate(0)
+    , f0(0)
+    , df(0)
+    , requested(AUTO)
+    , chosen(AUTO)
+    , y(NULL)
+    , pre(NULL)
+    , post(NULL)
+    , V(NULL)
+    , coef(NULL)
+    , forward(NULL)
+    , backward(NULL)
+{
+}
+
+BandAnalyzer::~BandAnalyzer()
+{
+    release();
+}
+
+void BandAnalyzer::release()
+{
+    QMutexLocker locker(&planLock);
+    if(forward != NULL) fftwf_destroy_plan(forward);
+    if(backward != NULL) fftwf_destroy_plan(backward);
+    if(y != NULL) fftwf_free(y);
+    if(pre != NULL) fftwf_free(pre);
+    if(post != NULL) fftwf_free(post);
+    if(V != NULL) fftwf_free(V);
+    if(coef != NULL) fftwf_free(coef);
+    forward = backward = NULL;
+    y = pre = post = V = NULL;
+    coef = NULL;
+}
+
+void BandAnalyzer::setup(int n, int sampleRate, double _f0, double _df, int bins, Method method)
+{
+    if(n == N && sampleRate == rate && _f0 == f0 && _df == df && bins == M && method == requested) return;
+    release();
+    N = n;
+    rate = sampleRate;
+    f0 = _f0;
+    df = _df;
+    M = bins;
+    requested = method;
+    if(N <= 0 || M <= 0 || rate <= 0) return;
+
+    chosen = method;
+    if(chosen == AUTO)
+        chosen = chirpZCost(N, M) < goertzelCost(N, M) ? CHIRP_Z : GOERTZEL;
+
+    if(chosen == GOERTZEL)
+    {
+        coef = (float*)fftwf_malloc(sizeof(float) * M);
+        for(int k = 0; k < M; k++)
+        {
+            coef[k] = 2 * cos(2 * M_PI * (f0 + k * df) / rate);
+        }
+        return;
+    }
+
+    // チャープZ変換: X[k] = sum x[n] A^-n W^nk,  A = exp(j2πf0/fs), W = exp(-j2πdf/fs)
+    // nk = (n^2 + k^2 - (k-n)^2)/2 を使って、W^(-(k-n)^2/2) との畳み込み(FFT)に直す
+    L = goodFFTSize(N + M - 1);
+    y = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * L);
+    pre = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * N);
+    post = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * M);
+    V = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * L);
+
+    double a = 2 * M_PI * f0 / rate;
+    double w = 2 * M_PI * df / rate;
+    for(int i = 0; i < N; i++)
+    {
+        // 位相は大きくなるのでdoubleで2πの剰余をとってから三角関数に渡す
+        double ph = fmod(-a * i - w * 0.5 * (double)i * i, 2 * M_PI);
+        pre[i][0] = cos(ph);
+        pre[i][1] = sin(ph);
+    }
+    for(int k = 0; k < M; k++)
+    {
+        double ph = fmod(-w * 0.5 * (double)k * k, 2 * M_PI);
+        post[k][0] = cos(ph) / L;
+        post[k][1] = sin(ph) / L;
+    }
+    for(int i = 0; i < L; i++)
+    {
+        V[i][0] = V[i][1] = 0;
+    }
+    for(int i = 0; i < qMax(N, M); i++)
+    {
+        double ph = fmod(w * 0.5 * (double)i * i, 2 * M_PI);
+        if(i < M)
+        {
+            V[i][0] = cos(ph);
+            V[i][1] = sin(ph);
+        }
+        if(i > 0 && i < N)
+        {
+            V[L - i][0] = cos(ph);
+            V[L - i][1] = sin(ph);
+        }
+    }
+
+    QMutexLocker locker(&planLock);
+    fftwf_plan vp = fftwf_plan_dft_1d(L, V, V, FFTW_FORWARD, FFTW_ESTIMATE);
+    fftwf_execute(vp);
+    fftwf_destroy_plan(vp);
+    forward = fftwf_plan_dft_1d(L, y, y, FFTW_FORWARD, FFTW_MEASURE);
+    backward = fftwf_plan_dft_1d(L, y, y, FFTW_BACKWARD, FFTW_MEASURE);
+}
+
+void BandAnalyzer::process(const float *src, float *dst)
+{
+    if(M <= 0 || N <= 0) return;
+
+    if(chosen == GOERTZEL)
+    {
+        for(int k = 0; k < M; k++)
+        {
+            float c = coef[k];
+            float s1 = 0, s2 = 0;
+            for(int i = 0; i < N; i++)
+            {
+                float s0 = src[i] + c * s1 - s2;
+                s2 = s1;
+                s1 = s0;
+            }
+            float power = s1 * s1 + s2 * s2 - c * s1 * s2;
+            dst[k] = log10f(1 + sqrtf(qMax(0.f, power)));
+        }
+        return;
+    }
+
+    for(int i = 0; i < N; i++)
+    {
+        y[i][0] = src[i] * pre[i][0];
+        y[i][1] = src[i] * pre[i][1];
+    }
+    memset(y + N, 0, sizeof(fftwf_complex) * (L - N));
+    fftwf_execute(forward);
+    for(int i = 0; i < L; i++)
+    {
+        float re = y[i][0] * V[i][0] - y[i][1] * V[i][1];
+        float im = y[i][0] * V[i][1] + y[i][1] * V[i][0];
+        y[i][0] = re;
+        y[i][1] = im;
+    }
+    fftwf_execute(backward);
+    // 振幅だけが必要なので、post側の位相は掛けても掛けなくても同じだが、複素値として正しくしておく
+    for(int k = 0; k < M; k++)
+    {
+        float re = y[k][0] * post[k][0] - y[k][1] * post[k][1];
+        float im = y[k][0] * post[k][1] + y[k][1] * post[k][0];
+        y[k][0] = re;
+        y[k][1] = im;
+    }
+    logMagnitude(y, dst, M);
+}
+
+
+/*====================================================================================================================================================================================================================================================================================*/
+// プローブ信号
+
+// チャープの両端10%のフェード。min()で書いて分岐をなくす
+static void fadeEdges(float *x, int n)
+{
+    double ramp = n / 10.;
+    if(ramp < 1) return;
+    for(int p = 0; p < n; p++)
+    {
+        double env = qMin(1.0, qMin(p / ramp, (n - p) / ramp));
+        x[p] = (float)(x[p] * env);
+    }
+}
+
+// Galois型LFSRの帰還係数(m = 2..20、いずれも周期2^m-1になることを確認済み)
+static const quint32 mlsTaps[21] = {
+    0, 0, 0x3, 0x6, 0xC, 0x14, 0x30, 0x60, 0xB8, 0x110, 0x240, 0x500, 0x829,
+    0x100D, 0x2015, 0x6000, 0xD008, 0x12000, 0x20400, 0x40023, 0x90000
+};
+
+// xを周期信号とみなして帯域 [minHz, maxHz] 以外の成分を取り除き、最大振幅を1にする
+// 周期全体を1回のFFTで扱うので(巡回畳み込み)、繰り返しても継ぎ目に不連続が生じない
+static void bandLimitPeriodic(float *x, int n, int sampleRate, int minHz, int maxHz)
+{
+    float *buf = (float *)fftwf_malloc(sizeof(float) * n);
+    fftwf_complex *spec = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (n/2 + 1));
+    fftwf_plan forward, backward;
+    {
+        QMutexLocker locker(&planLock);
+        forward = fftwf_plan_dft_r2c_1d(n, buf, spec, FFTW_ESTIMATE);
+        backward = fftwf_plan_dft_c2r_1d(n, spec, buf, FFTW_ESTIMATE);
+    }
+    memcpy(buf, x, sizeof(float) * n);
+    fftwf_execute(forward);
+    for(int k = 0; k <= n/2; k++)
+    {
+        double f = k * (double)sampleRate / n;
+        if(f < minHz || f > maxHz) spec[k][0] = spec[k][1] = 0;
+    }
+    fftwf_execute(backward);
+    float peak = 0;
+    for(int i = 0; i < n; i++) peak = qMax(peak, fabsf(buf[i]));
+    float g = peak > 0 ? 1 / peak : 0;
+    for(int i = 0; i < n; i++) x[i] = buf[i] * g;
+    {
+        QMutexLocker locker(&planLock);
+        fftwf_destroy_plan(forward);
+        fftwf_destroy_plan(backward);
+    }
+    fftwf_free(buf);
+    fftwf_free(spec);
+}
+
+QVector<float> renderProbe(ProbeWaveform type, int sampleRate, int minHz, int maxHz, int samples)
+{
+    QVector<float> out;
+    if(samples <= 0 || sampleRate <= 0) return out;
+    double f0 = qMin(minHz, maxHz), f1 = qMax(minHz, maxHz);
+
+    switch(type)
+    {
+    case PROBE_LOG_CHIRP:
+        if(f0 > 0)
+        {
+            // 瞬時周波数 f0 * (f1/f0)^(p/N) を積分した位相
+            out.resize(samples);
+            float *x = out.data();
+            double k = log(f1 / f0) / samples;
+            double a = 2 * M_PI * f0 / sampleRate;
+            for(int p = 0; p < samples; p++)
+            {
+                double phase = k > 0 ? a * (exp(k * p) - 1) / k : a * p;
+                x[p] = (float)sin(phase);
+            }
+            fadeEdges(x, samples);
+            break;
+        }
+        // f0が0なら対数チャープは定義できないので線形チャープにする
+    case PROBE_LINEAR_CHIRP:
+    {
+        // 従来のスイープと同じ離散時間の位相: 2π/fs * Σ_{q<p} (f0 + df q)
+        out.resize(samples);
+        float *x = out.data();
+        double df = (f1 - f0) / samples;
+        double a = 2 * M_PI / sampleRate;
+        for(int p = 0; p < samples; p++)
+        {
+            x[p] = (float)sin(a * (f0 * p + df * p * (p - 1.0) / 2));
+        }
+        fadeEdges(x, samples);
+        break;
+    }
+    case PROBE_MLS:
+    {
+        int m = 2;
+        while(m < 20 && ((1 << (m + 1)) - 1) <= samples) m++;
+        int n = (1 << m) - 1;
+        out.resize(n);
+        float *x = out.data();
+        quint32 state = 1;
+        for(int i = 0; i < n; i++)
+        {
+            quint32 bit = state & 1;
+            x[i] = bit ? 1.f : -1.f;
+            state >>= 1;
+            if(bit) state ^= mlsTaps[m];
+        }
+        bandLimitPeriodic(x, n, sampleRate, (int)f0, (int)f1);
+        break;
+    }
+    case PROBE_MULTITONE:
+    {
+        // 周期の中で整数回振動する周波数(fs/samplesの倍数)だけを使い、継ぎ目を連続にする
+        out.fill(0, samples);
+        float *x = out.data();
+        double bin = (double)sampleRate / samples;
+        int lo = qMax(1, (int)ceil(f0 / bin));
+        int hi = qMin(samples / 2 - 1, (int)floor(f1 / bin));
+        if(hi < lo) break;
+        const int MAX_TONES = 32;
+        int tones = qMin(MAX_TONES, hi - lo + 1);
+        double peak = 0;
+        QVector<double> acc(samples, 0.0);
+        for(int t = 0; t < tones; t++)
+        {
+            int k = tones > 1 ? lo + (int)((hi - lo) * (double)t / (tones - 1) + 0.5) : lo;
+            double w = 2 * M_PI * k / samples;
+            double phi = -M_PI * t * (t - 1.0) / tones; // Schroeder位相
+            for(int p = 0; p < samples; p++) acc[p] += cos(w * p + phi);
+        }
+        for(int p = 0; p < samples; p++) peak = qMax(peak, fabs(acc[p]));
+        double g = peak > 0 ? 1 / peak : 0;
+        for(int p = 0; p < samples; p++) x[p] = (float)(acc[p] * g);
+        break;
+    }
+    }
+    return out;
+}
+
+
+/*====================================================================================================================================================================================================================================================================================*/
+// スイープ同期フレーマ
+
+SweepFramer::SweepFramer()
+    : P(0)
+    , K(1)
+    , lockPeriods(4)
+    , isLocked(false)
+    , ready(false)
+    , lag(0)
+    , quality(0)
+    , lockCount(0)
+    , skip(0)
+    , pos(0)
+    , slot(0)
+    , filled(0)
+    , discard(0)
+    , corr(NULL)
+    , spec(NULL)
+    , probeSpec(NULL)
+    , forward(NULL)
+    , backward(NULL)
+{
+}
+
+SweepFramer::~SweepFramer()
+{
+    release();
+}
+
+void SweepFramer::release()
+{
+    QMutexLocker locker(&planLock);
+    if(forward) fftwf_destroy_plan(forward);
+    if(backward) fftwf_destroy_plan(backward);
+    if(corr) fftwf_free(corr);
+    if(spec) fftwf_free(spec);
+    if(probeSpec) fftwf_free(probeSpec);
+    forward = backward = NULL;
+    corr = NULL;
+    spec = probeSpec = NULL;
+}
+
+void SweepFramer::setup(const QVector<float> &probe, int averages, int _lockPeriods)
+{
+    averages = qMax(1, averages);
+    _lockPeriods = qMax(1, _lockPeriods);
+    if(probe.size() == P && averages == K && _lockPeriods == lockPeriods && probe.size() > 0
+            && memcmp(probe.constData(), probeWave.constData(), sizeof(float) * P) == 0)
+        return;
+
+    release();
+    probeWave = probe;
+    P = probe.size();
+    K = averages;
+    lockPeriods = _lockPeriods;
+    acc.fill(0, P);
+    history.fill(0, K * P);
+    if(P > 0)
+    {
+        corr = (float *)fftwf_malloc(sizeof(float) * P);
+        spec = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (P/2 + 1));
+        probeSpec = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (P/2 + 1));
+        {
+            QMutexLocker locker(&planLock);
+            forward = fftwf_plan_dft_r2c_1d(P, corr, spec, FFTW_ESTIMATE);
+            backward = fftwf_plan_dft_c2r_1d(P, spec, corr, FFTW_ESTIMATE);
+        }
+        memcpy(corr, probe.constData(), sizeof(float) * P);
+        fftwf_execute(forward);
+        for(int k = 0; k <= P/2; k++)
+        {
+            probeSpec[k][0] = spec[k][0];
+            probeSpec[k][1] = -spec[k][1];
+        }
+    }
+    reset();
+}
+
+void SweepFramer::reset()
+{
+    isLocked = false;
+    ready = false;
+    lag = 0;
+    quality = 0;
+    lockCount = 0;
+    skip = 0;
+    pos = 0;
+    slot = 0;
+    filled = 0;
+    discard = 0;
+    acc.fill(0);
+}
+
+void SweepFramer::resync()
+{
+    reset();
+    discard = 1;
+}
+
+// 同期加算した入力とprobeの巡回相互相関 c[d] = Σ x[n] p[n-d] のピークから遅延dを求める
+// x[n] = h * p[n-d0] ならdはd0になり、入力のd0点目(mod P)がスイープの先頭にあたる
+void SweepFramer::lock()
+{
+    memcpy(corr, acc.constData(), sizeof(float) * P);
+    fftwf_execute(forward);
+    for(int k = 0; k <= P/2; k++)
+    {
+        float re = spec[k][0] * probeSpec[k][0] - spec[k][1] * probeSpec[k][1];
+        float im = spec[k][0] * probeSpec[k][1] + spec[k][1] * probeSpec[k][0];
+        spec[k][0] = re;
+        spec[k][1] = im;
+    }
+    fftwf_execute(backward);
+
+    // 極性が反転していても揃えられるように絶対値で探す
+    int best = 0;
+    double sum = 0;
+    for(int d = 0; d < P; d++)
+    {
+        sum += fabsf(corr[d]);
+        if(fabsf(corr[d]) > fabsf(corr[best])) best = d;
+    }
+    lag = best;
+    quality = sum > 0 ? (float)(fabsf(corr[best]) / (sum / P)) : 0;
+
+    // ここまでに取り込んだのはlockPeriods周期ちょうどなので、次の入力は周期内の0点目。lag点読み捨てればスイープの先頭になる
+    isLocked = true;
+    skip = lag;
+    pos = 0;
+}
+
+int SweepFramer::write(const float *src, int n)
+{
+    if(P <= 0) return n;
+    int i = 0;
+    while(i < n && !ready)
+    {
+        if(!isLocked)
+        {
+            int m = qMin(n - i, P - pos);
+            float *a = acc.data() + pos;
+            for(int j = 0; j < m; j++) a[j] += src[i + j];
+            i += m;
+            pos += m;
+            if(pos == P)
+            {
+                pos = 0;
+                if(++lockCount == lockPeriods) lock();
+            }
+            continue;
+        }
+        if(skip > 0)
+        {
+            int m = qMin(skip, n - i);
+            skip -= m;
+            i += m;
+            continue;
+        }
+        int m = qMin(n - i, P - pos);
+        memcpy(history.data() + slot * P + pos, src + i, sizeof(float) * m);
+        i += m;
+        pos += m;
+        if(pos == P)
+        {
+            pos = 0;
+            // 捨てる周期は同じ位置に次の周期を上書きする
+            if(discard > 0)
+            {
+                discard--;
+                continue;
+            }
+            slot = (slot + 1) % K;
+            if(filled < K) filled++;
+            ready = true;
+        }
+    }
+    return i;
+}
+
+void SweepFramer::read(float *dst)
+{
+    // 直近filled周期の平均(起動直後はK周期に満たない分だけで平均する)
+    // 最新の周期はslot-1、その前はslot-2 ... の位置にある
+    int newest = (slot + K - 1) % K;
+    memcpy(dst, history.constData() + newest * P, sizeof(float) * P);
+    for(int s = 1; s < filled; s++)
+    {
+        const float *h = history.constData() + ((newest + K - s) % K) * P;
+        for(int j = 0; j < P; j++) dst[j] += h[j];
+    }
+    if(filled > 1)
+    {
+        float g = 1.f / filled;
+        for(int j = 0; j < P; j++) dst[j] *= g;
+    }
+    ready = false;
+}
+
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 整合フィルタ
+
+MatchedFilter::MatchedFilter()
+    : P(0)
+    , rate(0)
+    , energy(0)
+    , epsilon(0)
+    , y(NULL)
+    , spec(NULL)
+    , probeConj(NULL)
+    , probePower(NULL)
+    , forward(NULL)
+    , backward(NULL)
+    , allocCount(0)
+{
+}
+
+MatchedFilter::~MatchedFilter()
+{
+    release();
+}
+
+void MatchedFilter::release()
+{
+    QMutexLocker locker(&planLock);
+    if(forward) fftwf_destroy_plan(forward);
+    if(backward) fftwf_destroy_plan(backward);
+    if(y) fftwf_free(y);
+    if(spec) fftwf_free(spec);
+    if(probeConj) fftwf_free(probeConj);
+    if(probePower) fftwf_free(probePower);
+    forward = backward = NULL;
+    y = probePower = NULL;
+    spec = probeConj = NULL;
+}
+
+void MatchedFilter::setup(const QVector<float> &probe, int sampleRate)
+{
+    if(probe.size() == P && sampleRate == rate && P > 0
+            && memcmp(probe.constData(), probeWave.constData(), sizeof(float) * P) == 0)
+        return;
+
+    release();
+    probeWave = probe;
+    P = probe.size();
+    rate = sampleRate;
+    if(P == 0) return;
+
+    y = (float *)fftwf_malloc(sizeof(float) * P);
+    spec = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (P/2 + 1));
+    probeConj = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (P/2 + 1));
+    probePower = (float *)fftwf_malloc(sizeof(float) * (P/2 + 1));
+    {
+        QMutexLocker locker(&planLock);
+        forward = fftwf_plan_dft_r2c_1d(P, y, spec, FFTW_ESTIMATE);
+        backward = fftwf_plan_dft_c2r_1d(P, spec, y, FFTW_ESTIMATE);
+    }
+    allocCount++;
+
+    energy = 0;
+    for(int i = 0; i < P; i++) energy += probe[i] * probe[i];
+    memcpy(y, probe.constData(), sizeof(float) * P);
+    fftwf_execute(forward);
+    float maxPower = 0;
+    for(int k = 0; k <= P/2; k++)
+    {
+        probeConj[k][0] = spec[k][0];
+        probeConj[k][1] = -spec[k][1];
+        probePower[k] = spec[k][0] * spec[k][0] + spec[k][1] * spec[k][1];
+        maxPower = qMax(maxPower, probePower[k]);
+    }
+    epsilon = 1e-3f * maxPower;
+    for(int k = 0; k <= P/2; k++) probePower[k] += epsilon;
+}
+
+void MatchedFilter::correlate(const float *frame, int n)
+{
+    if(P == 0) return;
+    int periods = n / P;
+    if(periods == 0)
+    {
+        memcpy(y, frame, sizeof(float) * n);
+        memset(y + n, 0, sizeof(float) * (P - n));
+    }
+    else
+    {
+        memcpy(y, frame, sizeof(float) * P);
+        for(int m = 1; m < periods; m++)
+        {
+            const float *x = frame + m * P;
+            for(int i = 0; i < P; i++) y[i] += x[i];
+        }
+        float g = 1.f / periods;
+        for(int i = 0; i < P; i++) y[i] *= g;
+    }
+
+    fftwf_execute(forward);
+    for(int k = 0; k <= P/2; k++)
+    {
+        float re = spec[k][0] * probeConj[k][0] - spec[k][1] * probeConj[k][1];
+        float im = spec[k][0] * probeConj[k][1] + spec[k][1] * probeConj[k][0];
+        spec[k][0] = re;
+        spec[k][1] = im;
+    }
+}
+
+void MatchedFilter::impulse(float *dst, int taps)
+{
+    if(P == 0) return;
+    // c2rは入力(spec)を壊すことがあるので、同じフレームでtransfer()も使うなら先に呼ぶこと
+    fftwf_execute(backward);
+    // FFTWの逆変換は正規化されないのでPで割り、さらにprobeのエネルギーで割る
+    float g = energy > 0 ? 1.f / (P * energy) : 0;
+    int peak = 0;
+    for(int d = 1; d < P; d++)
+    {
+        if(fabsf(y[d]) > fabsf(y[peak])) peak = d;
+    }
+    for(int t = 0; t < taps; t++)
+    {
+        dst[t] = log10f(1 + fabsf(y[(peak + t) % P]) * g);
+    }
+}
+
+void MatchedFilter::transfer(float *dst, double minHz, double maxHz, int bins)
+{
+    if(P == 0 || bins <= 0) return;
+    double binHz = rate / (double)P;
+    for(int j = 0; j < bins; j++)
+    {
+        double fa = minHz + (maxHz - minHz) * j / bins;
+        double fb = minHz + (maxHz - minHz) * (j + 1) / bins;
+        int ka = qBound(0, (int)ceil(fa / binHz - 1e-9), P/2);
+        int kb = qBound(ka + 1, (int)ceil(fb / binHz - 1e-9), P/2 + 1);
+        float sum = 0;
+        for(int k = ka; k < kb; k++)
+        {
+            sum += sqrtf(spec[k][0] * spec[k][0] + spec[k][1] * spec[k][1]) / probePower[k];
+        }
+        dst[j] = log10f(1 + sum / (kb - ka));
+    }
+}
@@ -0,0 +1,354 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <fftw3.h>
+#include <QVector>
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 窓関数
+enum WindowType {
+    WINDOW_RECTANGULAR,
+    WINDOW_HAMMING,
+    WINDOW_HANN,
+    WINDOW_BLACKMAN_HARRIS, // 4項。サイドローブ-92dBで漏れが最も少ないが、メインローブは最も広い
+    WINDOW_KAISER           // betaで漏れと分解能のバランスを連続的に調整できる(beta=0で矩形窓)
+};
+
+// 窓関数の係数表
+// フレーム幅と種類が変わったときだけ係数を計算し、アラインされた領域に保持する
+class WindowTable
+{
+public:
+    WindowTable();
+    ~WindowTable();
+
+    // 種類・幅・Kaiserのbetaが前回と同じなら何もしない
+    void setup(WindowType type, int n, float beta = 8.6f);
+    WindowType type() const { return _type; }
+    float beta() const { return _beta; }
+    int size() const { return N; }
+    const float *coefficients() const { return w; }
+
+    // dst[i] = src[i] * w[i]
+    void apply(const float *src, float *dst) const;
+
+private:
+    WindowType _type;
+    float _beta;
+    int N;
+    float *w;
+
+    WindowTable(const WindowTable &);
+    WindowTable &operator=(const WindowTable &);
+};
+
+/*====================================================================================================================================================================================================================================================================================*/
+// FFTエンジン
+// プランと入出力バッファ(fftwf_mallocでSIMDアラインされる)をフレーム幅ごとに保持し、毎フレーム再利用する。
+// フレーム幅が変わったときだけプランとバッファを作り直す
+class FFTEngine
+{
+public:
+    // プラン作成時の最適化レベル。PATIENTはプラン作成に時間がかかるが実行は速くなることがある
+    enum PlanMode {
+        MEASURE,
+        PATIENT
+    };
+
+    explicit FFTEngine(PlanMode mode = MEASURE);
+    ~FFTEngine();
+
+    // フレーム幅を設定。同じ幅なら何もしない
+    void resize(int n);
+    // プランモードを変更。変わった場合は次のresize/transformでプランを作り直す
+    void setPlanMode(PlanMode mode);
+    PlanMode planMode() const { return mode; }
+    int size() const { return N; }
+
+    // 入力バッファ(実数N点)と出力バッファ(複素N/2+1点)。直接書き込み/読み出してよい
+    float *input() { return in; }
+    fftwf_complex *output() { return out; }
+
+    // input()の内容をFFTしてoutput()に書き出す
+    void execute();
+    // 窓関数を設定(既定はハミング窓)。係数はフレーム幅ごとに一度だけ計算される
+    void setWindow(WindowType type, float beta = 8.6f);
+    const WindowTable &window() const { return win; }
+
+    // srcに窓関数を掛けながらinput()に書き込んでFFTする。結果はoutput()に入る
+    void transform(const float *src);
+    // transform()を行い、N/2点のスペクトルをdstに書き出す
+    // maがtrueなら log10(1+|X|)、falseなら |X|
+    void spectrum(const float *src, float *dst, bool ma = true);
+
+    // バッファ・プラン・窓関数表を作り直した回数(デバッグ用のメモリ確保カウンタ)
+    int allocations() const { return allocCount; }
+
+private:
+    void release();
+    void plan();
+
+private:
+    PlanMode mode;
+    int N;
+    bool dirty;
+    float *in;
+    fftwf_complex *out;
+    fftwf_plan p;
+    WindowTable win;
+    WindowType winType;
+    float winBeta;
+    int allocCount;
+
+    // コピー禁止(プランとバッファを二重に解放しないように)
+    FFTEngine(const FFTEngine &);
+    FFTEngine &operator=(const FFTEngine &);
+};
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 帯域限定スペクトル解析
+// 指定した周波数帯域のビンだけを、フレーム幅と独立した周波数間隔で求める。
+// チャープZ変換(Bluestein法, FFT 2回)とGoertzelフィルタバンク(ビンごとに2次の漸化式)を持ち、
+// AUTOでは演算量の見積もりが小さい方を使う
+class BandAnalyzer
+{
+public:
+    enum Method {
+        AUTO,
+        CHIRP_Z,
+        GOERTZEL
+    };
+
+    BandAnalyzer();
+    ~BandAnalyzer();
+
+    // n点の入力から、周波数 f0 + k*df [Hz] (k = 0..bins-1) の振幅を求めるように設定する
+    // 設定が前回と同じなら何もしない。メモリ確保とプラン作成はここでのみ行う
+    void setup(int n, int sampleRate, double f0, double df, int bins, Method method = AUTO);
+    Method method() const { return chosen; }
+    int bins() const { return M; }
+
+    // src(n点、窓関数は掛け済み)から対数振幅 log10(1+|X|) を求めてdst(bins点)に書き出す
+    void process(const float *src, float *dst);
+
+    // 演算量の見積もり(浮動小数点演算回数のおおよその値)
+    static double fullFFTCost(int n, int bins);
+    static double chirpZCost(int n, int bins);
+    static double goertzelCost(int n, int bins);
+
+private:
+    void release();
+
+private:
+    int N, M, L;
+    int rate;
+    double f0, df;
+    Method requested, chosen;
+    fftwf_complex *y;      // 作業領域(L点)
+    fftwf_complex *pre;    // 入力に掛けるチャープ A^-n W^(n^2/2) (N点)
+    fftwf_complex *post;   // 出力に掛けるチャープ W^(k^2/2) / L (M点)
+    fftwf_complex *V;      // W^-(k^2/2) のFFT (L点)
+    float *coef;           // Goertzelの係数 2cos(w) (M点)
+    fftwf_plan forward, backward;
+
+    BandAnalyzer(const BandAnalyzer &);
+    BandAnalyzer &operator=(const BandAnalyzer &);
+};
+
+/*====================================================================================================================================================================================================================================================================================*/
+// STFTフレーマ
+// 直近width点を保持する循環バッファ。hop点取り込むごとに1フレームを切り出す
+// (width - hop)点がフレーム間のオーバーラップになる。コールバックの大きさに関係なくフレームレートはサンプリングレート/hopで一定
+class STFTFramer
+{
+public:
+    STFTFramer(int width = 0, int hop = 0);
+
+    // hopが0以下ならオーバーラップなし(hop = width)
+    void setup(int width, int hop);
+    void reset();
+    int width() const { return buffer.size(); }
+    int hop() const { return _hop; }
+
+    // srcから最大n点を取り込む。フレームの区切りに達したらそこで止め、取り込んだ点数を返す
+    int write(const float *src, int n);
+    // 切り出し待ちのフレームがあるか
+    bool frameReady() const { return ready; }
+    // 直近width点を古い順にdstへコピーし、frameReadyを下ろす
+    void read(float *dst);
+
+private:
+    QVector<float> buffer;
+    int pos;    // 次に書き込む位置(=最も古いサンプルの位置)
+    int _hop;
+    int count;  // 前回のフレームから取り込んだ点数
+    bool ready;
+};
+
+/*====================================================================================================================================================================================================================================================================================*/
+// スイープ同期フレーマ
+// 出力したスイープ(1周期分の波形)との巡回相互相関で再生から録音までの遅延を測り、入力をスイープの周期の先頭に揃えて1周期ずつ切り出す。
+// averagesが2以上なら、直近averages周期を同期加算平均(コヒーレント平均)してから出力する。
+// 周期ごとに1フレーム出力するので、平均しても出力の間隔と遅延は1周期のまま(無相関の雑音は約1/sqrt(averages)になる)
+class SweepFramer
+{
+public:
+    SweepFramer();
+    ~SweepFramer();
+
+    // probeは1周期分の出力波形。遅延の測定は、入力のlockPeriods周期分を同期加算したものとprobeの相関で行う
+    // 設定が前回と同じなら何もしない。メモリ確保とFFTのプラン作成はここでのみ行う
+    void setup(const QVector<float> &probe, int averages = 1, int lockPeriods = 4);
+    // 遅延を測り直す
+    void reset();
+    // 入力が途切れたとき(リングバッファのあふれなど)に測り直す。reset()に加えて、測り直した直後の1周期も出力しない
+    // (途切れる前のサンプルが混ざっていても、次の周期からは揃った位置で切り出せる)
+    void resync();
+    // 出力するフレームの幅(=1周期のサンプル数)
+    int width() const { return P; }
+    int averages() const { return K; }
+    bool locked() const { return isLocked; }
+    // 測定した遅延[サンプル](0..width()-1)と、相関のピークの鋭さ(ピーク/絶対値の平均)
+    int offset() const { return lag; }
+    float lockQuality() const { return quality; }
+
+    // srcから最大n点を取り込む。フレームの区切りに達したらそこで止め、取り込んだ点数を返す(STFTFramerと同じ)
+    int write(const float *src, int n);
+    bool frameReady() const { return ready; }
+    // スイープの先頭から1周期分(平均済み)をdstにコピーし、frameReadyを下ろす
+    void read(float *dst);
+
+private:
+    void release();
+    void lock();
+
+private:
+    QVector<float> probeWave;
+    int P, K, lockPeriods;
+    bool isLocked, ready;
+    int lag;
+    float quality;
+    int lockCount;  // ロック前: 同期加算した周期数
+    int skip;       // ロック後、周期の先頭まで読み捨てる残りのサンプル数
+    int pos;        // 周期内の書き込み位置
+    int slot;       // 次に書き込む周期の番号 (0..K-1)
+    int filled;     // 平均に使える周期数 (<= K)
+    int discard;    // ロック後に出力せずに捨てる残りの周期数
+    QVector<float> acc;     // ロック前の同期加算 (P点)
+    QVector<float> history; // 直近K周期 (K*P点)
+    // 相関用(P点のFFT)。probeのスペクトルの共役はsetup()で一度だけ求める
+    float *corr;
+    fftwf_complex *spec, *probeSpec;
+    fftwf_plan forward, backward;
+
+    SweepFramer(const SweepFramer &);
+    SweepFramer &operator=(const SweepFramer &);
+};
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 整合フィルタ
+// 出力したスイープ(1周期分の波形)と入力フレームの相互相関をFFTで求め、音響的なインパルス応答/伝達関数を推定する
+// スイープのスペクトル(の共役)はsetup()で一度だけ求めて保持する。入力は周期ごとに同期加算してから1周期分の巡回相関をとるので、
+// スイープが周期的に出力されていれば、フレームの切り出し位置によらず同じ応答(遅延だけがずれたもの)になる
+class MatchedFilter
+{
+public:
+    MatchedFilter();
+    ~MatchedFilter();
+
+    // probeは1周期分の出力波形。設定が前回と同じなら何もしない。メモリ確保とFFTのプラン作成はここでのみ行う
+    void setup(const QVector<float> &probe, int sampleRate);
+    int period() const { return P; }
+    int allocations() const { return allocCount; }
+
+    // frame(n点)を周期ごとに同期加算し(1周期に満たない末尾は使わない。n < 周期なら0で埋める)、
+    // そのスペクトルとprobeのスペクトルの共役の積を求める。impulse()/transfer()の前に呼ぶ
+    void correlate(const float *frame, int n);
+    // 推定したインパルス応答の振幅 log10(1 + |h[d]|) を、最大のピーク(直達音)を0番目としてtaps点書き出す
+    // hは相互相関をprobeのエネルギーで割ったもの(probeをh倍して遅らせた入力ならピークでh)
+    void impulse(float *dst, int taps);
+    // 帯域 [minHz, maxHz] をbins等分し、各区間の伝達関数の振幅 |X P*| / (|P|^2 + ε) の平均を log10(1 + .) で書き出す
+    // εは|P|^2の最大値の1e-3(帯域外やスペクトルの谷で雑音を増幅しないための正則化)
+    void transfer(float *dst, double minHz, double maxHz, int bins);
+
+private:
+    void release();
+
+private:
+    QVector<float> probeWave;
+    int P;
+    int rate;
+    float energy;      // Σ probe^2
+    float epsilon;
+    float *y;          // 同期加算した入力 / 相互相関 (P点)
+    fftwf_complex *spec;
+    fftwf_complex *probeConj;
+    float *probePower; // |P|^2 + ε (P/2+1点)
+    fftwf_plan forward, backward;
+    int allocCount;
+
+    MatchedFilter(const MatchedFilter &);
+    MatchedFilter &operator=(const MatchedFilter &);
+};
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 出力するプローブ信号(スイープ)
+enum ProbeWaveform {
+    PROBE_LINEAR_CHIRP, // 線形チャープ(従来のスイープ)。両端10%でフェードする
+    PROBE_LOG_CHIRP,    // 対数チャープ。低い周波数ほど長く滞在する。両端10%でフェードする
+    PROBE_MLS,          // 最長系列(M系列)を帯域制限したもの。自己相関が鋭く、インパルス応答の推定に向く
+    PROBE_MULTITONE     // 帯域内の等間隔の正弦波の和。Schroeder位相で波高率を抑える
+};
+
+// 周波数帯域 [minHz, maxHz] のプローブ信号を1周期分(振幅±1)求める
+// samplesは周期の長さ。MLSでは2^m-1点(samples以下で最長)になる。MLSとマルチトーンは周期の継ぎ目でも連続
+// 各サンプルの位相を閉じた式で求めるので、ループに依存関係がなく、周期を繰り返しても位相誤差が溜まらない
+QVector<float> renderProbe(ProbeWaveform type, int sampleRate, int minHz, int maxHz, int samples);
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 特徴ベクトルの後処理(いずれもメモリ確保なし・その場で書き換え)
+
+// ローパスフィルタ(移動平均)。O(n)
+// 以前のlowpass()と同じく、i番目の出力は区間 [i-width, i+width) のうち0でない値の平均(該当なしならNaN)。
+// 窓の和を足し引きで更新するため、和はdoubleで持つ。以前はfloatで毎回足し直していたので、
+// 結果は以前の値と最下位数ビット(数ulp)異なることがある。それ以外(区間の端、0の除外、NaN)は同一
+void lowpass(float *data, int n, int width = 5);
+
+// データ(パワースペクトル)の次元を削減(ダウンサンプリング)
+// (i+offset)がstepの倍数になるi番目の値だけを先頭から詰め直し、新しい点数を返す。以前のreduce()とビット単位で同一
+int reduce(float *data, int n, int step, int offset = 0);
+
+// パワースペクトルを求める(倍精度の厳密版。検証用の基準として残している)
+int maGetPowerSpectol2D(fftwf_complex *in, float *out, int cols, int rows);
+
+// 対数振幅スペクトル log10(1 + |X|) をn点求める(単精度、SIMD)
+// CPUに応じてAVX2/SSE2/スカラーの実装を実行時に選ぶ。exactがtrueならmaGetPowerSpectol2Dと同じ厳密計算を行う
+// 近似版の誤差: exact版に対して絶対誤差 1e-6 以下(|X| < 1e6 の範囲。対数は級数の第4項で打ち切り、
+// 3つの実装とも実測の最大は 4.8e-7 = 結果の2ulp程度。|X|が1e8付近では 9.5e-7)。stethos-benchのlog_magnitude_errorで確かめる
+void logMagnitude(const fftwf_complex *in, float *out, int n, bool exact = false);
+
+// 要素ごとの1次変換 out[i] = a[i] * x[i] + b[i] をn点求める(SIMD。outはxと同じでもよい)
+// 識別器の入力の正規化(次元ごとの最小値・最大値から[-1, 1]への写像)を、除算と分岐なしで行うのに使う
+void affine(const float *x, const float *a, const float *b, float *out, int n);
+
+// 行列とベクトルの積 out[k] = bias[k] + Σ_j w[k*stride + j] * x[j] (k < rows, j < cols) を求める(SIMD)
+// 線形の識別器(ラベルごとの重みとの内積)に使う。biasはNULLでもよい
+void matVec(const float *w, int rows, int cols, int stride, const float *x, const float *bias, float *out);
+
+// RBFカーネル out[i] = exp(-gamma * Σ_j (x[j] - rows[i*stride + j])²) をcount行求める(SIMD)
+// SVMの識別で、サポートベクタごとのカーネル値を1回ずつ求めるのに使う。rowsは32バイト境界に置き(qMallocAligned(size, 32)などで確保する。
+// fftwf_mallocは16バイト境界しか保証しないので使えない)、strideは8の倍数にすること
+// expは単精度の多項式近似(相対誤差 2e-7 程度)。rowsのうちcols以降の詰め物は読まない
+void rbfKernel(const float *rows, int count, int cols, int stride, const float *x, float gamma, float *out);
+
+// logMagnitude・affine・matVec・rbfKernelが使う命令セット
+enum SimdLevel {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+SimdLevel simdLevel();
+// 使う命令セットをlevel以下に制限する(stethos-benchで各実装を比べる用。計算中の他のスレッドがないときに呼ぶ)
+void limitSimdLevel(SimdLevel level);
+
+#endif // DSP_H
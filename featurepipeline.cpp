@@ -0,0 +1,205 @@
+#include "featurepipeline.h"
+#include "alloccounter.h"
+#include <QtGlobal>
+
+FeaturePipeline::FeaturePipeline()
+    : mode(SPECTRUM_AUTO)
+    , bandBins(0)
+    , useBand(false)
+    , feature(FEATURE_SPECTRUM)
+    , matchedSize(64)
+    , windowed(NULL)
+    , width(0)
+    , rate(0)
+    , minHz(0)
+    , maxHz(0)
+    , step(1)
+    , smoothWidth(0)
+    , lo(0)
+    , hi(0)
+    , features(0)
+    , band(NULL)
+    , allocCount(0)
+    , steadyAllocCount(0)
+    , reconfigured(true)
+    , profiling(false)
+    , profileFrames(0)
+{
+    resetProfile();
+}
+
+void FeaturePipeline::resetProfile()
+{
+    for(int i = 0; i < STAGE_COUNT; i++) stageTime[i] = 0;
+    profileFrames = 0;
+}
+
+const char *FeaturePipeline::stageName(Stage stage)
+{
+    switch(stage)
+    {
+    case STAGE_WINDOW_FFT: return "window_fft";
+    case STAGE_MAGNITUDE: return "magnitude";
+    case STAGE_DECIMATE: return "decimate";
+    case STAGE_SMOOTH: return "smooth";
+    default: return "";
+    }
+}
+
+FeaturePipeline::~FeaturePipeline()
+{
+    release();
+}
+
+void FeaturePipeline::release()
+{
+    if(band != NULL) fftwf_free(band);
+    if(windowed != NULL) fftwf_free(windowed);
+    band = NULL;
+    windowed = NULL;
+}
+
+void FeaturePipeline::configure(int _frameWidth, int _sampleRate, int _minHz, int _maxHz, int _step, int _smoothWidth)
+{
+    if(_frameWidth == width && _sampleRate == rate && _minHz == minHz && _maxHz == maxHz
+            && _step == step && _smoothWidth == smoothWidth && band != NULL)
+        return;
+
+    width = _frameWidth;
+    rate = _sampleRate;
+    minHz = _minHz;
+    maxHz = _maxHz;
+    step = qMax(1, _step);
+    smoothWidth = _smoothWidth;
+    reconfigured = true;
+
+    engine.resize(width);
+
+    plan();
+}
+
+void FeaturePipeline::setSpectralMode(SpectralMode _mode, int _bandBins)
+{
+    if(_mode == mode && _bandBins == bandBins) return;
+    mode = _mode;
+    bandBins = qMax(0, _bandBins);
+    reconfigured = true;
+    if(width > 0) plan();
+}
+
+void FeaturePipeline::setFeatureMode(FeatureMode _feature, const QVector<float> &_probe, int size)
+{
+    if(_feature == FEATURE_SPECTRUM && feature == FEATURE_SPECTRUM) return;
+    if(_feature == feature && size == matchedSize && _probe == probe) return;
+    feature = _feature;
+    probe = _feature == FEATURE_SPECTRUM ? QVector<float>() : _probe;
+    matchedSize = qMax(1, size);
+    reconfigured = true;
+    if(width > 0) plan();
+}
+
+// 帯域と解析方法を決めて作業領域を確保する
+void FeaturePipeline::plan()
+{
+    // 以前のQVector::mid()と同じく、N/2点のスペクトルの範囲に収める
+    lo = qBound(0, hz2idx(minHz), width/2);
+    hi = qBound(lo, hz2idx(maxHz), width/2);
+    int bins = bandBins > 0 ? bandBins : hi - lo;
+    features = (bins + step - 1) / step;
+
+    // FFTと同じ分解能ならFFTのビンと同じ周波数を、そうでなければ帯域を等分した周波数を求める
+    double binHz = rate / (double)width;
+    double f0 = lo * binHz;
+    double df = bandBins > 0 ? (hi - lo) * binHz / bandBins : binHz;
+
+    if(bandBins > 0 || mode == SPECTRUM_BAND)
+        useBand = true;
+    else if(mode == SPECTRUM_FULL)
+        useBand = false;
+    else
+        useBand = qMin(BandAnalyzer::chirpZCost(width, features), BandAnalyzer::goertzelCost(width, features))
+                < BandAnalyzer::fullFFTCost(width, hi - lo);
+
+    release();
+    if(useBand)
+    {
+        // 間引き後のビンだけを直接求める
+        analyzer.setup(width, rate, f0, df * step, features);
+        windowed = (float*)fftwf_malloc(sizeof(float) * qMax(1, width));
+        allocCount += 2;
+    }
+    band = (float*)fftwf_malloc(sizeof(float) * qMax(1, hi - lo));
+    allocCount++;
+
+    if(feature != FEATURE_SPECTRUM && !probe.isEmpty())
+    {
+        // スイープのスペクトルを求めておく(スイープが変わっていなければ何もしない)
+        matched.setup(probe, rate);
+        features = feature == FEATURE_IMPULSE ? qMin(matchedSize, matched.period()) : matchedSize;
+        useBand = false;
+    }
+}
+
+void FeaturePipeline::process(const float *frame, float *out)
+{
+    if(band == NULL || width == 0) return;
+    AllocationCounter counter;
+    qint64 t0 = 0, t1 = 0, t2 = 0, t3 = 0;
+    if(profiling) clock.start();
+
+    bool matchedFilter = feature != FEATURE_SPECTRUM && !probe.isEmpty();
+    if(matchedFilter)
+    {
+        // 周期ごとに同期加算 -> スイープとの相互相関(周波数領域) -> インパルス応答のタップ / 帯域内の伝達関数
+        // 窓は掛けない(周期の整数倍を切り出して巡回相関をとるため)
+        matched.correlate(frame, width);
+        if(profiling) t0 = clock.nsecsElapsed();
+        if(feature == FEATURE_IMPULSE)
+            matched.impulse(out, features);
+        else
+            matched.transfer(out, minHz, maxHz, features);
+        if(profiling) t1 = t2 = clock.nsecsElapsed();
+    }
+    else if(useBand)
+    {
+        // 窓掛け -> 帯域内の間引き後のビンだけをチャープZ変換/Goertzelで求める(間引きは周波数間隔に含まれている)
+        engine.window().apply(frame, windowed);
+        if(profiling) t0 = clock.nsecsElapsed();
+        analyzer.process(windowed, out);
+        if(profiling) t1 = t2 = clock.nsecsElapsed();
+    }
+    else
+    {
+        // 窓掛け(FFT入力へのコピーと同時) -> FFT
+        engine.transform(frame);
+        if(profiling) t0 = clock.nsecsElapsed();
+        // 帯域内のビンだけを対数振幅に変換する
+        logMagnitude(engine.output() + lo, band, hi - lo);
+        if(profiling) t1 = clock.nsecsElapsed();
+        // step間隔で間引いて出力に詰める(以前のreduce(rawData, step)と同じ)
+        int k = 0;
+        for(int i = 0; i < hi - lo; i += step)
+        {
+            out[k++] = band[i];
+        }
+        if(profiling) t2 = clock.nsecsElapsed();
+    }
+    // 出力の上でそのまま平滑化(インパルス応答のタップはぼかさない)
+    if(!matchedFilter) lowpass(out, features, smoothWidth);
+
+    if(profiling)
+    {
+        t3 = clock.nsecsElapsed();
+        stageTime[STAGE_WINDOW_FFT] += t0;
+        stageTime[STAGE_MAGNITUDE] += t1 - t0;
+        stageTime[STAGE_DECIMATE] += t2 - t1;
+        stageTime[STAGE_SMOOTH] += t3 - t2;
+        profileFrames++;
+    }
+
+    // 確保を数えるビルド(stethos-bench)でのみ意味を持つ。それ以外ではcount()は常に0
+    int allocated = counter.count();
+    if(!reconfigured) steadyAllocCount += allocated;
+    Q_ASSERT_X(reconfigured || allocated == 0, "FeaturePipeline::process", "heap allocation in steady state");
+    reconfigured = false;
+}
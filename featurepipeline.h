@@ -0,0 +1,122 @@
+#ifndef FEATUREPIPELINE_H
+#define FEATUREPIPELINE_H
+
+#include "dsp.h"
+#include <QElapsedTimer>
+
+// 特徴抽出パイプライン
+// 窓掛け -> FFT -> 帯域の切り出し -> 間引き -> 平滑化 を、configure()で確保したバッファだけを使って1フレームずつ行う。
+// process()はメモリを確保せず、結果を呼び出し側のバッファに直接書き込む
+class FeaturePipeline
+{
+public:
+    // スペクトルの求め方
+    // FULL: フレーム全体をFFTして帯域内のビンを使う(FFTと同じ分解能のときのみ)
+    // BAND: 帯域内の(間引き後の)ビンだけをチャープZ変換かGoertzelで求める
+    // AUTO: 演算量の見積もりが小さい方
+    enum SpectralMode {
+        SPECTRUM_AUTO,
+        SPECTRUM_FULL,
+        SPECTRUM_BAND
+    };
+
+    // 特徴の種類
+    // SPECTRUM: 帯域内の対数振幅スペクトル(従来どおり)
+    // IMPULSE: 出力したスイープとの整合フィルタ(相互相関)で推定したインパルス応答の、直達音からのタップ
+    // TRANSFER: 同じくスイープで逆畳み込みした帯域内の伝達関数の振幅
+    enum FeatureMode {
+        FEATURE_SPECTRUM,
+        FEATURE_IMPULSE,
+        FEATURE_TRANSFER
+    };
+
+    // 処理段(プロファイル用)
+    enum Stage {
+        STAGE_WINDOW_FFT,   // 窓掛けとFFT(帯域限定解析では窓掛けのみ、整合フィルタでは同期加算・FFT・スイープのスペクトルとの積)
+        STAGE_MAGNITUDE,    // 対数振幅(帯域限定解析ではチャープZ変換/Goertzelを、整合フィルタでは逆FFTを含む)
+        STAGE_DECIMATE,     // 間引き
+        STAGE_SMOOTH,       // 平滑化
+        STAGE_COUNT
+    };
+
+    FeaturePipeline();
+    ~FeaturePipeline();
+
+    // フレーム幅・サンプリングレート・使用する周波数帯域・間引き間隔・平滑化幅を設定する
+    // メモリ確保とFFTのプラン作成はここでのみ行う(設定が前回と同じなら何もしない)
+    void configure(int frameWidth, int sampleRate, int minHz, int maxHz, int step = 2, int smoothWidth = 5);
+    void setWindow(WindowType type, float beta = 8.6f) { engine.setWindow(type, beta); reconfigured = true; }
+    void setPlanMode(FFTEngine::PlanMode mode) { engine.setPlanMode(mode); reconfigured = true; }
+    // bandBinsは帯域内で求めるビン数(間引き前)。0ならFFTと同じ周波数間隔(sampleRate/frameWidth)
+    // 0以外のときは常にBAND(帯域限定解析)になり、featureSize()も変わる
+    void setSpectralMode(SpectralMode mode, int bandBins = 0);
+    // 特徴の種類を設定する。IMPULSE/TRANSFERではprobeに出力しているスイープの1周期分の波形を渡し、
+    // sizeがfeatureSize()(タップ数/帯域の分割数)になる。スイープの周期と同じかその倍数のフレーム幅で使うこと
+    void setFeatureMode(FeatureMode mode, const QVector<float> &probe = QVector<float>(), int size = 64);
+    FeatureMode featureMode() const { return feature; }
+    // 現在の設定で帯域限定解析を使っているか
+    bool usesBandAnalyzer() const { return useBand; }
+
+    int frameWidth() const { return width; }
+    // process()が書き出す特徴ベクトルの次元
+    int featureSize() const { return features; }
+
+    // frame(frameWidth点の時間信号)から特徴ベクトルを求め、out(featureSize点)に書き出す
+    void process(const float *frame, float *out);
+
+    // 周波数からインデックスに変換
+    int hz2idx(int hz) const
+    {
+        return (width/2 * (hz/(float)(rate/2)));
+    }
+
+    // デバッグ用のメモリ確保カウンタ
+    // allocations()はバッファ・FFTプラン・窓関数表を作った総回数。
+    // steadyStateAllocations()は設定を変えていないフレームのprocess()の中で実際に発生したヒープ確保の回数(AllocationCounter)。
+    // 確保を数えるビルド(stethos-bench)でのみ数えられ、0でなければデバッグビルドではQ_ASSERTで止まる。それ以外のビルドでは常に0
+    int allocations() const { return allocCount + engine.allocations() + matched.allocations(); }
+    int steadyStateAllocations() const { return steadyAllocCount; }
+
+    // 段ごとの処理時間の計測。有効な間はprocess()の各段の経過時間[ns]を積算する
+    void setProfiling(bool enable) { profiling = enable; }
+    void resetProfile();
+    qint64 stageNanoseconds(Stage stage) const { return stageTime[stage]; }
+    qint64 profiledFrames() const { return profileFrames; }
+    static const char *stageName(Stage stage);
+
+private:
+    void release();
+    void plan();
+
+private:
+    FFTEngine engine;
+    BandAnalyzer analyzer;
+    SpectralMode mode;
+    int bandBins;
+    bool useBand;
+    MatchedFilter matched;
+    FeatureMode feature;
+    QVector<float> probe; // 整合フィルタに使うスイープ1周期分
+    int matchedSize;
+    float *windowed;  // 帯域限定解析用の窓掛け済みフレーム (frameWidth点)
+    int width;
+    int rate;
+    int minHz, maxHz;
+    int step;
+    int smoothWidth;
+    int lo, hi;       // 切り出す帯域 [lo, hi) のビン番号
+    int features;
+    float *band;      // 帯域内の対数振幅スペクトル (hi-lo点)
+    int allocCount;
+    int steadyAllocCount;
+    bool reconfigured; // 前回のprocess()以降に設定が変わったか
+    bool profiling;
+    qint64 stageTime[STAGE_COUNT];
+    qint64 profileFrames;
+    QElapsedTimer clock;
+
+    FeaturePipeline(const FeaturePipeline &);
+    FeaturePipeline &operator=(const FeaturePipeline &);
+};
+
+#endif // FEATUREPIPELINE_H
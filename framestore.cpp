@@ -0,0 +1,300 @@
+#include "framestore.h"
+#include <QDateTime>
+#include <string.h>
+
+// ファイルの構成(値は書いたマシンのバイト順)
+//   先頭 HEADER_BYTES バイト: Header
+//   以降: セグメント(segmentBytes バイト、rowsPerSegment行)の繰り返し。セグメントの中は
+//         label int32[R] | take int32[R] | flags int32[R] | time int64[R] | features float[R × dimension]
+#define FRAMESTORE_MAGIC "STFS"
+#define FRAMESTORE_VERSION 1
+#define FRAMESTORE_BYTE_ORDER 0x01020304
+#define HEADER_BYTES 4096
+#define ROWS_PER_SEGMENT 1024
+
+struct FrameStore::Header
+{
+    char magic[4];
+    quint32 version;
+    quint32 byteOrder;
+    qint32 dimension;
+    qint32 rowsPerSegment;
+    qint32 reserved;
+    qint64 rowCount;        // 書き込みを終えた行数(行の中身を書いてから増やす)
+    char labelUsed[FRAMESTORE_MAX_LABELS];
+    char labelNames[FRAMESTORE_MAX_LABELS][FRAMESTORE_NAME_BYTES];
+};
+
+FrameStore::FrameStore()
+    : header(NULL)
+    , rowsPerSegment(ROWS_PER_SEGMENT)
+    , segmentBytes(0)
+{
+    for(int i = 0; i < COLUMN_COUNT; i++)
+    {
+        columnOffset[i] = 0;
+        columnBytes[i] = 0;
+    }
+}
+
+FrameStore::~FrameStore()
+{
+    close();
+}
+
+bool FrameStore::open(const QString &path)
+{
+    close();
+    file.setFileName(path);
+    if(!file.open(QIODevice::ReadWrite)) return false;
+
+    bool created = file.size() == 0;
+    if(created && !file.resize(HEADER_BYTES))
+    {
+        file.close();
+        return false;
+    }
+    if(file.size() < HEADER_BYTES)
+    {
+        file.close();
+        return false;
+    }
+    header = (Header *)file.map(0, HEADER_BYTES);
+    if(header == NULL)
+    {
+        file.close();
+        return false;
+    }
+
+    if(created)
+    {
+        memset(header, 0, sizeof(Header));
+        memcpy(header->magic, FRAMESTORE_MAGIC, 4);
+        header->version = FRAMESTORE_VERSION;
+        header->byteOrder = FRAMESTORE_BYTE_ORDER;
+        header->rowsPerSegment = ROWS_PER_SEGMENT;
+        return true;
+    }
+
+    if(memcmp(header->magic, FRAMESTORE_MAGIC, 4) != 0 || header->version != FRAMESTORE_VERSION
+            || header->byteOrder != FRAMESTORE_BYTE_ORDER || header->rowsPerSegment <= 0
+            || header->dimension < 0 || header->rowCount < 0)
+    {
+        close();
+        return false;
+    }
+    rowsPerSegment = header->rowsPerSegment;
+    if(header->dimension == 0) return true;
+
+    // 書き込み済みの行を含むセグメントを全てマップする
+    layout(header->dimension);
+    int count = (header->rowCount + rowsPerSegment - 1) / rowsPerSegment;
+    if(file.size() < HEADER_BYTES + segmentBytes * count)
+    {
+        close();
+        return false;
+    }
+    for(int i = 0; i < count; i++)
+    {
+        if(!mapSegment(i))
+        {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void FrameStore::close()
+{
+    // QFile::close()がマップした領域を全て解放する
+    if(file.isOpen()) file.close();
+    header = NULL;
+    segments.clear();
+}
+
+void FrameStore::layout(int dimension)
+{
+    qint64 r = rowsPerSegment;
+    columnBytes[COLUMN_LABEL] = sizeof(qint32);
+    columnBytes[COLUMN_TAKE] = sizeof(qint32);
+    columnBytes[COLUMN_FLAGS] = sizeof(qint32);
+    columnBytes[COLUMN_TIME] = sizeof(qint64);
+    columnBytes[COLUMN_FEATURES] = sizeof(float) * dimension;
+    columnOffset[COLUMN_LABEL] = 0;
+    columnOffset[COLUMN_TAKE] = columnOffset[COLUMN_LABEL] + r * columnBytes[COLUMN_LABEL];
+    columnOffset[COLUMN_FLAGS] = columnOffset[COLUMN_TAKE] + r * columnBytes[COLUMN_TAKE];
+    // 時刻は8バイト境界に、特徴ベクトルは32バイト境界に置く
+    columnOffset[COLUMN_TIME] = (columnOffset[COLUMN_FLAGS] + r * columnBytes[COLUMN_FLAGS] + 7) & ~(qint64)7;
+    columnOffset[COLUMN_FEATURES] = (columnOffset[COLUMN_TIME] + r * columnBytes[COLUMN_TIME] + 31) & ~(qint64)31;
+    segmentBytes = columnOffset[COLUMN_FEATURES] + r * columnBytes[COLUMN_FEATURES];
+    segmentBytes = (segmentBytes + HEADER_BYTES - 1) / HEADER_BYTES * HEADER_BYTES;
+}
+
+bool FrameStore::mapSegment(int index)
+{
+    uchar *p = file.map(HEADER_BYTES + segmentBytes * index, segmentBytes);
+    if(p == NULL) return false;
+    segments.append(p);
+    return true;
+}
+
+int FrameStore::dimension() const
+{
+    return header ? header->dimension : 0;
+}
+
+int FrameStore::rowCount() const
+{
+    return header ? header->rowCount : 0;
+}
+
+int FrameStore::liveRowCount() const
+{
+    int count = 0;
+    for(int row = 0; row < rowCount(); row++)
+    {
+        if(!isRemoved(row)) count++;
+    }
+    return count;
+}
+
+bool FrameStore::reset()
+{
+    if(!header || liveRowCount() > 0) return false;
+    // セグメントを外してからファイルをヘッダだけに切り詰める(ヘッダのマップはそのまま使える)
+    foreach(uchar *p, segments) file.unmap(p);
+    segments.clear();
+    header->rowCount = 0;
+    header->dimension = 0;
+    return file.resize(HEADER_BYTES);
+}
+
+int FrameStore::addLabel(const QString &name)
+{
+    if(!header) return -1;
+    for(int i = 0; i < FRAMESTORE_MAX_LABELS; i++)
+    {
+        if(header->labelUsed[i]) continue;
+        // 前に同じ番号を使っていたラベルの行は削除済みになっているので、テイク番号はそのまま続ける
+        header->labelUsed[i] = 1;
+        renameLabel(i, name);
+        return i;
+    }
+    return -1;
+}
+
+void FrameStore::renameLabel(int label, const QString &name)
+{
+    if(!header || label < 0 || label >= FRAMESTORE_MAX_LABELS) return;
+    // 文字の途中で切れないように、収まるまで1文字ずつ削る
+    QString s = name;
+    QByteArray utf8 = s.toUtf8();
+    while(utf8.size() > FRAMESTORE_NAME_BYTES - 1)
+    {
+        s.chop(1);
+        utf8 = s.toUtf8();
+    }
+    memset(header->labelNames[label], 0, FRAMESTORE_NAME_BYTES);
+    memcpy(header->labelNames[label], utf8.constData(), utf8.size());
+}
+
+void FrameStore::removeLabel(int label)
+{
+    if(!header || label < 0 || label >= FRAMESTORE_MAX_LABELS) return;
+    for(int row = 0; row < rowCount(); row++)
+    {
+        if(this->label(row) == label) *(qint32 *)mutableColumn(row, COLUMN_FLAGS) |= FLAG_REMOVED;
+    }
+    header->labelUsed[label] = 0;
+    memset(header->labelNames[label], 0, FRAMESTORE_NAME_BYTES);
+}
+
+QList<int> FrameStore::labels() const
+{
+    QList<int> ret;
+    for(int i = 0; header && i < FRAMESTORE_MAX_LABELS; i++)
+    {
+        if(header->labelUsed[i]) ret.append(i);
+    }
+    return ret;
+}
+
+QString FrameStore::labelName(int label) const
+{
+    if(!header || label < 0 || label >= FRAMESTORE_MAX_LABELS) return QString();
+    return QString::fromUtf8(header->labelNames[label], qstrnlen(header->labelNames[label], FRAMESTORE_NAME_BYTES));
+}
+
+bool FrameStore::append(int label, int take, const float *features, int size, qint64 timestamp)
+{
+    if(!header || size <= 0) return false;
+    if(header->dimension == 0)
+    {
+        header->dimension = size;
+        layout(size);
+    }
+    if(size != header->dimension) return false;
+
+    int row = header->rowCount;
+    int s = row / rowsPerSegment;
+    if(s >= segments.size())
+    {
+        // セグメントを1つ足す(既存のセグメントはマップし直さない)
+        if(!file.resize(HEADER_BYTES + segmentBytes * (s + 1))) return false;
+        if(!mapSegment(s)) return false;
+    }
+
+    if(timestamp <= 0) timestamp = QDateTime::currentMSecsSinceEpoch();
+    *(qint32 *)mutableColumn(row, COLUMN_LABEL) = label;
+    *(qint32 *)mutableColumn(row, COLUMN_TAKE) = take;
+    *(qint32 *)mutableColumn(row, COLUMN_FLAGS) = 0;
+    *(qint64 *)mutableColumn(row, COLUMN_TIME) = timestamp;
+    memcpy(mutableColumn(row, COLUMN_FEATURES), features, sizeof(float) * size);
+    header->rowCount = row + 1;
+    return true;
+}
+
+void FrameStore::removeTake(int label, int take)
+{
+    for(int row = 0; row < rowCount(); row++)
+    {
+        if(this->label(row) == label && this->take(row) == take)
+            *(qint32 *)mutableColumn(row, COLUMN_FLAGS) |= FLAG_REMOVED;
+    }
+}
+
+QList<int> FrameStore::takes(int label) const
+{
+    QList<int> ret;
+    for(int row = 0; row < rowCount(); row++)
+    {
+        if(this->label(row) != label || isRemoved(row)) continue;
+        int t = take(row);
+        if(ret.isEmpty() || ret.last() != t)
+        {
+            if(!ret.contains(t)) ret.append(t);
+        }
+    }
+    return ret;
+}
+
+int FrameStore::nextTake(int label) const
+{
+    int next = 0;
+    for(int row = 0; row < rowCount(); row++)
+    {
+        if(this->label(row) == label) next = qMax(next, take(row) + 1);
+    }
+    return next;
+}
+
+QVector<int> FrameStore::rows(int label) const
+{
+    QVector<int> ret;
+    for(int row = 0; row < rowCount(); row++)
+    {
+        if(this->label(row) == label && !isRemoved(row)) ret.append(row);
+    }
+    return ret;
+}
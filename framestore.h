@@ -0,0 +1,108 @@
+#ifndef FRAMESTORE_H
+#define FRAMESTORE_H
+
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QList>
+
+#define FRAMESTORE_MAX_LABELS 64
+#define FRAMESTORE_NAME_BYTES 48
+
+// 学習データ(特徴ベクトルのフレーム)の追記専用ストア
+// 1行 = ラベル番号・テイク番号(1回の学習操作で取ったフレームのまとまり)・時刻・特徴ベクトル で、ファイルをメモリにマップして持つ。
+// ファイルは固定行数のセグメントに分かれ、セグメントの中は列ごと(ラベル・テイク・フラグ・時刻・特徴ベクトル)に連続して並ぶ。
+// 書き足すときは新しいセグメントを足してマップするだけで、既存のセグメントはマップし直さないので、
+// features()などが返すポインタは閉じるまで有効(学習スレッドからもコピーせずに読める)。
+// 削除は行にフラグを立てるだけで詰めない。ラベル名の表もファイルの先頭に持つので、再起動しても学習データが残る
+// 書き込み(append・remove・ラベルの変更)は1つのスレッドから行うこと。読み出しは書き込み済みの行ならどのスレッドからでもよい
+class FrameStore
+{
+public:
+    FrameStore();
+    ~FrameStore();
+
+    // pathのストアを開く(なければ作る)。ファイルが壊れているか別の形式ならfalse
+    bool open(const QString &path);
+    void close();
+    bool isOpen() const { return header != NULL; }
+    QString fileName() const { return file.fileName(); }
+
+    // 特徴ベクトルの次元(最初に追記した行で決まる。空なら0)
+    int dimension() const;
+    // 追記済みの行数(削除した行を含む)
+    int rowCount() const;
+    // 削除していない行数
+    int liveRowCount() const;
+    // 削除していない行がなければ、全ての行を捨てて次元を未定(0)に戻す(ラベルの表は残す)。行が残っていればfalse
+    // 特徴抽出の設定を変えた後に、新しい次元で学習データを取り直すために使う
+    // features()などが返したポインタは無効になるので、それを参照する学習が終わってから呼ぶこと
+    bool reset();
+
+    // ラベル名の表。番号はFRAMESTORE_MAX_LABELS未満で、削除したラベルの番号は再利用される
+    // addLabelは空きがなければ-1を返す。名前はUTF-8でFRAMESTORE_NAME_BYTES-1バイトまで
+    int addLabel(const QString &name);
+    void renameLabel(int label, const QString &name);
+    // ラベルとその行を全て削除する
+    void removeLabel(int label);
+    QList<int> labels() const;
+    QString labelName(int label) const;
+
+    // 1行追記する。次元がこれまでの行と違えば追記せずにfalseを返す(特徴抽出の設定を変えたら、古い行を消してreset()すること)
+    // timestampは[ms](0以下なら現在時刻)
+    bool append(int label, int take, const float *features, int size, qint64 timestamp = 0);
+    // labelのtakeの行を削除する
+    void removeTake(int label, int take);
+    // labelで使われているテイク番号(削除していないもの、古い順)と、次に使う番号
+    QList<int> takes(int label) const;
+    int nextTake(int label) const;
+    // labelの削除していない行の番号(古い順)
+    QVector<int> rows(int label) const;
+
+    // 行の読み出し(コピーなし)
+    int label(int row) const { return *(const qint32 *)column(row, COLUMN_LABEL); }
+    int take(int row) const { return *(const qint32 *)column(row, COLUMN_TAKE); }
+    qint64 timestamp(int row) const { return *(const qint64 *)column(row, COLUMN_TIME); }
+    bool isRemoved(int row) const { return *(const qint32 *)column(row, COLUMN_FLAGS) & FLAG_REMOVED; }
+    const float *features(int row) const { return (const float *)column(row, COLUMN_FEATURES); }
+
+private:
+    enum Column {
+        COLUMN_LABEL,
+        COLUMN_TAKE,
+        COLUMN_TIME,
+        COLUMN_FLAGS,
+        COLUMN_FEATURES,
+        COLUMN_COUNT
+    };
+    enum Flag {
+        FLAG_REMOVED = 0x1
+    };
+    struct Header;
+
+    const uchar *column(int row, Column c) const
+    {
+        int s = row / rowsPerSegment;
+        int i = row % rowsPerSegment;
+        return segments[s] + columnOffset[c] + (qint64)columnBytes[c] * i;
+    }
+    uchar *mutableColumn(int row, Column c) { return const_cast<uchar *>(column(row, c)); }
+    // 次元が決まってからセグメント内の列の配置を決める
+    void layout(int dimension);
+    bool mapSegment(int index);
+
+private:
+    QFile file;
+    Header *header;
+    QVector<uchar *> segments;
+    int rowsPerSegment;
+    qint64 segmentBytes;
+    qint64 columnOffset[COLUMN_COUNT];
+    int columnBytes[COLUMN_COUNT];
+
+    FrameStore(const FrameStore &);
+    FrameStore &operator=(const FrameStore &);
+};
+
+#endif // FRAMESTORE_H
@@ -0,0 +1,181 @@
+#include "latencyprobe.h"
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <limits.h>
+#include <math.h>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+// 8us未満は1usごと、それ以上は[2^e, 2^(e+1))を8等分した階級
+int LatencyHistogram::bucketOf(qint64 us)
+{
+    if(us < SUB_BUCKETS) return us < 0 ? 0 : (int)us;
+    int e = 3;
+    while((us >> (e + 1)) != 0) e++;
+    int index = (e - 2) * SUB_BUCKETS + (int)(us >> (e - 3)) - SUB_BUCKETS;
+    return qMin(index, BUCKETS - 1);
+}
+
+double LatencyHistogram::bucketCenter(int index)
+{
+    if(index < SUB_BUCKETS) return index + 0.5;
+    int e = index / SUB_BUCKETS + 2;
+    double width = (double)((qint64)1 << (e - 3));
+    return (index % SUB_BUCKETS + SUB_BUCKETS + 0.5) * width;
+}
+
+void LatencyHistogram::add(qint64 ns)
+{
+    qint64 us = ns / 1000;
+    buckets[bucketOf(us)].fetchAndAddRelaxed(1);
+    total.fetchAndAddRelaxed(1);
+    int v = (int)qMin(us, (qint64)INT_MAX);
+    for(int m = maxValue.load(); v > m; m = maxValue.load())
+    {
+        if(maxValue.testAndSetRelaxed(m, v)) break;
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    for(int i = 0; i < BUCKETS; i++) buckets[i].store(0);
+    total.store(0);
+    maxValue.store(0);
+}
+
+double LatencyHistogram::percentile(double p) const
+{
+    // 記録と並行して読むので、合計は数え直した値を使う
+    qint64 n = 0;
+    int counts[BUCKETS];
+    for(int i = 0; i < BUCKETS; i++)
+    {
+        counts[i] = buckets[i].load();
+        n += counts[i];
+    }
+    if(n == 0) return 0;
+
+    qint64 rank = qMax((qint64)1, (qint64)ceil(p * n));
+    qint64 seen = 0;
+    for(int i = 0; i < BUCKETS; i++)
+    {
+        seen += counts[i];
+        if(seen >= rank) return bucketCenter(i);
+    }
+    return bucketCenter(BUCKETS - 1);
+}
+
+
+LatencyProbe::LatencyProbe()
+    : arrival(-1)
+    , emitted(-1)
+    , predicted(-1)
+{
+    clock.start();
+}
+
+LatencyProbe *LatencyProbe::instance()
+{
+    static LatencyProbe probe;
+    return &probe;
+}
+
+void LatencyProbe::frameEmitted(qint64 _arrival, qint64 ready)
+{
+    if(emitted >= 0) dropped.fetchAndAddRelaxed(1);
+    emitted = now();
+    arrival = _arrival;
+    predicted = -1;
+    record(STAGE_READ, ready - arrival);
+    record(STAGE_EMIT, emitted - ready);
+}
+
+void LatencyProbe::framePredicted()
+{
+    if(emitted < 0 || predicted >= 0) return;
+    predicted = now();
+    record(STAGE_PREDICT, predicted - emitted);
+}
+
+void LatencyProbe::framePainted()
+{
+    if(predicted < 0) return;
+    qint64 painted = now();
+    record(STAGE_PAINT, painted - predicted);
+    record(STAGE_TOTAL, painted - arrival);
+    arrival = emitted = predicted = -1;
+}
+
+void LatencyProbe::reset()
+{
+    for(int i = 0; i < STAGE_COUNT; i++) histograms[i].reset();
+    dropped.store(0);
+}
+
+QString LatencyProbe::stageName(Stage stage)
+{
+    switch(stage)
+    {
+    case STAGE_CAPTURE:
+        return "capture";
+    case STAGE_READ:
+        return "read";
+    case STAGE_EMIT:
+        return "emit";
+    case STAGE_PREDICT:
+        return "predict";
+    case STAGE_PAINT:
+        return "paint";
+    default:
+        return "total";
+    }
+}
+
+QStringList LatencyProbe::summary() const
+{
+    QStringList lines;
+    lines.append(QString("%1 %2 %3 %4 %5").arg("latency[ms]", -12).arg("p50", 7).arg("p95", 7).arg("p99", 7).arg("n", 7));
+    for(int i = 0; i < STAGE_COUNT; i++)
+    {
+        const LatencyHistogram &h = histograms[i];
+        lines.append(QString("%1 %2 %3 %4 %5").arg(stageName((Stage)i), -12)
+                     .arg(h.percentile(0.5) / 1000, 7, 'f', 2)
+                     .arg(h.percentile(0.95) / 1000, 7, 'f', 2)
+                     .arg(h.percentile(0.99) / 1000, 7, 'f', 2)
+                     .arg(h.count(), 7));
+    }
+    return lines;
+}
+
+QJsonObject LatencyProbe::toJson() const
+{
+    QJsonArray stages;
+    for(int i = 0; i < STAGE_COUNT; i++)
+    {
+        const LatencyHistogram &h = histograms[i];
+        QJsonObject o;
+        o["name"] = stageName((Stage)i);
+        o["count"] = h.count();
+        o["p50_us"] = h.percentile(0.5);
+        o["p95_us"] = h.percentile(0.95);
+        o["p99_us"] = h.percentile(0.99);
+        o["max_us"] = h.maxUs();
+        stages.append(o);
+    }
+    QJsonObject root;
+    root["stages"] = stages;
+    root["dropped_frames"] = droppedFrames();
+    return root;
+}
+
+bool LatencyProbe::save(const QString &path) const
+{
+    QSaveFile f(path);
+    if(!f.open(QIODevice::WriteOnly)) return false;
+    f.write(QJsonDocument(toJson()).toJson());
+    return f.commit();
+}
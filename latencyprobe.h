@@ -0,0 +1,100 @@
+#ifndef LATENCYPROBE_H
+#define LATENCYPROBE_H
+
+#include <QString>
+#include <QStringList>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QJsonObject>
+
+// 区間ごとの遅延の分布(ロックなし)
+// 値[us]を2のべきごとに8分割した対数の階級で数えるので、どの値でも誤差は階級の幅(1/8)以内に収まる
+// add()はどのスレッドからも同時に呼べる(階級ごとのカウンタを原子的に増やすだけで、確保もロックもしない)
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void add(qint64 ns);
+    void reset();
+
+    int count() const { return total.load(); }
+    // p(0〜1)分位点[us]。該当する階級の中央の値を返す(まだ何もなければ0)
+    double percentile(double p) const;
+    double maxUs() const { return maxValue.load(); }
+
+private:
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = 240;     // 2^31 us(約36分)まで
+    static int bucketOf(qint64 us);
+    static double bucketCenter(int index);
+
+    QAtomicInt buckets[BUCKETS];
+    QAtomicInt total;
+    QAtomicInt maxValue;    // [us]
+};
+
+// 音声の到着から識別結果(PredictionLabel)が描画されるまでの、フレームごとの遅延の計測
+// 時刻は単調増加の時計(QElapsedTimer)で、各段階で記録した時刻の差を区間ごとのヒストグラムに積む
+//
+//   STAGE_CAPTURE  QAudioInputのコールバック(CaptureDevice::writeData)の処理時間。コールバックごとに記録する
+//   STAGE_READ     コールバックの到着 -> DSPスレッドのreadData()でフレームの特徴ベクトルが揃うまで
+//   STAGE_EMIT     特徴ベクトルが揃ってから -> 33msのタイマ(updateData)でsenseDataChangedを発行するまで
+//   STAGE_PREDICT  発行 -> MainWindow::senseDataChangedが識別を終えるまで
+//   STAGE_PAINT    識別の完了 -> 識別されたPredictionLabelが再描画されるまで
+//   STAGE_TOTAL    コールバックの到着 -> 再描画(READ〜PAINTの和)
+//
+// フレームの到着時刻は、そのフレームの最後のサンプルを取り出した時点で最も新しいコールバックの時刻とする
+// (取り出すまでに次のコールバックが来ていれば、その分だけ短めに測る)
+// READはDSPスレッド、EMIT以降はGUIスレッドで記録する。GUIスレッド側の記録(frameEmitted()以降)はGUIスレッドからのみ呼ぶこと
+class LatencyProbe
+{
+public:
+    enum Stage {
+        STAGE_CAPTURE,
+        STAGE_READ,
+        STAGE_EMIT,
+        STAGE_PREDICT,
+        STAGE_PAINT,
+        STAGE_TOTAL,
+        STAGE_COUNT
+    };
+
+    // アプリケーション全体で1つ(最初の呼び出しで生成し、時計もそこから始まる)
+    static LatencyProbe *instance();
+
+    // 単調増加の時刻[ns]
+    qint64 now() const { return clock.nsecsElapsed(); }
+    void record(Stage stage, qint64 ns) { histograms[stage].add(ns); }
+
+    // GUIスレッドでフレームを受け渡した時刻を記録する(arrivalは到着、readyは特徴ベクトルが揃った時刻)
+    // 前のフレームが描画まで届いていなければ、それは途中までの区間だけを数えて捨てる
+    void frameEmitted(qint64 arrival, qint64 ready);
+    // 受け渡したフレームの識別が終わった
+    void framePredicted();
+    // 識別したラベルが描画された(フレームの最初の描画だけを数える)
+    void framePainted();
+
+    const LatencyHistogram &histogram(Stage stage) const { return histograms[stage]; }
+    // 描画まで届かずに捨てたフレーム数(識別しないタブにいる間など)
+    int droppedFrames() const { return dropped.load(); }
+    void reset();
+
+    static QString stageName(Stage stage);
+    // 区間ごとのp50/p95/p99を1行ずつ(画面の表示用)
+    QStringList summary() const;
+    QJsonObject toJson() const;
+    // toJson()をpathに書き出す
+    bool save(const QString &path) const;
+
+private:
+    LatencyProbe();
+
+    QElapsedTimer clock;
+    LatencyHistogram histograms[STAGE_COUNT];
+    QAtomicInt dropped;
+    // 受け渡し中のフレームの時刻(GUIスレッドのみ。-1は未記録)
+    qint64 arrival, emitted, predicted;
+};
+
+#endif // LATENCYPROBE_H
@@ -0,0 +1,420 @@
+#include "linearclassifier.h"
+#include "dsp.h"
+#include <QSaveFile>
+#include <QFile>
+#include <QDataStream>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#define LINEAR_FILE_MAGIC 0x53544c4e  // "STLN"
+#define LINEAR_FILE_VERSION 1
+
+// ロジスティック回帰の反復の上限と、打ち切る勾配の大きさ(成分の最大値)
+#define LOGISTIC_MAX_ITERATIONS 500
+#define LOGISTIC_TOLERANCE 1e-4
+
+LinearClassifier::LinearClassifier(QObject *parent)
+    : Classifier(parent)
+    , regularization(1e-3)
+{
+}
+
+LinearClassifier::~LinearClassifier()
+{
+    waitForTraining();
+}
+
+QSharedPointer<const LinearModel> LinearClassifier::model() const
+{
+    QMutexLocker locker(&modelLock);
+    return current;
+}
+
+int LinearClassifier::labelCount() const
+{
+    QSharedPointer<const LinearModel> m = model();
+    return m ? m->labels : 0;
+}
+
+int LinearClassifier::dimension() const
+{
+    QSharedPointer<const LinearModel> m = model();
+    return m ? m->dimension : 0;
+}
+
+double LinearClassifier::predict(const float *data, int size, double *probability, ClassifierWorkspace &workspace) const
+{
+    QSharedPointer<const LinearModel> m = model();
+    if(!m) return -1;
+
+    // 学習時の次元を超える分は使わず、足りない次元は正規化後の値を0とする(SVMClassifierと同じ)
+    int n = qMin(size, m->dimension);
+    if(workspace.scaled.size() < m->dimension) workspace.scaled.resize(m->dimension);
+    if(workspace.scores.size() < m->labels) workspace.scores.resize(m->labels);
+    float *scaled = workspace.scaled.data();
+    float *scores = workspace.scores.data();
+    affine(data, m->scaleA.constData(), m->scaleB.constData(), scaled, n);
+    for(int i = n; i < m->dimension; i++) scaled[i] = 0;
+
+    matVec(m->weight.constData(), m->labels, m->dimension, m->stride, scaled, m->bias.constData(), scores);
+    int best = 0;
+    for(int k = 1; k < m->labels; k++)
+    {
+        if(scores[k] > scores[best]) best = k;
+    }
+
+    if(probability != NULL)
+    {
+        double sum = 0;
+        for(int k = 0; k < m->labels; k++)
+        {
+            probability[k] = exp((double)scores[k] - scores[best]);
+            sum += probability[k];
+        }
+        for(int k = 0; k < m->labels; k++) probability[k] /= sum;
+    }
+    return m->labelValues[best];
+}
+
+LinearModel *LinearClassifier::prepare(const ProblemView &problems, QVector<float> *scaled, QVector<int> *index)
+{
+    int n = problems.x.size();
+    int dimension = problems.dimension;
+    if(n == 0 || dimension <= 0) return NULL;
+
+    LinearModel *m = new LinearModel;
+    m->dimension = dimension;
+    m->stride = (dimension + 7) & ~7;
+
+    // ラベルの値を昇順に並べ、その順番をラベル番号とする
+    for(int i = 0; i < n; i++)
+    {
+        if(!m->labelValues.contains(problems.y[i])) m->labelValues.append(problems.y[i]);
+    }
+    std::sort(m->labelValues.begin(), m->labelValues.end());
+    m->labels = m->labelValues.size();
+    index->resize(n);
+    for(int i = 0; i < n; i++) (*index)[i] = m->labelValues.indexOf(problems.y[i]);
+
+    // 次元ごとの[最小値, 最大値]を[-1, 1]に写す(範囲が0の次元は常に-1)
+    QVector<float> max(dimension), min(dimension);
+    memcpy(max.data(), problems.x[0], sizeof(float) * dimension);
+    memcpy(min.data(), problems.x[0], sizeof(float) * dimension);
+    for(int i = 1; i < n; i++)
+    {
+        const float *x = problems.x[i];
+        for(int j = 0; j < dimension; j++)
+        {
+            if(max[j] < x[j]) max[j] = x[j];
+            if(min[j] > x[j]) min[j] = x[j];
+        }
+    }
+    m->scaleA.resize(dimension);
+    m->scaleB.resize(dimension);
+    for(int j = 0; j < dimension; j++)
+    {
+        double a = max[j] > min[j] ? 2 / ((double)max[j] - min[j]) : 0;
+        m->scaleA[j] = a;
+        m->scaleB[j] = -1 - a * min[j];
+    }
+
+    scaled->resize(n * dimension);
+    for(int i = 0; i < n; i++)
+    {
+        affine(problems.x[i], m->scaleA.constData(), m->scaleB.constData(), scaled->data() + i * dimension, dimension);
+    }
+    m->weight.fill(0, m->labels * m->stride);
+    m->bias.fill(0, m->labels);
+    return m;
+}
+
+LinearModel *LinearClassifier::fit(const ProblemView &problems, int g) const
+{
+    QVector<float> x;
+    QVector<int> y;
+    LinearModel *m = prepare(problems, &x, &y);
+    if(m == NULL) return NULL;
+
+    int n = y.size(), d = m->dimension, stride = m->stride, K = m->labels;
+    double lambda = regularization;
+
+    // 勾配のリプシッツ定数は 1/2 λmax(XᵀX/n) + λ 以下で、λmax(XᵀX/n) は行のノルムの2乗の平均(+バイアスの1)以下
+    double norm = 0;
+    for(int i = 0; i < x.size(); i++) norm += x[i] * x[i];
+    double step = 1 / (0.5 * (norm / n + 1) + lambda);
+
+    // w: 現在の解、v: 勾配を求める点(前の解との外挿)
+    QVector<float> w(K * stride, 0), v(K * stride, 0), wb(K, 0), vb(K, 0);
+    QVector<double> grad(K * stride), gradb(K);
+    QVector<float> scores(K);
+    QVector<double> p(K);
+    for(int it = 0; it < LOGISTIC_MAX_ITERATIONS; it++)
+    {
+        if(cancelled(g))
+        {
+            delete m;
+            return NULL;
+        }
+
+        grad.fill(0);
+        gradb.fill(0);
+        for(int i = 0; i < n; i++)
+        {
+            const float *xi = x.constData() + i * d;
+            matVec(v.constData(), K, d, stride, xi, vb.constData(), scores.data());
+            float top = scores[0];
+            for(int k = 1; k < K; k++) top = qMax(top, scores[k]);
+            double sum = 0;
+            for(int k = 0; k < K; k++)
+            {
+                p[k] = exp((double)scores[k] - top);
+                sum += p[k];
+            }
+            for(int k = 0; k < K; k++)
+            {
+                double r = p[k] / sum - (k == y[i] ? 1 : 0);
+                double *gk = grad.data() + k * stride;
+                for(int j = 0; j < d; j++) gk[j] += r * xi[j];
+                gradb[k] += r;
+            }
+        }
+
+        double largest = 0;
+        double momentum = it / (it + 3.0);
+        for(int k = 0; k < K; k++)
+        {
+            for(int j = 0; j < d; j++)
+            {
+                int idx = k * stride + j;
+                double gj = grad[idx] / n + lambda * v[idx];
+                largest = qMax(largest, fabs(gj));
+                float next = v[idx] - step * gj;
+                v[idx] = next + momentum * (next - w[idx]);
+                w[idx] = next;
+            }
+            double gb = gradb[k] / n;
+            largest = qMax(largest, fabs(gb));
+            float next = vb[k] - step * gb;
+            vb[k] = next + momentum * (next - wb[k]);
+            wb[k] = next;
+        }
+        if(largest < LOGISTIC_TOLERANCE) break;
+        if(it % 10 == 0) progress(g, it * 100 / LOGISTIC_MAX_ITERATIONS);
+    }
+
+    m->weight = w;
+    m->bias = wb;
+    return m;
+}
+
+bool LinearClassifier::build(const ProblemView &problems, int g)
+{
+    LinearModel *m = fit(problems, g);
+    return m != NULL && publish(m, g);
+}
+
+bool LinearClassifier::publish(LinearModel *m, int g)
+{
+    QMutexLocker locker(&modelLock);
+    if(!mayPublish(g))
+    {
+        locker.unlock();
+        delete m;
+        return false;
+    }
+    current = QSharedPointer<const LinearModel>(m);
+    return true;
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// モデルの保存と読み込み
+//
+// QDataStream(単精度)で magic, version, type, labels, dimension, labelValues, scaleA, scaleB, weight(labels × dimension、行ごと), bias, labelNames の順に書く
+
+bool LinearClassifier::save(const QString &path, const QStringList &labelNames) const
+{
+    QSharedPointer<const LinearModel> m = model();
+    if(!m) return false;
+
+    QSaveFile f(path);
+    if(!f.open(QIODevice::WriteOnly)) return false;
+    QDataStream out(&f);
+    out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    out << (quint32)LINEAR_FILE_MAGIC << (quint32)LINEAR_FILE_VERSION << (qint32)type() << (qint32)m->labels << (qint32)m->dimension;
+    out << m->labelValues << m->scaleA << m->scaleB;
+    for(int k = 0; k < m->labels; k++)
+    {
+        for(int j = 0; j < m->dimension; j++) out << m->weight[k * m->stride + j];
+    }
+    out << m->bias << labelNames;
+    return out.status() == QDataStream::Ok && f.commit();
+}
+
+bool LinearClassifier::load(const QString &path, QStringList *labelNames)
+{
+    QFile f(path);
+    if(!f.open(QIODevice::ReadOnly)) return false;
+    QDataStream in(&f);
+    in.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+    quint32 magic, version;
+    qint32 fileType, labels, dimension;
+    in >> magic >> version >> fileType >> labels >> dimension;
+    if(in.status() != QDataStream::Ok || magic != LINEAR_FILE_MAGIC || version != LINEAR_FILE_VERSION
+            || (fileType != TYPE_LINEAR && fileType != TYPE_CENTROID) || labels <= 0 || dimension <= 0)
+        return false;
+
+    LinearModel *m = new LinearModel;
+    m->labels = labels;
+    m->dimension = dimension;
+    m->stride = (dimension + 7) & ~7;
+    m->weight.fill(0, labels * m->stride);
+    in >> m->labelValues >> m->scaleA >> m->scaleB;
+    for(int k = 0; k < labels; k++)
+    {
+        for(int j = 0; j < dimension; j++) in >> m->weight[k * m->stride + j];
+    }
+    QStringList names;
+    in >> m->bias >> names;
+    if(in.status() != QDataStream::Ok || m->labelValues.size() != labels || m->scaleA.size() != dimension
+            || m->scaleB.size() != dimension || m->bias.size() != labels)
+    {
+        delete m;
+        return false;
+    }
+
+    cancelTraining();
+    modelLock.lock();
+    current = QSharedPointer<const LinearModel>(m);
+    modelLock.unlock();
+    if(labelNames != NULL) *labelNames = names;
+    return true;
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 最近傍重心(マハラノビス距離)
+
+CentroidClassifier::CentroidClassifier(QObject *parent)
+    : LinearClassifier(parent)
+    , shrinkage(0.1)
+{
+}
+
+LinearModel *CentroidClassifier::fit(const ProblemView &problems, int g) const
+{
+    QVector<float> x;
+    QVector<int> y;
+    LinearModel *m = prepare(problems, &x, &y);
+    if(m == NULL) return NULL;
+
+    int n = y.size(), d = m->dimension, K = m->labels;
+
+    // ラベルごとの重心
+    QVector<double> mean(K * d, 0);
+    QVector<int> count(K, 0);
+    for(int i = 0; i < n; i++)
+    {
+        const float *xi = x.constData() + i * d;
+        double *mk = mean.data() + y[i] * d;
+        for(int j = 0; j < d; j++) mk[j] += xi[j];
+        count[y[i]]++;
+    }
+    for(int k = 0; k < K; k++)
+    {
+        for(int j = 0; j < d; j++) mean[k * d + j] /= count[k];
+    }
+    progress(g, 10);
+
+    // 重心からの偏差の共分散(全ラベル共通、上三角だけ求めて写す)
+    QVector<double> cov(d * d, 0), dev(d);
+    for(int i = 0; i < n; i++)
+    {
+        if(i % 256 == 0 && cancelled(g))
+        {
+            delete m;
+            return NULL;
+        }
+        const float *xi = x.constData() + i * d;
+        const double *mk = mean.constData() + y[i] * d;
+        for(int j = 0; j < d; j++) dev[j] = xi[j] - mk[j];
+        for(int a = 0; a < d; a++)
+        {
+            double *row = cov.data() + a * d;
+            double da = dev[a];
+            for(int b = a; b < d; b++) row[b] += da * dev[b];
+        }
+    }
+    double trace = 0;
+    for(int a = 0; a < d; a++)
+    {
+        for(int b = a; b < d; b++)
+        {
+            cov[a * d + b] /= qMax(1, n - K);
+            cov[b * d + a] = cov[a * d + b];
+        }
+        trace += cov[a * d + a];
+    }
+    progress(g, 60);
+
+    // 縮小推定(偏差がなければ単位行列、つまりユークリッド距離になる)
+    double alpha = qBound(0.0, shrinkage, 1.0);
+    double diagonal = trace > 0 ? trace / d : 1;
+    if(trace <= 0) alpha = 1;
+    for(int a = 0; a < d; a++)
+    {
+        for(int b = 0; b < d; b++) cov[a * d + b] *= 1 - alpha;
+        cov[a * d + a] += alpha * diagonal;
+    }
+
+    // コレスキー分解 Σ = LLᵀ (下三角にLを書く)
+    for(int a = 0; a < d; a++)
+    {
+        for(int b = 0; b <= a; b++)
+        {
+            double sum = cov[a * d + b];
+            for(int c = 0; c < b; c++) sum -= cov[a * d + c] * cov[b * d + c];
+            if(a == b)
+            {
+                if(sum <= 0)
+                {
+                    delete m;
+                    return NULL;
+                }
+                cov[a * d + a] = sqrt(sum);
+            }
+            else
+            {
+                cov[a * d + b] = sum / cov[b * d + b];
+            }
+        }
+    }
+    progress(g, 90);
+
+    // weight[k] = Σ⁻¹μ[k] (前進代入と後退代入)、bias[k] = -μ[k]ᵀΣ⁻¹μ[k] / 2
+    QVector<double> z(d);
+    for(int k = 0; k < K; k++)
+    {
+        const double *mk = mean.constData() + k * d;
+        for(int a = 0; a < d; a++)
+        {
+            double sum = mk[a];
+            for(int c = 0; c < a; c++) sum -= cov[a * d + c] * z[c];
+            z[a] = sum / cov[a * d + a];
+        }
+        for(int a = d - 1; a >= 0; a--)
+        {
+            double sum = z[a];
+            for(int c = a + 1; c < d; c++) sum -= cov[c * d + a] * z[c];
+            z[a] = sum / cov[a * d + a];
+        }
+        double quad = 0;
+        for(int a = 0; a < d; a++)
+        {
+            m->weight[k * m->stride + a] = z[a];
+            quad += mk[a] * z[a];
+        }
+        m->bias[k] = -quad / 2;
+    }
+    return m;
+}
@@ -0,0 +1,89 @@
+#ifndef LINEARCLASSIFIER_H
+#define LINEARCLASSIFIER_H
+
+#include "classifier.h"
+#include <QSharedPointer>
+
+// 線形の識別器の学習済みモデル。公開した後は書き換えない
+// 入力を正規化した x' に対して、ラベルkの値 score[k] = weight[k]・x' + bias[k] が最大のラベルを選び、確率は softmax(score) とする
+struct LinearModel
+{
+    LinearModel() : labels(0), dimension(0), stride(0) {}
+    int labels, dimension;
+    int stride;                     // weightの行の間隔(8の倍数。行の先頭をSIMDの幅に揃える)
+    QVector<float> scaleA, scaleB;  // 正規化 a * x + b (SVMClassifierと同じく、学習データの[最小値, 最大値]を[-1, 1]に写す)
+    QVector<float> weight;          // labels × stride
+    QVector<float> bias;
+    QVector<double> labelValues;    // k番目のラベルの値(学習データのy、昇順)。確率もこの順に並べる
+};
+
+// 多クラスのロジスティック回帰による識別器
+// 識別は正規化とラベルごとの内積(SIMD)だけなので、計算量はラベル数×次元で、RBFカーネルのSVMのようにサポートベクタの数に比例しない
+// 学習はソフトマックス交差エントロピー+L2正則化を、Nesterovの加速勾配法で最小化する
+// モデルの差し替え・保存と読み込みは、学習方法の違うCentroidClassifierと共通
+class LinearClassifier : public Classifier
+{
+    Q_OBJECT
+public:
+    explicit LinearClassifier(QObject *parent = 0);
+    // 学習中ならそれを取り消し、学習スレッドが終わるのを待つ
+    ~LinearClassifier();
+
+    virtual Type type() const { return TYPE_LINEAR; }
+    virtual int labelCount() const;
+    virtual int dimension() const;
+    virtual bool isTrained() const { return !model().isNull(); }
+    // 識別に使っている学習済みモデル。受け取った側が持っている間は、学習し直しても解放されない
+    QSharedPointer<const LinearModel> model() const;
+
+    virtual double predict(const float *data, int size, double *probability, ClassifierWorkspace &workspace) const;
+    using Classifier::predict;
+
+    // 独自のバイナリ形式(QDataStream)。LinearClassifierとCentroidClassifierのモデルは互いに読める
+    virtual bool save(const QString &path, const QStringList &labelNames = QStringList()) const;
+    virtual bool load(const QString &path, QStringList *labelNames = NULL);
+
+    // L2正則化の強さ(学習中に変えないこと)
+    void setRegularization(double lambda) { regularization = lambda; }
+
+protected:
+    virtual bool build(const ProblemView &problems, int generation);
+    // 学習データからモデルを作る(作業スレッドから呼ばれる)。作れないか、generation番目の学習が取り消されたらNULL
+    // generationが0以上なら進捗をprogress()で通知する
+    virtual LinearModel *fit(const ProblemView &problems, int generation) const;
+    // 正規化の係数とラベルの値を決め、正規化した学習データ(行ごと)と各行のラベル番号を返す。学習データが空ならNULL
+    static LinearModel *prepare(const ProblemView &problems, QVector<float> *scaled, QVector<int> *index);
+
+    double regularization;
+
+private:
+    // generation番目の学習の結果を公開する。その後に取り消されていれば破棄してfalseを返す
+    bool publish(LinearModel *m, int generation);
+
+    // 公開中のモデル(modelLockで保護)
+    QSharedPointer<const LinearModel> current;
+};
+
+// 最近傍重心(マハラノビス距離)による識別器
+// ラベルごとの重心μ[k]と全ラベル共通の共分散Σから、距離 d²[k] = (x-μ[k])ᵀΣ⁻¹(x-μ[k]) が最小のラベルを選ぶ
+// Σが共通なので xᵀΣ⁻¹x はラベルによらず、-d²/2 は weight[k] = Σ⁻¹μ[k], bias[k] = -μ[k]ᵀΣ⁻¹μ[k]/2 の線形式になる
+// (識別はLinearClassifierと同じで、確率は softmax(-d²/2) = 等分散の正規分布とみなしたときの事後確率)
+// 学習は平均と共分散を1回求めてコレスキー分解で解くだけなので、反復せずにすぐ終わる
+class CentroidClassifier : public LinearClassifier
+{
+    Q_OBJECT
+public:
+    explicit CentroidClassifier(QObject *parent = 0);
+
+    virtual Type type() const { return TYPE_CENTROID; }
+    // 共分散の縮小推定 (1-α)Σ + α(tr(Σ)/次元)I の α。学習データが次元より少なくても逆行列が求まるようにする
+    void setShrinkage(double alpha) { shrinkage = alpha; }
+
+protected:
+    virtual LinearModel *fit(const ProblemView &problems, int generation) const;
+
+private:
+    double shrinkage;
+};
+
+#endif // LINEARCLASSIFIER_H
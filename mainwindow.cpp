@@ -22,6 +22,17 @@ void ConfigWidget::setupUI()
     vlay->addWidget(&audioInputs);
     vlay->addWidget(new QLabel("Audio Output Device:"));
     vlay->addWidget(&audioOutputs);
+    // 複数のチャンネルを選ぶと、チャンネルごとの特徴ベクトルを連結して使う(面ごとにピックアップを付ける場合)
+    vlay->addWidget(new QLabel("Input Channels (e.g. 2 or 1,2,3):"));
+    inputChannels.setText("2");
+    vlay->addWidget(&inputChannels);
+    // RBFのSVMの識別が重い環境では、線形の識別器を選ぶ
+    vlay->addWidget(new QLabel("Classifier:"));
+    for(int i = 0; i < Classifier::TYPE_COUNT; i++)
+    {
+        classifierTypes.addItem(Classifier::typeName((Classifier::Type)i), i);
+    }
+    vlay->addWidget(&classifierTypes);
     okButton.setText("OK");
     connect(&okButton, SIGNAL(clicked()), SLOT(accept()));
     vlay->addWidget(&okButton);
@@ -29,11 +40,66 @@ void ConfigWidget::setupUI()
     this->setLayout(vlay);
 }
 
+QList<int> ConfigWidget::getInputChannels(QString *error)
+{
+    QList<int> channels;
+    QStringList invalid;
+    foreach(QString s, inputChannels.text().split(",", QString::SkipEmptyParts))
+    {
+        bool ok;
+        int ch = s.trimmed().toInt(&ok);
+        if(!ok || ch <= 0) invalid.append(s.trimmed());
+        else if(!channels.contains(ch - 1)) channels.append(ch - 1);
+    }
+    if(error != NULL) error->clear();
+    if(!invalid.isEmpty() && error != NULL) *error = QString("invalid input channel %1").arg(invalid.join(","));
+    if(channels.isEmpty())
+    {
+        channels.append(1);
+        if(error != NULL && !error->isEmpty()) *error += ", using channel 2";
+    }
+    return channels;
+}
+
 /*====================================================================================================================================================================================================================================================================================*/
 // メインウィンドウ
+
+// 学習データ(frames.stf)と学習済みモデル(model.stsv、SVM以外の識別器はmodel-<種類>.stln)の保存先
+// 学習データはテイクごとに、モデルは学習が終わるたびに書き込み、次の起動時に読み込んで学習し直さずに識別を始める
+static QString dataPath(QString name)
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::DataLocation);
+    QDir().mkpath(dir);
+    return dir + "/" + name;
+}
+
+QStringList MainWindow::labelNames() const
+{
+    QStringList names;
+    foreach(TrainLabel *t, labelList) names.append(t->Name());
+    return names;
+}
+
+bool MainWindow::modelMatches()
+{
+    if(!modelCurrent || !classifier->isTrained() || modelLabels != labelNames()) return false;
+    // 特徴ベクトルの次元(まだフレームが届いていなければ学習データの次元)
+    int dimension = aas->getData().size();
+    if(dimension == 0) dimension = store.dimension();
+    return dimension == 0 || dimension == classifier->dimension();
+}
+
+QString MainWindow::modelPath() const
+{
+    if(classifier->type() == Classifier::TYPE_SVM) return dataPath("model.stsv");
+    return dataPath("model-" + Classifier::typeName(classifier->type()) + ".stln");
+}
+
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
+    , classifier(NULL)
     , defaultLabel(NULL)
+    , modelCurrent(false)
 {
     connect(&autoButton, SIGNAL(toggled(bool)), SLOT(switchAutoMode(bool)));
 
@@ -137,6 +203,18 @@ MainWindow::MainWindow(QWidget *parent)
         return;
     }
     conf.getInputName();
+
+    // 識別器(設定画面で選んだもの)
+    classifier = Classifier::create(conf.getClassifierType());
+    connect(classifier, SIGNAL(trainingProgress(int)), SLOT(classifierTrainingProgress(int)));
+    connect(classifier, SIGNAL(trainingFinished(bool)), SLOT(classifierTrainingFinished(bool)));
+    SVMClassifier *svm = qobject_cast<SVMClassifier *>(classifier);
+    if(svm != NULL)
+    {
+        connect(svm, SIGNAL(tuningPoint(double,double,double,int)), SLOT(svmTuningPoint(double,double,double,int)));
+        // CとgammaはSVMClassifierの既定値ではなく、学習データごとにグリッドサーチで決める
+        svm->setAutoTune(true);
+    }
     
     
     /////////////////////
@@ -144,7 +222,14 @@ MainWindow::MainWindow(QWidget *parent)
     /////////////////////
     
     // ActiveAcousticSensorクラス(以降AAS)のインスタンスを生成
-    aas = new AIFActiveAcousticSensor(conf.getInputName(), conf.getOutputName());
+    AIFActiveAcousticSensor *aif = new AIFActiveAcousticSensor(conf.getInputName(), conf.getOutputName());
+    // 入力に無いチャンネルを選んでいたら、使うチャンネルと一緒に知らせる
+    QString channelError;
+    QList<int> inputs = conf.getInputChannels(&channelError);
+    QString channelStatus = aif->setInputChannels(inputs);
+    if(channelStatus != "OK") channelError = channelError.isEmpty() ? channelStatus : channelError + "; " + channelStatus;
+    if(!channelError.isEmpty()) plotter.drawText(channelError, 10);
+    aas = aif;
     // AASを開始。シリアル通信を行いそれを整理した特徴ベクトルの送信がこちらへ向けて行われる
     // 処理開始できたら文字列OKが返り、開始出来なかった場合はシリアルポートクラスのエラーが返る
     qDebug() << aas->start();
@@ -156,12 +241,53 @@ MainWindow::MainWindow(QWidget *parent)
     connect(&volumeSlider, SIGNAL(valueChanged(int)), SLOT(threshChanged(int)));
     volumeSlider.setRange(0, 300);
     volumeSlider.setValue(30);
+
+    // 遅延の計測結果の表示(Ctrl+Lで切り替え)
+    latencyTimer.setInterval(500);
+    connect(&latencyTimer, SIGNAL(timeout()), SLOT(updateLatencyOverlay()));
     
+    // 前回までの学習データのラベルを作り直す
+    if(!store.open(dataPath("frames.stf")))
+    {
+        // 保存先に書けなければ、今回の起動の間だけ一時ファイルに置く
+        qDebug() << "failed to open the frame store:" << store.fileName();
+        store.open(QDir::tempPath() + QString("/stethos-frames-%1.stf").arg(QCoreApplication::applicationPid()));
+    }
+    foreach(int id, store.labels()) addNewLabel(store.labelName(id), id);
+
+    // 前回の学習済みモデルがあり、ラベルが同じなら(学習データがなければそのラベルを作って)識別から始める
+    QStringList names;
+    if(classifier->load(modelPath(), &names) && names.size() == classifier->labelCount())
+    {
+        if(labelList.isEmpty())
+        {
+            foreach(QString name, names) addNewLabel(name);
+        }
+        modelLabels = names;
+        if(labelNames() == names)
+        {
+            modelCurrent = true;
+            tab.setCurrentIndex(PREDICT);
+        }
+    }
+
     // ウィンドウを表示
     this->show();
 }
 MainWindow::~MainWindow()
 {
+    // 学習スレッドがstoreの行を参照しているので、storeより先に破棄して学習の終了を待つ
+    delete classifier;
+
+    // 今回の起動で計測した遅延を残す(入出力を始めていなければ何もしない)
+    LatencyProbe *probe = LatencyProbe::instance();
+    if(probe->histogram(LatencyProbe::STAGE_CAPTURE).count() > 0)
+    {
+        if(probe->save(dataPath("latency.json")))
+            qDebug() << "latency:" << dataPath("latency.json");
+        else
+            qDebug() << "failed to save the latency:" << dataPath("latency.json");
+    }
 }
 
 
@@ -208,9 +334,12 @@ void MainWindow::tabChanged(int num)
     switch(num)
     {
     case LABEL:
+        classifier->cancelTraining();
         plotter.setColor(Qt::gray);
         break;
     case TRAIN:
+        // 学習データを足すなら、学習中のモデルは古くなるので取り消す
+        classifier->cancelTraining();
         if(labelList.isEmpty())
         {
             tab.setCurrentIndex(0);
@@ -228,10 +357,13 @@ void MainWindow::tabChanged(int num)
             return;
         }
 
+        // 学習データが前回の学習から変わっていなければ(起動時に読み込んだモデルを含む)、学習し直さない
+        if(modelMatches()) return;
+
         //train data check
         foreach(TrainLabel *t, labelList)
         {
-            if(t->getTrainData().isEmpty())
+            if(!t->hasTrainData())
             {
                 tab.setCurrentIndex(1);
                 plotter.drawText("plaese train all labels.", 2);
@@ -239,23 +371,62 @@ void MainWindow::tabChanged(int num)
             }
         }
 
-        //build svm model
-        QList<QPair<double, QVector<float> > > problems;
-        int id = 0;
+        //build model
+        // 学習データはストアの行を直接参照する(コピーしない)
+        QList<int> labels;
         foreach(TrainLabel *t, labelList)
         {
-            foreach(QVector<float> d, t->getTrainData())
-            {
-                problems.append(QPair<double, QVector<float> >((double)id, d));
-            }
-            id++;
+            labels.append(t->labelId());
         }
-        svm.train(problems);
+        // 学習はバックグラウンドで行い、終わるまでは前のモデル(あれば)で識別を続ける
+        trainingLabels = labelNames();
+        classifier->trainAsync(Classifier::makeProblems(store, labels));
 
         break;
     }
 }
 
+void MainWindow::classifierTrainingProgress(int percent)
+{
+    plotter.drawText(QString("training... %1%").arg(percent));
+}
+
+void MainWindow::svmTuningPoint(double C, double gamma, double accuracy, int msec)
+{
+    Q_UNUSED(msec);
+    plotter.drawText(QString("tuning... C=%1 gamma=%2 %3%").arg(C).arg(gamma).arg(accuracy, 0, 'f', 1));
+}
+
+void MainWindow::classifierTrainingFinished(bool success)
+{
+    plotter.drawText(success ? "training finished." : "training canceled.", 2);
+    if(!success) return;
+
+    modelCurrent = true;
+    modelLabels = trainingLabels;
+    if(!classifier->save(modelPath(), modelLabels)) qDebug() << "failed to save the model:" << modelPath();
+}
+
+// ラベルのテイクが増えたか消された
+void MainWindow::trainingDataChanged()
+{
+    modelCurrent = false;
+}
+
+// 特徴抽出の設定が変わって、特徴ベクトルの次元が学習データと違う
+void MainWindow::featureSizeChanged(int size)
+{
+    // 学習データが全て消されていれば、新しい次元で取り直す(学習中はその行を参照しているので作り直さない)
+    if(classifier->isTraining() || !store.reset()) return;
+    qDebug() << "frame store reset for feature size" << size;
+}
+
+void MainWindow::takeRejected(int size)
+{
+    plotter.drawText(QString("take rejected: feature size %1 != %2. delete old takes.").arg(size).arg(store.dimension()), 5);
+    qDebug() << "failed to store the take: feature size" << size << "store" << store.dimension();
+}
+
 
 /*====================================================================================================================================================================================================================================================================================*/
 // シリアル通信で取得され纏められた特徴ベクトルが更新される度に実行
@@ -271,9 +442,10 @@ void MainWindow::senseDataChanged(QVector<float> senseData)
 
     if(tab.currentIndex() == PREDICT && !labelList.empty())
     {
-        double *probability = new double[labelList.size()];
+        // 確率の受け取り領域は使い回す(ラベル数が増えたときだけ確保される)
+        probability.fill(0, qMax(labelList.size(), classifier->labelCount()));
         // 推定を行う(尤度を返すようにしている際は尤度が返る)
-        double res = svm.predict(senseData, probability);
+        double res = classifier->predict(senseData, probability.data());
         for(int i = 0; i < labelList.size(); i++)
         {
             bool isTrueLabel = (i == (int)res);
@@ -284,9 +456,29 @@ void MainWindow::senseDataChanged(QVector<float> senseData)
             labelList[i]->getPredictionLabel()->setResult(isTrueLabel);
             labelList[i]->getPredictionLabel()->setProbability(probability[i]);
         }
+        LatencyProbe::instance()->framePredicted();
     }
 }
 
+void MainWindow::toggleLatencyOverlay()
+{
+    if(latencyTimer.isActive())
+    {
+        latencyTimer.stop();
+        plotter.setOverlay(QStringList());
+    }
+    else
+    {
+        latencyTimer.start();
+        updateLatencyOverlay();
+    }
+}
+
+void MainWindow::updateLatencyOverlay()
+{
+    plotter.setOverlay(LatencyProbe::instance()->summary());
+}
+
 
 /*====================================================================================================================================================================================================================================================================================*/
 // 新しいラベル追加ボタンが押下されたとき
@@ -295,8 +487,8 @@ void MainWindow::createLabelButtonPushed()
     addNewLabel(labelEdit.text());
     labelEdit.clear();
 }
-// 新しいラベルを追加
-void MainWindow::addNewLabel(QString name)
+// 新しいラベルを追加(storeIdが-1ならストアにもラベルを作る。0以上ならストアにある既存のラベル)
+void MainWindow::addNewLabel(QString name, int storeId)
 {
     if(name.isEmpty()) return;
     QStringList labelNameList;
@@ -317,8 +509,16 @@ void MainWindow::addNewLabel(QString name)
         return;
     }
 
+    if(storeId < 0) storeId = store.addLabel(name);
+    if(storeId < 0)
+    {
+        plotter.drawText("too many labels.", 2);
+        return;
+    }
+
+    modelCurrent = false;
     QColor color = colorTrash.isEmpty() ? color_templates.at(labelList.count()) : colorTrash.takeFirst();
-    TrainLabel *newlabel = new TrainLabel(name, color, aas);
+    TrainLabel *newlabel = new TrainLabel(name, color, aas, &store, storeId);
     labelList.append(newlabel);
     definitionLay->addWidget(newlabel->getDefinitionLabel());
     trainingLay->addWidget(newlabel);
@@ -326,6 +526,9 @@ void MainWindow::addNewLabel(QString name)
     connect(newlabel, SIGNAL(defaultPressed()), SLOT(defaultChanged()));
     connect(newlabel, SIGNAL(deleted()), SLOT(labelDeleted()));
     connect(newlabel, SIGNAL(trainFinished()), SLOT(trainFinshed()));
+    connect(newlabel, SIGNAL(dataChanged()), SLOT(trainingDataChanged()));
+    connect(newlabel, SIGNAL(featureSizeChanged(int)), SLOT(featureSizeChanged(int)));
+    connect(newlabel, SIGNAL(takeRejected(int)), SLOT(takeRejected(int)));
 }
 // 訓練終了
 void MainWindow::trainFinshed()
@@ -342,7 +545,7 @@ void MainWindow::trainFinshed()
             {
                 if(tlist[i]->getTrainCount() < trainTimes.value())
                 {
-                    thresholdVector = defaultLabel->getTrainData().last();
+                    thresholdVector = defaultLabel->lastFrame();
                     tlist[i]->setTrain(TrainLabel::AUTO, thresholdVector);
                     plotter.drawText("please perform " +
                                      tlist[i]->Name() +
@@ -397,6 +600,8 @@ void MainWindow::labelDeleted()
     TrainLabel *label = dynamic_cast<TrainLabel *>(QObject::sender());
     if(label == defaultLabel) defaultLabel = NULL;
     labelList.removeOne(label);
+    store.removeLabel(label->labelId());
+    modelCurrent = false;
     definitionLay->removeWidget(label->getDefinitionLabel());
     predictionLay->removeWidget(label->getPredictionLabel());
     trainingLay->removeWidget(label);
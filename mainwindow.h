@@ -6,6 +6,7 @@
 #include "trainlabel.h"
 #include "activeacousticsensor.h"
 #include "plotter.h"
+#include "classifier.h"
 #include "svmclassifier.h"
 #include <QSerialPortInfo>
 #include <QKeyEvent>
@@ -24,9 +25,14 @@ public:
 
     QString getInputName() { return audioInputs.currentText(); }
     QString getOutputName() { return audioOutputs.currentText(); }
+    // 特徴を求める入力チャンネル(表示は1始まり、戻り値は0始まり)
+    // チャンネル番号として読めない項目は使わず、errorにその旨を返す(全て読めれば空)。1つも読めなければ既定の2ch目を返す
+    QList<int> getInputChannels(QString *error = NULL);
+    Classifier::Type getClassifierType() { return (Classifier::Type)classifierTypes.currentData().toInt(); }
 private:
     void setupUI();
-    QComboBox audioInputs, audioOutputs;
+    QComboBox audioInputs, audioOutputs, classifierTypes;
+    QLineEdit inputChannels;
     QPushButton okButton;
 };
 
@@ -123,20 +129,41 @@ private:
     QInputDialog inputMethod;
     
     ActiveAcousticSensor *aas;
-    SVMClassifier svm;
+    // 学習データ。識別器の学習スレッドが参照するので、識別器はデストラクタでstoreより先に破棄する
+    FrameStore store;
+    Classifier *classifier;  // 設定画面で選んだ識別器
+    QVector<double> probability; // 識別結果の確率(毎フレーム使い回す)
     TrainLabel *defaultLabel;
+    bool modelCurrent; // 識別器のモデルが今の学習データで学習したものか
+    QStringList modelLabels, trainingLabels; // モデル(学習中のもの)のラベル名(ラベル番号順)
+    QTimer latencyTimer; // 遅延の計測結果の表示を更新する(表示中のみ動かす)
+
+    // 識別器の種類ごとのモデルの保存先
+    QString modelPath() const;
+    QStringList labelNames() const;
+    // 識別器のモデルを学習し直さずに使えるか(学習データが変わっておらず、ラベル名と順序・特徴ベクトルの次元が今と同じ)
+    bool modelMatches();
 
 private slots:
     // アクションメソッド
     void createLabelButtonPushed();
-    void addNewLabel(QString name);
+    void addNewLabel(QString name, int storeId = -1);
     void senseDataChanged(QVector<float> senseData);
     void tabChanged(int tab);
     void labelDeleted();
     void trainFinshed();
+    void classifierTrainingProgress(int percent);
+    void classifierTrainingFinished(bool success);
+    void svmTuningPoint(double C, double gamma, double accuracy, int msec);
+    void trainingDataChanged();
+    void featureSizeChanged(int size);
+    void takeRejected(int size);
     void defaultChanged();
     void switchAutoMode(bool b);
     void threshChanged(int v);
+    // 音声の到着から識別結果の描画までの遅延(LatencyProbe)の表示を切り替える
+    void toggleLatencyOverlay();
+    void updateLatencyOverlay();
 
 protected:
     // trainタブに居るときに数字キーを押すことで、マニュアルモードでラベルを押し続けるのと同じ動作(学習)を行う
@@ -148,6 +175,11 @@ protected:
         {
             labelList.at(key)->manualStart();
         }
+        // Ctrl+L(macではCmd+L)で遅延の計測結果を波形に重ねて表示する
+        if(ev->key() == Qt::Key_L && (ev->modifiers() & Qt::ControlModifier))
+        {
+            toggleLatencyOverlay();
+        }
         QMainWindow::keyPressEvent(ev);
     }
     // リリース時
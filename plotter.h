@@ -137,6 +137,16 @@ protected:
         QFont f = QFont("Helvetica", 16);
         painter.setFont(f);
         if(!text.isEmpty()) painter.drawText(QRectF(20, 15, width(), 30), Qt::AlignVCenter, text);
+        if(!overlay.isEmpty())
+        {
+            // 表の列が揃うように等幅で、左下に重ねる
+            QFont mono("Courier", 11);
+            mono.setStyleHint(QFont::Monospace);
+            painter.setFont(mono);
+            int lineHeight = QFontMetrics(mono).height();
+            QRectF overlayRect(20, height() - 15 - lineHeight * overlay.size(), width() - 20, lineHeight * overlay.size());
+            painter.drawText(overlayRect, Qt::AlignLeft | Qt::AlignTop, overlay.join("\n"));
+        }
         painter.end();
     }
 
@@ -192,6 +202,13 @@ public slots:
         text = "";
     }
 
+    // 波形に重ねて表示する複数行のテキスト(空なら表示しない)
+    void setOverlay(QStringList lines)
+    {
+        overlay = lines;
+        update();
+    }
+
     void toggleCircleMode()
     {
         circleMode = !circleMode;
@@ -203,6 +220,7 @@ private:
     bool circleMode;
     float reg;
     QString text;
+    QStringList overlay;
     QList<QVector<float> > dataList;
     QList<QColor> color_templates;
     QColor color;
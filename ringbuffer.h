@@ -0,0 +1,79 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <QAtomicInt>
+#include <QVector>
+
+// 書き込み側1スレッド・読み出し側1スレッド専用のロックフリーリングバッファ
+// 容量は2のべき乗に切り上げる。書き込み側はheadだけ、読み出し側はtailだけを更新するので、
+// どちらもロックを取らずに相手を待たせない。満杯時に書き込めなかった分は呼び出し側で数える
+template <typename T>
+class RingBuffer
+{
+public:
+    explicit RingBuffer(int capacity = 1 << 16)
+        : head(0)
+        , tail(0)
+    {
+        int n = 1;
+        while(n < capacity) n <<= 1;
+        buffer.resize(n);
+        mask = n - 1;
+    }
+
+    int capacity() const { return (int)mask + 1; }
+
+    // 読み出し可能な要素数(どちらのスレッドから呼んでもよいが、値は呼んだ瞬間のもの)
+    int size() const
+    {
+        return (int)(head.loadAcquire() - tail.loadAcquire());
+    }
+
+    // 書き込み側: 書き込めた要素数を返す(満杯なら残りは捨てる)
+    int push(const T *src, int n)
+    {
+        quint32 h = head.load();
+        int free = capacity() - (int)(h - tail.loadAcquire());
+        if(n > free) n = free;
+        T *b = buffer.data();
+        for(int i = 0; i < n; i++)
+        {
+            b[(h + (quint32)i) & mask] = src[i];
+        }
+        head.storeRelease(h + (quint32)n);
+        return n;
+    }
+
+    // 読み出し側: 読み出せた要素数を返す
+    int pop(T *dst, int n)
+    {
+        quint32 t = tail.load();
+        int avail = (int)(head.loadAcquire() - t);
+        if(n > avail) n = avail;
+        const T *b = buffer.constData();
+        for(int i = 0; i < n; i++)
+        {
+            dst[i] = b[(t + (quint32)i) & mask];
+        }
+        tail.storeRelease(t + (quint32)n);
+        return n;
+    }
+
+    // 読み出し側: 溜まっている要素を全て捨てる
+    void clear()
+    {
+        tail.storeRelease(head.loadAcquire());
+    }
+
+private:
+    QVector<T> buffer;
+    quint32 mask;
+    // 添字は単調増加させ、maskで剰余をとる(符号無しなので桁あふれしても差分は正しい)
+    QAtomicInteger<quint32> head;
+    QAtomicInteger<quint32> tail;
+
+    RingBuffer(const RingBuffer &);
+    RingBuffer &operator=(const RingBuffer &);
+};
+
+#endif // RINGBUFFER_H
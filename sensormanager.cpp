@@ -0,0 +1,282 @@
+#include "sensormanager.h"
+
+// 1つのセンサの1つの仕事(AIF版では1チャンネル)をワーカースレッドで処理するタスク
+class SensorWorkTask : public QRunnable
+{
+public:
+    SensorWorkTask(SensorManager *manager, int id, int index) : manager(manager), id(id), index(index) {}
+    void run() { manager->runWork(id, index); }
+
+private:
+    SensorManager *manager;
+    int id, index;
+};
+
+SensorManager::SensorManager(int threads, QObject *parent)
+    : QObject(parent)
+    , pool(threads)
+    , dispatcher(this)
+    , predictionsPending(0)
+{
+    clock.start();
+}
+
+SensorManager::~SensorManager()
+{
+    stopAll();
+    foreach(ManagedSensor *m, sensors)
+    {
+        delete m->sensor;
+        delete [] m->busy;
+        delete [] m->queuedAt;
+        delete m;
+    }
+}
+
+int SensorManager::addSensor(ActiveAcousticSensor *sensor, Classifier *classifier)
+{
+    ManagedSensor *m = new ManagedSensor;
+    m->sensor = sensor;
+    m->work = 0;
+    m->busy = NULL;
+    m->queuedAt = NULL;
+    m->classifier = classifier;
+    m->classifiedFrame = -1;
+    m->frames = m->works = m->predictions = 0;
+    m->latencyNs = m->maxLatencyNs = m->workNs = m->predictNs = 0;
+    m->lastLabel = -1;
+    m->predictionPending.store(0);
+    sensor->setParent(NULL);
+    sensor->setExternalWake(&wake);
+    sensors.append(m);
+
+    // 特徴抽出を自前で行うセンサ(シリアル版)はシグナルで受け取る
+    if(sensor->workCount() == 0)
+        connect(sensor, SIGNAL(senseDataChanged(QVector<float>)), SLOT(serialDataChanged(QVector<float>)));
+    return sensors.size() - 1;
+}
+
+void SensorManager::setClassifier(int id, Classifier *classifier)
+{
+    ManagedSensor *m = sensors[id];
+    QMutexLocker locker(&m->classifyLock);
+    m->classifier = classifier;
+    m->classifiedFrame = -1;
+}
+
+QString SensorManager::startAll()
+{
+    stopAll();
+    resetStats();
+
+    QString ret = "OK";
+    foreach(ManagedSensor *m, sensors)
+    {
+        // 仕事の数はチャンネル構成で決まるので、開始のたびに取り直す
+        delete [] m->busy;
+        delete [] m->queuedAt;
+        m->work = m->sensor->workCount();
+        m->busy = new QAtomicInt[qMax(1, m->work)];
+        m->queuedAt = new qint64[qMax(1, m->work)];
+        for(int i = 0; i < m->work; i++)
+        {
+            m->busy[i].store(0);
+            m->queuedAt[i] = 0;
+        }
+
+        QString r = m->sensor->start();
+        if(r != "OK" && ret == "OK") ret = r;
+    }
+    dispatcher.start(QThread::HighPriority);
+    return ret;
+}
+
+void SensorManager::stopAll()
+{
+    // 先に仕事の受け付けを止め、積んである仕事が全て終わってからセンサを止める
+    dispatcher.requestInterruption();
+    wake.release();
+    dispatcher.wait();
+    pool.waitForDone();
+    foreach(ManagedSensor *m, sensors)
+    {
+        m->sensor->stop();
+    }
+}
+
+void SensorDispatcher::run()
+{
+    while(!isInterruptionRequested())
+    {
+        // いずれかのセンサにサンプルが届くまで眠る(センサ・仕事の終わり・stopAll()がreleaseする)
+        // 起きたら溜まっている分をまとめて取り、1回のdispatch()で全センサを見る
+        manager->wake.acquire();
+        manager->wake.tryAcquire(manager->wake.available());
+        manager->dispatch();
+    }
+}
+
+// データの溜まっている仕事を、まだ積まれていなければプールに積む
+// 同じ仕事は終わるまで2重には積まないので、センサの処理はチャンネルごとに直列、センサ間・チャンネル間では並列になる
+void SensorManager::dispatch()
+{
+    qint64 now = clock.nsecsElapsed();
+    for(int id = 0; id < sensors.size(); id++)
+    {
+        ManagedSensor *m = sensors[id];
+        for(int i = 0; i < m->work; i++)
+        {
+            if(m->busy[i].load() || !m->sensor->hasWork(i)) continue;
+            m->busy[i].store(1);
+            m->queuedAt[i] = now;
+            SensorWorkTask *task = new SensorWorkTask(this, id, i);
+            task->setAutoDelete(true);
+            pool.submit(task);
+        }
+    }
+}
+
+void SensorManager::runWork(int id, int index)
+{
+    ManagedSensor *m = sensors[id];
+    qint64 begin = clock.nsecsElapsed();
+    m->sensor->runWork(index);
+    qint64 worked = clock.nsecsElapsed();
+    classify(m);
+    qint64 end = clock.nsecsElapsed();
+
+    m->statsLock.lock();
+    m->works++;
+    m->workNs += worked - begin;
+    qint64 latency = end - m->queuedAt[index];
+    m->latencyNs += latency;
+    if(latency > m->maxLatencyNs) m->maxLatencyNs = latency;
+    m->statsLock.unlock();
+
+    m->busy[index].store(0);
+    // 処理中に次のデータが溜まっていれば、取りこぼさないようにディスパッチャを起こす
+    if(m->sensor->hasWork(index)) wake.release();
+}
+
+// センサの最新フレームが未識別なら識別する
+void SensorManager::classify(ManagedSensor *m)
+{
+    // 同じセンサの別の仕事が識別中なら、そちらが最新フレームを拾うので任せる
+    if(!m->classifyLock.tryLock()) return;
+    qint64 frame = m->sensor->copyLatestFrame(m->frame);
+    if(frame < 0 || frame == m->classifiedFrame)
+    {
+        m->classifyLock.unlock();
+        return;
+    }
+    qint64 newFrames = m->classifiedFrame < 0 ? frame + 1 : frame - m->classifiedFrame;
+    m->classifiedFrame = frame;
+
+    double label = -1;
+    qint64 predictNs = 0;
+    bool classified = m->classifier != NULL;
+    if(classified)
+    {
+        QElapsedTimer t;
+        t.start();
+        if(m->probability.size() < m->classifier->labelCount()) m->probability.resize(m->classifier->labelCount());
+        label = m->classifier->predict(m->frame.constData(), m->frame.size(), m->probability.data(), m->workspace);
+        predictNs = t.nsecsElapsed();
+    }
+    m->classifyLock.unlock();
+
+    m->statsLock.lock();
+    m->frames += newFrames;
+    if(classified)
+    {
+        m->predictions++;
+        m->predictNs += predictNs;
+        m->lastLabel = label;
+    }
+    m->statsLock.unlock();
+
+    // GUIスレッドへは、溜まっている間は通知を1件だけ積む
+    if(classified)
+    {
+        m->predictionPending.store(1);
+        if(predictionsPending.testAndSetOrdered(0, 1))
+            QMetaObject::invokeMethod(this, "takePredictions", Qt::QueuedConnection);
+    }
+}
+
+void SensorManager::takePredictions()
+{
+    predictionsPending.store(0);
+    for(int id = 0; id < sensors.size(); id++)
+    {
+        ManagedSensor *m = sensors[id];
+        if(!m->predictionPending.testAndSetOrdered(1, 0)) continue;
+        m->statsLock.lock();
+        double label = m->lastLabel;
+        m->statsLock.unlock();
+        emit predicted(id, label);
+    }
+}
+
+// 仕事を持たないセンサ(シリアル版)の特徴ベクトル。GUIスレッドで識別する
+void SensorManager::serialDataChanged(QVector<float> data)
+{
+    ActiveAcousticSensor *sensor = qobject_cast<ActiveAcousticSensor *>(QObject::sender());
+    for(int id = 0; id < sensors.size(); id++)
+    {
+        ManagedSensor *m = sensors[id];
+        if(m->sensor != sensor || m->work > 0) continue;
+
+        double label = -1;
+        QElapsedTimer t;
+        t.start();
+        m->classifyLock.lock();
+        if(m->classifier)
+        {
+            if(m->probability.size() < m->classifier->labelCount()) m->probability.resize(m->classifier->labelCount());
+            label = m->classifier->predict(data.constData(), data.size(), m->probability.data(), m->workspace);
+        }
+        bool classified = m->classifier != NULL;
+        m->classifyLock.unlock();
+        qint64 predictNs = t.nsecsElapsed();
+
+        m->statsLock.lock();
+        m->frames++;
+        if(classified)
+        {
+            m->predictions++;
+            m->predictNs += predictNs;
+            m->lastLabel = label;
+        }
+        m->statsLock.unlock();
+        if(classified) emit predicted(id, label);
+    }
+}
+
+SensorStats SensorManager::stats(int id) const
+{
+    const ManagedSensor *m = sensors[id];
+    QMutexLocker locker(&m->statsLock);
+    SensorStats s;
+    double sec = clock.nsecsElapsed() / 1e9;
+    s.frames = m->frames;
+    s.framesPerSecond = sec > 0 ? m->frames / sec : 0;
+    s.meanLatencyUs = m->works > 0 ? m->latencyNs / 1e3 / m->works : 0;
+    s.maxLatencyUs = m->maxLatencyNs / 1e3;
+    s.meanWorkUs = m->works > 0 ? m->workNs / 1e3 / m->works : 0;
+    s.predictions = m->predictions;
+    s.meanPredictUs = m->predictions > 0 ? m->predictNs / 1e3 / m->predictions : 0;
+    s.lastLabel = m->lastLabel;
+    return s;
+}
+
+void SensorManager::resetStats()
+{
+    foreach(ManagedSensor *m, sensors)
+    {
+        QMutexLocker locker(&m->statsLock);
+        m->frames = m->works = m->predictions = 0;
+        m->latencyNs = m->maxLatencyNs = m->workNs = m->predictNs = 0;
+    }
+    clock.restart();
+}
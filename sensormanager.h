@@ -0,0 +1,116 @@
+#ifndef SENSORMANAGER_H
+#define SENSORMANAGER_H
+
+#include <QObject>
+#include <QThread>
+#include <QSemaphore>
+#include <QMutex>
+#include <QElapsedTimer>
+#include "activeacousticsensor.h"
+#include "classifier.h"
+#include "workerpool.h"
+
+// センサごとの処理統計
+struct SensorStats
+{
+    qint64 frames;          // 完成したフレーム数
+    double framesPerSecond; // startAll()からの平均
+    double meanLatencyUs;   // データ到着の検出 -> 特徴抽出(と識別)の完了 の平均 [us]
+    double maxLatencyUs;
+    double meanWorkUs;      // 1回の特徴抽出の処理時間の平均 [us]
+    qint64 predictions;
+    double meanPredictUs;   // 1回の識別の処理時間の平均 [us]
+    double lastLabel;       // 直近の識別結果(識別器がなければ-1)
+};
+
+class SensorManager;
+
+// データが届いたセンサの仕事をワーカープールに積むスレッド
+class SensorDispatcher : public QThread
+{
+    Q_OBJECT
+public:
+    SensorDispatcher(SensorManager *manager) : manager(manager) {}
+
+protected:
+    void run();
+
+private:
+    SensorManager *manager;
+};
+
+// 複数のActiveAcousticSensor(AIF版・シリアル版・ファイル再生版)をまとめて動かすマネージャ
+// 各センサの特徴抽出は、センサごとのスレッドではなくコア数分の固定スレッドのワーカープール(ワークスティーリング)で行う。
+// フレームが完成するとそのセンサに割り当てた識別器で識別し、センサごとの処理量と遅延を集計する
+// (シリアル版は自前で特徴ベクトルを作るので、senseDataChangedを受けてGUIスレッドで識別だけを行う)
+class SensorManager : public QObject
+{
+    Q_OBJECT
+    friend class SensorDispatcher;
+    friend class SensorWorkTask;
+public:
+    // threadsが0以下ならコア数
+    explicit SensorManager(int threads = 0, QObject *parent = 0);
+    ~SensorManager();
+
+    // sensorを管理下に置き、番号を返す(sensorの所有権はマネージャに移る)。停止中に呼ぶこと
+    // classifierはこのセンサのフレームの識別に使う(NULLなら識別しない。所有しない)
+    int addSensor(ActiveAcousticSensor *sensor, Classifier *classifier = NULL);
+    // 識別器を差し替える(識別器の学習し直しは、そのままでもモデルの差し替えが識別と重ならないように行われる)
+    void setClassifier(int id, Classifier *classifier);
+    int sensorCount() const { return sensors.size(); }
+    ActiveAcousticSensor *sensor(int id) const { return sensors[id]->sensor; }
+    SensorStats stats(int id) const;
+    void resetStats();
+    int threadCount() const { return pool.threadCount(); }
+
+public slots:
+    // 全センサを開始する。失敗したセンサがあればそのエラー、なければ"OK"を返す
+    QString startAll();
+    void stopAll();
+
+signals:
+    // センサidの識別結果(GUIスレッドへは最新の結果だけがまとめて届く)
+    void predicted(int id, double label);
+
+private slots:
+    void takePredictions();
+    void serialDataChanged(QVector<float> data);
+
+private:
+    struct ManagedSensor
+    {
+        ActiveAcousticSensor *sensor;
+        int work;                 // 仕事の数(startAll()時のworkCount())
+        QAtomicInt *busy;         // 仕事ごとにプールに積んでから終わるまで1
+        qint64 *queuedAt;         // 仕事ごとのデータ到着を検出した時刻 [ns]
+        // 識別(同じセンサの識別は同時に1つだけ)
+        QMutex classifyLock;
+        Classifier *classifier;
+        QVector<float> frame;
+        QVector<double> probability;
+        ClassifierWorkspace workspace;   // 識別器を複数のセンサで共有しても作業領域は共有しない
+        qint64 classifiedFrame;
+        // 統計
+        mutable QMutex statsLock;
+        qint64 frames, works, predictions;
+        qint64 latencyNs, maxLatencyNs, workNs, predictNs;
+        double lastLabel;
+        QAtomicInt predictionPending;
+    };
+
+    // ワーカースレッドから呼ばれる
+    void runWork(int id, int index);
+    void classify(ManagedSensor *m);
+    void dispatch();
+
+private:
+    QList<ManagedSensor *> sensors;
+    WorkerPool pool;
+    SensorDispatcher dispatcher;
+    QSemaphore wake;
+    QElapsedTimer clock;
+    QAtomicInt predictionsPending;
+};
+
+#endif // SENSORMANAGER_H
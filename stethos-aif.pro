@@ -8,14 +8,33 @@ INCLUDEPATH += /usr/local/opt/fftw/include /usr/local/opt/libsvm/include
 
 SOURCES += main.cpp\
         mainwindow.cpp \
+    classifier.cpp \
     svmclassifier.cpp \
+    linearclassifier.cpp \
+    framestore.cpp \
     activeacousticsensor.cpp \
+    dsp.cpp \
+    featurepipeline.cpp \
+    workerpool.cpp \
+    sensormanager.cpp \
+    latencyprobe.cpp \
+    alloccounter.cpp \
     trainlabel.cpp \
     plotter.cpp
 
 HEADERS  += mainwindow.h \
+    classifier.h \
     svmclassifier.h \
+    linearclassifier.h \
+    framestore.h \
     activeacousticsensor.h \
+    dsp.h \
+    featurepipeline.h \
+    workerpool.h \
+    sensormanager.h \
+    latencyprobe.h \
+    alloccounter.h \
+    ringbuffer.h \
     trainlabel.h \
     plotter.h
 
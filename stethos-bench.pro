@@ -0,0 +1,37 @@
+TEMPLATE = app
+TARGET = stethos-bench
+QT += core gui multimedia serialport
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG += c++11
+# operator new/mallocを数える版に置き換え、特徴抽出の定常状態でヒープ確保がないことを確かめる(alloccounter.h)
+DEFINES += STETHOS_COUNT_ALLOCATIONS
+
+LIBS += -L/usr/local/opt/fftw/lib -L/usr/local/opt/libsvm/lib -lfftw3f -lsvm
+INCLUDEPATH += /usr/local/opt/fftw/include /usr/local/opt/libsvm/include
+
+SOURCES += bench.cpp \
+    classifier.cpp \
+    svmclassifier.cpp \
+    linearclassifier.cpp \
+    framestore.cpp \
+    activeacousticsensor.cpp \
+    dsp.cpp \
+    featurepipeline.cpp \
+    workerpool.cpp \
+    sensormanager.cpp \
+    latencyprobe.cpp \
+    alloccounter.cpp
+
+HEADERS  += classifier.h \
+    svmclassifier.h \
+    linearclassifier.h \
+    framestore.h \
+    activeacousticsensor.h \
+    dsp.h \
+    featurepipeline.h \
+    workerpool.h \
+    sensormanager.h \
+    latencyprobe.h \
+    alloccounter.h \
+    ringbuffer.h
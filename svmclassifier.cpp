@@ -1,8 +1,130 @@
 #include "svmclassifier.h"
+#include "dsp.h"
+#include "workerpool.h"
+#include <QThreadStorage>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <string.h>
+#include <math.h>
+
+// 学習したモデルを覚えておく数(ラベルのデータを消して戻すなど、最近の学習データに戻ったときは学習し直さない)
+#define SVM_MODEL_CACHE_SIZE 4
+
+SVMModel::SVMModel()
+    : model(NULL)
+    , x_space(NULL)
+    , sv(NULL)
+    , kernelSV(NULL)
+    , kernelStride(0)
+    , kernelDimension(0)
+    , file(NULL)
+    , svRows(NULL)
+    , coefRows(NULL)
+{
+    prob.l = 0;
+    prob.x = NULL;
+    prob.y = NULL;
+}
+
+SVMModel::~SVMModel()
+{
+    if(file != NULL)
+    {
+        // ファイルをマップしたモデルは、構造体と行の配列だけを自前で確保している
+        delete [] svRows;
+        delete [] coefRows;
+        delete model;
+        file->close();
+        delete file;
+    }
+    else if(model != NULL)
+    {
+        svm_free_and_destroy_model(&model);
+    }
+    delete [] prob.x;
+    delete [] prob.y;
+    delete [] x_space;
+    qFreeAligned(kernelSV);
+}
+
+// libsvmのサポートベクタ(疎なsvm_node列)を、行ごとに並べた連続領域に書き写す
+void SVMModel::setDenseSV(int dimension)
+{
+    denseSV.fill(0, model->l * dimension);
+    for(int i = 0; i < model->l; i++)
+    {
+        for(const svm_node *p = model->SV[i]; p->index != -1; p++)
+        {
+            if(p->index >= 1 && p->index <= dimension) denseSV[i * dimension + p->index - 1] = p->value;
+        }
+    }
+    sv = denseSV.constData();
+    setKernel(dimension);
+}
+
+void SVMModel::compact(int dimension)
+{
+    if(model == NULL || file != NULL) return;
+    // 学習データの正規化済みの値はfloatで求めているので、svから戻しても同じ値になる
+    int l = model->l;
+    svm_node *rows = new svm_node[(quint64)(dimension + 1) * qMax(1, l)];
+    for(int i = 0; i < l; i++)
+    {
+        svm_node *row = rows + (quint64)(dimension + 1) * i;
+        const float *v = sv + (quint64)dimension * i;
+        for(int j = 0; j < dimension; j++)
+        {
+            row[j].index = j + 1;
+            row[j].value = v[j];
+        }
+        row[dimension].index = -1;
+        // SV(行の配列)はlibsvmが確保したものをそのまま使う(free_svが0なので行の中身はlibsvmが解放しない)
+        model->SV[i] = row;
+    }
+    delete [] prob.x;
+    delete [] prob.y;
+    delete [] x_space;
+    prob.l = 0;
+    prob.x = NULL;
+    prob.y = NULL;
+    x_space = rows;
+}
+
+// svを識別用の行列(kernelSV)に書き写す。行の先頭を揃えておけば、rbfKernel()が行ごとにアラインされた読み込みで済む
+void SVMModel::setKernel(int dimension)
+{
+    qFreeAligned(kernelSV);
+    kernelSV = NULL;
+    const svm_parameter &param = model->param;
+    if(param.kernel_type != RBF || (param.svm_type != C_SVC && param.svm_type != NU_SVC)) return;
+    if(model->l <= 0 || dimension <= 0 || model->nSV == NULL) return;
+
+    kernelDimension = dimension;
+    kernelStride = (dimension + 7) & ~7;
+    // AVX2のアラインされた読み込みに合わせて32バイト境界に置く
+    kernelSV = (float *)qMallocAligned(sizeof(float) * (quint64)kernelStride * model->l, 32);
+    Q_CHECK_PTR(kernelSV);
+    for(int i = 0; i < model->l; i++)
+    {
+        float *row = kernelSV + (quint64)kernelStride * i;
+        memcpy(row, sv + (quint64)dimension * i, sizeof(float) * dimension);
+        for(int j = dimension; j < kernelStride; j++) row[j] = 0;
+    }
+    svStart.resize(model->nr_class);
+    for(int i = 0, start = 0; i < model->nr_class; i++)
+    {
+        svStart[i] = start;
+        start += model->nSV[i];
+    }
+}
 
 SVMClassifier::SVMClassifier(QObject *parent) :
-    QObject(parent)
-  , model(NULL)
+    Classifier(parent)
+  , autoTuneEnabled(false)
+  , tuneFolds(5)
+  , tuneTarget(1.0)
 {
     param.svm_type = C_SVC;
     param.kernel_type = RBF;
@@ -21,130 +143,318 @@ SVMClassifier::SVMClassifier(QObject *parent) :
     param.weight = NULL;
 }
 
-//void SVMClassifier::loadProblems()
-//{
-//    QString loadfile = QFileDialog::getOpenFileName();
-//    if(loadfile.isEmpty()) return;
-//    QFile f(loadfile);
-//    f.open(QIODevice::ReadOnly);
-
-//    QMap<int, QList<QVector<float> > > _problems;
-
-//    QTextStream t(&f);
-//    while(!t.atEnd())
-//    {
-//        QString line = t.readLine();
-//        QStringList ll = line.split(" ");
-//        int y = ll.takeFirst().toInt();
-//        QVector<float> x;
-//        foreach(QString s, ll)
-//        {
-//            x.append(s.split(":").last().toFloat());
-//        }
-//        _problems[y].append(x);
-//    }
-//    train(_problems);
-//}
-
-//void SVMClassifier::writeProblems()
-//{
-//    QString savefile = QFileDialog::getSaveFileName();
-//    if(savefile.isEmpty()) return;
-//    QFile out(savefile);
-//    out.open(QFile::WriteOnly | QFile::Text);
-//    QTextStream stm(&out);
-
-//    foreach(int label, problems.keys())
-//    {
-//        foreach(QVector<float> vector, problems[label])
-//        {
-//            stm << label;
-//            for(int j = 0; j < vector.count(); j++)
-//            {
-//                stm << " " << j+1 << ":" << vector[j];
-//            }
-//            stm << endl;
-//        }
-//    }
-//    out.close();
-//}
-
-float SVMClassifier::scaling(float value, QPointF maxmin)
-{
-    float ret;
-    if(value == maxmin.y())
-        ret = -1;
-    else if(value == maxmin.x())
-        ret = 1;
-    else
-        ret = -1 + 2 * (value-maxmin.y()) / (maxmin.x()-maxmin.y());
-    return ret;
+SVMClassifier::~SVMClassifier()
+{
+    waitForTraining();
+}
+
+// 次元ごとの[最小値, 最大値]を[-1, 1]に写す1次変換の係数を求める
+// 学習データで最小値と最大値が等しい次元は、以前のscaling()と同じく最小値を-1とし、常に-1になるようにする
+void SVMClassifier::setScale(SVMModel *m, QVector<QPointF> maxmin)
+{
+    m->scale = maxmin;
+    m->scaleA.resize(maxmin.size());
+    m->scaleB.resize(maxmin.size());
+    for(int i = 0; i < maxmin.size(); i++)
+    {
+        double max = maxmin[i].x(), min = maxmin[i].y();
+        double a = max > min ? 2 / (max - min) : 0;
+        m->scaleA[i] = a;
+        m->scaleB[i] = -1 - a * min;
+    }
+}
+
+QSharedPointer<const SVMModel> SVMClassifier::model() const
+{
+    QMutexLocker locker(&modelLock);
+    return current;
+}
+
+int SVMClassifier::labelCount() const
+{
+    QSharedPointer<const SVMModel> m = model();
+    return m ? svm_get_nr_class(m->model) : 0;
 }
 
-svm_model *SVMClassifier::buildModel(QList<QPair<double, QVector<float> > > _problems, QVector<QPointF> scale)
+int SVMClassifier::dimension() const
 {
-    if(_problems.isEmpty()) return NULL;
+    QSharedPointer<const SVMModel> m = model();
+    return m ? m->scaleA.size() : 0;
+}
 
-    int dimension = scale.size();
-    svm_problem prob;
-    prob.l = _problems.count();
+QByteArray SVMClassifier::fingerprint(const ProblemView &problems, const svm_parameter &param,
+                                      bool tune, int folds, double targetAccuracy)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    // cache_sizeは学習の速さにしか関わらないので含めない
+    qint32 ints[] = {param.svm_type, param.kernel_type, param.degree, param.shrinking, param.probability, param.nr_weight,
+                     problems.dimension, problems.x.size()};
+    double doubles[] = {param.gamma, param.coef0, param.C, param.nu, param.p, param.eps};
+    hash.addData((const char *)ints, sizeof(ints));
+    hash.addData((const char *)doubles, sizeof(doubles));
+    // 自動調整ではCとgammaは学習データから決まる(調整に失敗したときだけparamの値を使う)ので、調整の設定も区別する
+    qint32 tuneInts[] = {tune ? 1 : 0, tune ? folds : 0};
+    double tuneTarget = tune ? targetAccuracy : 0;
+    hash.addData((const char *)tuneInts, sizeof(tuneInts));
+    hash.addData((const char *)&tuneTarget, sizeof(tuneTarget));
+    for(int i = 0; i < param.nr_weight; i++)
+    {
+        hash.addData((const char *)&param.weight_label[i], sizeof(int));
+        hash.addData((const char *)&param.weight[i], sizeof(double));
+    }
+    hash.addData((const char *)problems.y.constData(), sizeof(double) * problems.y.size());
+    for(int i = 0; i < problems.x.size(); i++)
+    {
+        hash.addData((const char *)problems.x[i], sizeof(float) * problems.dimension);
+    }
+    return hash.result();
+}
+
+SVMModel *SVMClassifier::makeProblem(const ProblemView &problems)
+{
+    if(problems.x.isEmpty() || problems.dimension <= 0) return NULL;
+
+    SVMModel *m = new SVMModel;
+    setScale(m, calcScale(problems));
+
+    // 識別時と同じ係数で正規化する(学習データは参照先から直接svm_nodeに書き込む)
+    int dimension = m->scale.size();
+    svm_problem &prob = m->prob;
+    prob.l = problems.x.size();
     prob.x = new svm_node *[prob.l];
     prob.y = new double[prob.l];
-    svm_node *x_space = new svm_node[(dimension+1) * prob.l];
+    m->x_space = new svm_node[(dimension+1) * prob.l];
+    svm_node *x_space = m->x_space;
 
-    for(int i = 0; i < _problems.size(); i++)
+    for(int i = 0; i < prob.l; i++)
     {
+        const float *x = problems.x[i];
         for(int j = 0; j < dimension; j++)
         {
             x_space[(dimension+1) * i + j].index = j+1;
-            x_space[(dimension+1) * i + j].value = scaling(_problems[i].second[j], scale[j]);
+            x_space[(dimension+1) * i + j].value = m->scaleA[j] * x[j] + m->scaleB[j];
         }
         x_space[(dimension+1) * i + dimension].index = -1;
         prob.x[i] = &x_space[(dimension+1) * i];
-        prob.y[i] = _problems[i].first;
+        prob.y[i] = problems.y[i];
+    }
+    return m;
+}
+
+SVMModel *SVMClassifier::buildModel(const ProblemView &problems, svm_parameter param)
+{
+    SVMModel *m = makeProblem(problems);
+    if(m == NULL) return NULL;
+    m->model = svm_train(&m->prob, &param);
+    if(m->model == NULL)
+    {
+        delete m;
+        return NULL;
     }
+    m->setDenseSV(problems.dimension);
+    m->compact(problems.dimension);
+    return m;
+}
 
-    return svm_train(&prob, &param);
+// libsvmのsigmoid_predict()と同じ(2クラスの決定値を、Plattの方法で確率にする)
+static double sigmoidPredict(double decision, double A, double B)
+{
+    double fApB = decision * A + B;
+    if(fApB >= 0)
+        return exp(-fApB) / (1.0 + exp(-fApB));
+    else
+        return 1.0 / (1 + exp(fApB));
 }
 
-double SVMClassifier::predict(QVector<float> data, double *probability)
+// libsvmのmulticlass_probability()と同じ(Wu, Lin, Wengの方法で、ペアごとの確率r(k×k)からクラスごとの確率pを求める)
+// workはk×k+k点。libsvmと同じ順に計算し、同じ反復回数で止める
+static void multiclassProbability(int k, const double *r, double *p, double *work)
 {
-    if(!model) return -1;
+    int maxIter = qMax(100, k);
+    double *Q = work, *Qp = work + k * k;
+    double eps = 0.005 / k;
 
-    int dimension = data.size();
-    svm_node *svm_x = new svm_node[dimension+1];
-    for(int i = 0; i < dimension; i++)
+    for(int t = 0; t < k; t++)
+    {
+        p[t] = 1.0 / k;
+        Q[t * k + t] = 0;
+        for(int j = 0; j < t; j++)
+        {
+            Q[t * k + t] += r[j * k + t] * r[j * k + t];
+            Q[t * k + j] = Q[j * k + t];
+        }
+        for(int j = t + 1; j < k; j++)
+        {
+            Q[t * k + t] += r[j * k + t] * r[j * k + t];
+            Q[t * k + j] = -r[j * k + t] * r[t * k + j];
+        }
+    }
+    for(int iter = 0; iter < maxIter; iter++)
+    {
+        // 停止条件は大域最適の条件を使う
+        double pQp = 0;
+        for(int t = 0; t < k; t++)
+        {
+            Qp[t] = 0;
+            for(int j = 0; j < k; j++) Qp[t] += Q[t * k + j] * p[j];
+            pQp += p[t] * Qp[t];
+        }
+        double maxError = 0;
+        for(int t = 0; t < k; t++)
+        {
+            double error = fabs(Qp[t] - pQp);
+            if(error > maxError) maxError = error;
+        }
+        if(maxError < eps) break;
+
+        for(int t = 0; t < k; t++)
+        {
+            double diff = (-Qp[t] + pQp) / Q[t * k + t];
+            p[t] += diff;
+            pQp = (pQp + diff * (diff * Q[t * k + t] + 2 * Qp[t])) / (1 + diff) / (1 + diff);
+            for(int j = 0; j < k; j++)
+            {
+                Qp[j] = (Qp[j] + diff * Q[t * k + j]) / (1 + diff);
+                p[j] /= (1 + diff);
+            }
+        }
+    }
+}
+
+// 正規化済みのxを、SVMModel::kernelSVで識別する(svm_predict()・svm_predict_probability()と同じ結果を返す)
+// カーネル値はサポートベクタごとに1回だけ求め、それを全てのクラス対の決定値で使い回す
+// (libsvmも1回ずつ求めるが、svm_nodeの列を1点ずつ辿る倍精度の計算になる)
+static double predictKernel(const SVMModel &m, const float *x, double *probability, ClassifierWorkspace &workspace)
+{
+    const svm_model *sm = m.model;
+    int k = sm->nr_class, l = sm->l;
+    int pairs = k * (k - 1) / 2;
+    if(workspace.kernel.size() < l) workspace.kernel.resize(l);
+    if(workspace.decision.size() < pairs) workspace.decision.resize(pairs);
+    if(workspace.coupling.size() < 2 * k * k + k) workspace.coupling.resize(2 * k * k + k);
+    float *kv = workspace.kernel.data();
+    double *decision = workspace.decision.data();
+
+    rbfKernel(m.kernelSV, l, m.kernelDimension, m.kernelStride, x, (float)sm->param.gamma, kv);
+
+    // クラス対(i, j)の決定値。係数の並びはlibsvmのsvm_predict_values()と同じ
+    for(int i = 0, p = 0; i < k; i++)
+    {
+        for(int j = i + 1; j < k; j++, p++)
+        {
+            int si = m.svStart[i], sj = m.svStart[j];
+            const double *coef1 = sm->sv_coef[j - 1];
+            const double *coef2 = sm->sv_coef[i];
+            double sum = 0;
+            for(int t = 0; t < sm->nSV[i]; t++) sum += coef1[si + t] * kv[si + t];
+            for(int t = 0; t < sm->nSV[j]; t++) sum += coef2[sj + t] * kv[sj + t];
+            decision[p] = sum - sm->rho[p];
+        }
+    }
+
+    double *work = workspace.coupling.data();
+    if(probability != NULL && sm->probA != NULL && sm->probB != NULL)
+    {
+        // svm_predict_probability()と同じく、確率が最大のクラスを選ぶ
+        const double minProb = 1e-7;
+        double *r = work;
+        for(int i = 0, p = 0; i < k; i++)
+        {
+            for(int j = i + 1; j < k; j++, p++)
+            {
+                double v = qMin(qMax(sigmoidPredict(decision[p], sm->probA[p], sm->probB[p]), minProb), 1 - minProb);
+                r[i * k + j] = v;
+                r[j * k + i] = 1 - v;
+            }
+        }
+        if(k == 2)
+        {
+            probability[0] = r[1];
+            probability[1] = r[k];
+        }
+        else
+        {
+            multiclassProbability(k, r, probability, work + k * k);
+        }
+        int best = 0;
+        for(int i = 1; i < k; i++)
+        {
+            if(probability[i] > probability[best]) best = i;
+        }
+        return sm->label[best];
+    }
+
+    // 投票(svm_predict()と同じく、同数なら先のクラス)
+    double *vote = work;
+    for(int i = 0; i < k; i++) vote[i] = 0;
+    for(int i = 0, p = 0; i < k; i++)
+    {
+        for(int j = i + 1; j < k; j++, p++)
+        {
+            if(decision[p] > 0) vote[i]++;
+            else vote[j]++;
+        }
+    }
+    int best = 0;
+    for(int i = 1; i < k; i++)
     {
-        svm_x[i].index = i+1;
-        svm_x[i].value = scaling(data[i], scale[i]);
+        if(vote[i] > vote[best]) best = i;
     }
-    svm_x[dimension].index = -1;
+    return sm->label[best];
+}
 
+double SVMClassifier::predict(const float *data, int size, double *probability, ClassifierWorkspace &workspace) const
+{
+    // 差し替えと重なっても、このフレームは取り出した時点のモデルで最後まで識別する
+    QSharedPointer<const SVMModel> m = model();
+    if(!m) return -1;
+
+    // 学習時の次元を超える分は使わない(足りない次元はlibsvmでは0として扱われる)
+    int n = qMin(size, m->scaleA.size());
+    if(workspace.nodes.size() != n + 1)
+    {
+        workspace.scaled.resize(n);
+        workspace.nodes.resize(n + 1);
+        for(int i = 0; i < n; i++) workspace.nodes[i].index = i+1;
+        workspace.nodes[n].index = -1;
+    }
+
+    // 正規化はSIMDでまとめて行い、svm_node(倍精度)へは書き写すだけにする
+    float *scaled = workspace.scaled.data();
+    svm_node *x = workspace.nodes.data();
+    affine(data, m->scaleA.constData(), m->scaleB.constData(), scaled, n);
+    // 全次元がそろっていれば、libsvmを通さずにSIMDのカーネルで識別する
+    if(m->kernelSV != NULL && n == m->kernelDimension)
+    {
+        return predictKernel(*m, scaled, probability, workspace);
+    }
+    for(int i = 0; i < n; i++)
+    {
+        x[i].value = scaled[i];
+    }
 
-    double res;
     if(probability != NULL)
-        res = svm_predict_probability(model, svm_x, probability);
+        return svm_predict_probability(m->model, x, probability);
     else
-        res = svm_predict(model, svm_x);
-
-    delete [] svm_x;
-    return res;
+        return svm_predict(m->model, x);
 }
 
-QVector<QPointF> SVMClassifier::calcScale(QList<QPair<double, QVector<float> > > _problems)
+
+QVector<QPointF> SVMClassifier::calcScale(const ProblemView &problems)
 {
     QVector<QPointF> scale;
-    scale.resize(_problems.first().second.size());
+    scale.resize(problems.dimension);
     for(int i = 0; i < scale.size(); i++)
     {
         scale[i].setX(-100);
         scale[i].setY(100);
     }
-    for(int i = 0 ; i < _problems.size(); i++)
+    for(int i = 0 ; i < problems.x.size(); i++)
     {
+        const float *x = problems.x[i];
         for(int j = 0; j < scale.size(); j++)
         {
-            float v = _problems[i].second[j];
+            float v = x[j];
             if(scale[j].x() < v) scale[j].setX(v);
             if(scale[j].y() > v) scale[j].setY(v);
         }
@@ -156,10 +466,755 @@ QVector<QPointF> SVMClassifier::calcScale(QList<QPair<double, QVector<float> > >
 
 void SVMClassifier::train(QList<QPair<double, QVector<float> > > _problems)
 {
-    if(_problems.isEmpty()) return;
-    if(model != NULL) svm_free_model_content(model);
-    problems = _problems;
-    scale = calcScale(problems);
-    model = buildModel(problems, scale);
+    train(makeView(_problems));
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// 学習
+
+// libsvmは2クラス問題を1つ解くたびに"optimization finished"を出力するので、それを数えて進捗とする
+// 出力先の関数は全体で1つなので、出力したスレッドで実行中の学習に振り分ける
+struct SVMTrainProgress
+{
+    SVMTrainProgress() : classifier(NULL), generation(-1), expected(1), solved(0), reported(-1) {}
+    void start(const SVMClassifier *classifier, int generation, const ProblemView &problems, const svm_parameter &param);
+    void solvedOne();
+
+    const SVMClassifier *classifier;  // このスレッドで学習中の識別器(なければNULL)
+    int generation;
+    int expected, solved, reported;
+};
+static QThreadStorage<SVMTrainProgress> trainProgress;
+
+static void printTrainProgress(const char *s)
+{
+    if(!trainProgress.hasLocalData()) return;
+    SVMTrainProgress &progress = trainProgress.localData();
+    if(progress.classifier != NULL && strncmp(s, "optimization finished", 21) == 0) progress.solvedOne();
 }
 
+// 最近と同じ学習データなら、学習し直さずにそのモデルを使う
+bool SVMClassifier::build(const ProblemView &problems, int g)
+{
+    // パラメータは学習中に変えないこと(setParam()・setAutoTune())
+    svm_parameter p = param;
+    QByteArray key = fingerprint(problems, p, autoTuneEnabled, tuneFolds, tuneTarget);
+    QSharedPointer<const SVMModel> m = cachedModel(key);
+    if(!m && autoTuneEnabled)
+    {
+        // 自動調整(格子点は専用のプールで並列に調べ、バックグラウンドの学習では1点ごとにtuningPointで通知する)
+        SVMGridPoint best;
+        gridSearch(problems, p, tuneFolds, tuneTarget, g, &best);
+        if(best.accuracy >= 0)
+        {
+            p.C = best.C;
+            p.gamma = best.gamma;
+        }
+    }
+    if(!m && !cancelled(g))
+    {
+        SVMTrainProgress &counter = trainProgress.localData();
+        counter.start(this, g, problems, p);
+        svm_set_print_string_function(printTrainProgress);
+        SVMModel *built = buildModel(problems, p);
+        counter.classifier = NULL;
+        if(built != NULL)
+        {
+            built->fingerprint = key;
+            m = QSharedPointer<const SVMModel>(built);
+        }
+    }
+    return m && publish(m, g);
+}
+
+void SVMTrainProgress::start(const SVMClassifier *_classifier, int _generation, const ProblemView &problems, const svm_parameter &param)
+{
+    // クラスごとの2クラス問題の数(1対1)。確率を求める場合は、それぞれについて5分割の交差検定でも解く
+    QList<double> labels;
+    for(int i = 0; i < problems.y.size(); i++)
+    {
+        if(!labels.contains(problems.y[i])) labels.append(problems.y[i]);
+    }
+    int k = labels.size();
+    classifier = _classifier;
+    generation = _generation;
+    expected = qMax(1, k * (k - 1) / 2 * (param.probability ? 6 : 1));
+    solved = 0;
+    reported = -1;
+}
+
+void SVMTrainProgress::solvedOne()
+{
+    solved++;
+    int percent = qMin(99, solved * 100 / expected);
+    if(percent == reported) return;
+    reported = percent;
+    classifier->progress(generation, percent);
+}
+
+void SVMClassifier::trainAsync(QList<QPair<double, QVector<float> > > _problems)
+{
+    startTraining(makeView(_problems), _problems);
+}
+
+bool SVMClassifier::publish(QSharedPointer<const SVMModel> m, int g)
+{
+    // 取り消しの判定と差し替えを同じロックの中で行う
+    QMutexLocker locker(&modelLock);
+    // 取り消された学習の結果も、その学習データに戻ったときのために覚えておく
+    remember(m);
+    if(!mayPublish(g)) return false;
+    current = m;
+    return true;
+}
+
+void SVMClassifier::remember(QSharedPointer<const SVMModel> m)
+{
+    cache.removeOne(m);
+    cache.prepend(m);
+    while(cache.size() > SVM_MODEL_CACHE_SIZE) cache.removeLast();
+}
+
+QSharedPointer<const SVMModel> SVMClassifier::cachedModel(const QByteArray &key)
+{
+    QMutexLocker locker(&modelLock);
+    for(int i = 0; i < cache.size(); i++)
+    {
+        if(cache[i]->fingerprint != key) continue;
+        cache.move(i, 0);
+        return cache.first();
+    }
+    return QSharedPointer<const SVMModel>();
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// パラメータの自動調整
+//
+// libsvmのgrid.pyと同じく、log2(C)を-5〜15、log2(gamma)を-15〜3の範囲で2刻みに調べ(粗い格子)、
+// 最良点の周り±1を0.5刻みで調べ直す(細かい格子)。各点はk分割交差検定の正解率で評価する
+// 点ごとの交差検定は互いに独立なので、1点を1タスクとしてスレッドプールで並列に実行する
+
+#define GRID_LOG2C_MIN -5
+#define GRID_LOG2C_MAX 15
+#define GRID_LOG2G_MIN -15
+#define GRID_LOG2G_MAX 3
+#define GRID_COARSE_STEP 2
+#define GRID_FINE_STEP 0.5
+
+// 1回のグリッドサーチで格子点のタスクが共有するもの
+struct SVMGridSearch
+{
+    const svm_problem *prob;  // 正規化済みの学習データ(各タスクは読むだけ)
+    svm_parameter param;
+    int folds;
+    double targetAccuracy;
+    SVMClassifier *classifier;
+    int generation;           // 0以上なら、この学習が取り消されたら打ち切り、調べた点を通知する
+    QAtomicInt stop;          // 目標の正解率に達したか取り消された
+};
+
+class SVMGridTask : public QRunnable
+{
+public:
+    SVMGridTask(SVMGridSearch *search, SVMGridPoint *point) : search(search), point(point) {}
+
+    void run()
+    {
+        if(search->stop.load()) return;
+        if(search->classifier->cancelled(search->generation))
+        {
+            search->stop.store(1);
+            return;
+        }
+
+        svm_parameter param = search->param;
+        param.C = point->C;
+        param.gamma = point->gamma;
+        const svm_problem *prob = search->prob;
+        QVector<double> target(prob->l);
+        QElapsedTimer t;
+        t.start();
+        svm_cross_validation(prob, &param, search->folds, target.data());
+        int correct = 0;
+        for(int i = 0; i < prob->l; i++)
+        {
+            if(target[i] == prob->y[i]) correct++;
+        }
+        point->msec = t.elapsed();
+        point->accuracy = correct / (double)prob->l;
+
+        // これ以上の点はないので、残りの点は調べない
+        if(point->accuracy >= search->targetAccuracy) search->stop.store(1);
+        if(search->generation >= 0)
+        {
+            QMetaObject::invokeMethod(search->classifier, "reportTuningPoint", Qt::QueuedConnection, Q_ARG(int, search->generation),
+                                      Q_ARG(double, point->C), Q_ARG(double, point->gamma), Q_ARG(double, point->accuracy), Q_ARG(int, (int)point->msec));
+        }
+    }
+
+private:
+    SVMGridSearch *search;
+    SVMGridPoint *point;
+};
+
+// 正解率が高い点、同じならCが小さい(なめらかな境界の)点
+static bool betterPoint(const SVMGridPoint &a, const SVMGridPoint &b)
+{
+    if(a.accuracy != b.accuracy) return a.accuracy > b.accuracy;
+    if(a.C != b.C) return a.C < b.C;
+    return a.gamma < b.gamma;
+}
+
+QList<SVMGridPoint> SVMClassifier::gridSearch(const ProblemView &problems, svm_parameter param, int folds, double targetAccuracy, int generation, SVMGridPoint *best)
+{
+    QList<SVMGridPoint> results;
+    SVMModel *data = makeProblem(problems);
+    if(data == NULL) return results;
+
+    SVMGridSearch search;
+    search.prob = &data->prob;
+    search.param = param;
+    // 交差検定では正解率しか見ないので、確率の推定(内部でさらに交差検定する)は行わない
+    search.param.probability = 0;
+    search.folds = qBound(2, folds, data->prob.l);
+    search.targetAccuracy = targetAccuracy;
+    search.classifier = this;
+    search.generation = generation;
+    search.stop.store(0);
+
+    // 作業スレッド(共有プールの学習タスク)からも待てるように、専用のプールで実行する
+    WorkerPool pool;
+    QVector<SVMGridPoint> coarse;
+    for(int c = GRID_LOG2C_MIN; c <= GRID_LOG2C_MAX; c += GRID_COARSE_STEP)
+    {
+        for(int g = GRID_LOG2G_MIN; g <= GRID_LOG2G_MAX; g += GRID_COARSE_STEP)
+        {
+            SVMGridPoint p;
+            p.C = pow(2.0, c);
+            p.gamma = pow(2.0, g);
+            coarse.append(p);
+        }
+    }
+    for(int i = 0; i < coarse.size(); i++) pool.submit(new SVMGridTask(&search, &coarse[i]));
+    pool.waitForDone();
+
+    SVMGridPoint top;
+    for(int i = 0; i < coarse.size(); i++)
+    {
+        if(coarse[i].accuracy < 0) continue;
+        results.append(coarse[i]);
+        if(top.accuracy < 0 || betterPoint(coarse[i], top)) top = coarse[i];
+    }
+
+    // 粗い格子の最良点の周りを調べ直す(目標に達していれば調べない)
+    if(top.accuracy >= 0 && !search.stop.load())
+    {
+        QVector<SVMGridPoint> fine;
+        double c0 = log2(top.C), g0 = log2(top.gamma);
+        for(double dc = -1; dc <= 1; dc += GRID_FINE_STEP)
+        {
+            for(double dg = -1; dg <= 1; dg += GRID_FINE_STEP)
+            {
+                if(dc == 0 && dg == 0) continue;
+                SVMGridPoint p;
+                p.C = pow(2.0, c0 + dc);
+                p.gamma = pow(2.0, g0 + dg);
+                fine.append(p);
+            }
+        }
+        for(int i = 0; i < fine.size(); i++) pool.submit(new SVMGridTask(&search, &fine[i]));
+        pool.waitForDone();
+        for(int i = 0; i < fine.size(); i++)
+        {
+            if(fine[i].accuracy < 0) continue;
+            results.append(fine[i]);
+            if(betterPoint(fine[i], top)) top = fine[i];
+        }
+    }
+
+    delete data;
+    if(best != NULL) *best = top;
+    return results;
+}
+
+QList<SVMGridPoint> SVMClassifier::tune(const ProblemView &problems)
+{
+    SVMGridPoint best;
+    QList<SVMGridPoint> results = gridSearch(problems, param, tuneFolds, tuneTarget, -1, &best);
+    if(best.accuracy >= 0)
+    {
+        param.C = best.C;
+        param.gamma = best.gamma;
+    }
+    return results;
+}
+
+void SVMClassifier::setAutoTune(bool on, int folds, double targetAccuracy)
+{
+    autoTuneEnabled = on;
+    tuneFolds = folds;
+    tuneTarget = targetAccuracy;
+}
+
+void SVMClassifier::reportTuningPoint(int g, double C, double gamma, double accuracy, int msec)
+{
+    if(!cancelled(g)) emit tuningPoint(C, gamma, accuracy * 100, msec);
+}
+
+/*====================================================================================================================================================================================================================================================================================*/
+// モデルの保存と読み込み
+//
+// バイナリ形式(バージョン1)。値は書いたマシンのバイト順のままで、各区画は8バイト境界に置く(マップした領域をそのまま指せるように)
+//   ヘッダ   SVMFileHeader
+//   label    int32[nr_class]                      libsvmのラベル番号
+//   nSV      int32[nr_class]                      クラスごとのサポートベクタ数
+//   rho      double[nr_class*(nr_class-1)/2]
+//   probA    double[同上]                         (SVM_FILE_PROBABILITYのときのみ。なければ長さ0)
+//   probB    double[同上]                         (同上)
+//   sv_coef  double[(nr_class-1) × l]             行ごと
+//   sv       float[l × dimension]                 正規化済みのサポートベクタ、行ごと
+//   scale    float[dimension] × 4                 a, b(正規化の係数), 最大値, 最小値
+//   names    UTF-8のラベル名をラベル番号順に'\0'で終端して並べたもの
+
+#define SVM_FILE_MAGIC "STSV"
+#define SVM_FILE_VERSION 1
+#define SVM_FILE_BYTE_ORDER 0x01020304
+#define SVM_FILE_PROBABILITY 0x1
+// 読み込むモデルの上限(壊れたファイルや細工されたヘッダで、区画の大きさの計算があふれないように先に制限する)
+#define SVM_FILE_MAX_CLASS 4096
+#define SVM_FILE_MAX_SV (1 << 24)
+#define SVM_FILE_MAX_DIMENSION (1 << 20)
+
+enum SVMFileSection {
+    SECTION_LABEL,
+    SECTION_NSV,
+    SECTION_RHO,
+    SECTION_PROBA,
+    SECTION_PROBB,
+    SECTION_COEF,
+    SECTION_SV,
+    SECTION_SCALE,
+    SECTION_NAMES,
+    SECTION_COUNT
+};
+
+struct SVMFileHeader
+{
+    char magic[4];
+    quint32 version;
+    quint32 byteOrder;      // 読み込むマシンとバイト順が違えば読まない
+    qint32 svmType, kernelType, degree;
+    double gamma, coef0;
+    qint32 nrClass, l, dimension, flags;
+    qint32 nameCount, reserved;
+    quint64 offset[SECTION_COUNT]; // 各区画の先頭(ファイル先頭からのバイト数)
+    quint64 size[SECTION_COUNT];   // 各区画のバイト数
+    quint64 fileSize;
+};
+
+static quint64 align8(quint64 n)
+{
+    return (n + 7) & ~(quint64)7;
+}
+
+// 区画ごとのバイト数(namesを除く)。読み込み時はヘッダの値をこれと照合する
+// 全て64bitで計算する(kは1以上、各値はSVM_FILE_MAX_*以下であること)
+static void sectionSizes(quint64 k, quint64 l, quint64 dimension, bool probability, quint64 *size)
+{
+    quint64 pairs = k * (k - 1) / 2;
+    size[SECTION_LABEL] = sizeof(qint32) * k;
+    size[SECTION_NSV] = sizeof(qint32) * k;
+    size[SECTION_RHO] = sizeof(double) * pairs;
+    size[SECTION_PROBA] = probability ? sizeof(double) * pairs : 0;
+    size[SECTION_PROBB] = probability ? sizeof(double) * pairs : 0;
+    size[SECTION_COEF] = sizeof(double) * (k - 1) * l;
+    size[SECTION_SV] = sizeof(float) * l * dimension;
+    size[SECTION_SCALE] = sizeof(float) * dimension * 4;
+}
+
+bool SVMClassifier::save(const QString &path, const QStringList &labelNames) const
+{
+    QSharedPointer<const SVMModel> m = model();
+    if(!m) return false;
+    const svm_model *sm = m->model;
+    int k = sm->nr_class, l = sm->l, dimension = m->scaleA.size();
+    bool probability = sm->probA != NULL && sm->probB != NULL;
+
+    QByteArray names;
+    foreach(QString name, labelNames)
+    {
+        names += name.toUtf8();
+        names += '\0';
+    }
+
+    SVMFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SVM_FILE_MAGIC, 4);
+    h.version = SVM_FILE_VERSION;
+    h.byteOrder = SVM_FILE_BYTE_ORDER;
+    h.svmType = sm->param.svm_type;
+    h.kernelType = sm->param.kernel_type;
+    h.degree = sm->param.degree;
+    h.gamma = sm->param.gamma;
+    h.coef0 = sm->param.coef0;
+    h.nrClass = k;
+    h.l = l;
+    h.dimension = dimension;
+    h.flags = probability ? SVM_FILE_PROBABILITY : 0;
+    h.nameCount = labelNames.size();
+    sectionSizes(k, l, dimension, probability, h.size);
+    h.size[SECTION_NAMES] = names.size();
+    quint64 pos = align8(sizeof(h));
+    for(int i = 0; i < SECTION_COUNT; i++)
+    {
+        h.offset[i] = pos;
+        pos = align8(pos + h.size[i]);
+    }
+    h.fileSize = pos;
+
+    // ファイル全体をメモリ上で組み立ててから一度に書く
+    QByteArray buf(h.fileSize, '\0');
+    char *p = buf.data();
+    memcpy(p, &h, sizeof(h));
+    for(int i = 0; i < k; i++)
+    {
+        qint32 label = sm->label[i], nSV = sm->nSV[i];
+        memcpy(p + h.offset[SECTION_LABEL] + sizeof(qint32) * i, &label, sizeof(qint32));
+        memcpy(p + h.offset[SECTION_NSV] + sizeof(qint32) * i, &nSV, sizeof(qint32));
+    }
+    memcpy(p + h.offset[SECTION_RHO], sm->rho, h.size[SECTION_RHO]);
+    if(probability)
+    {
+        memcpy(p + h.offset[SECTION_PROBA], sm->probA, h.size[SECTION_PROBA]);
+        memcpy(p + h.offset[SECTION_PROBB], sm->probB, h.size[SECTION_PROBB]);
+    }
+    for(int j = 0; j < k - 1; j++)
+    {
+        memcpy(p + h.offset[SECTION_COEF] + sizeof(double) * l * j, sm->sv_coef[j], sizeof(double) * l);
+    }
+    memcpy(p + h.offset[SECTION_SV], m->sv, h.size[SECTION_SV]);
+    float *scale = (float *)(p + h.offset[SECTION_SCALE]);
+    for(int i = 0; i < dimension; i++)
+    {
+        scale[i] = m->scaleA[i];
+        scale[dimension + i] = m->scaleB[i];
+        scale[dimension * 2 + i] = m->scale[i].x();
+        scale[dimension * 3 + i] = m->scale[i].y();
+    }
+    memcpy(p + h.offset[SECTION_NAMES], names.constData(), names.size());
+
+    // 書き終えてから置き換えるので、途中で止まっても前のファイルが残る
+    QSaveFile f(path);
+    if(!f.open(QIODevice::WriteOnly)) return false;
+    if(f.write(buf) != buf.size()) return false;
+    return f.commit();
+}
+
+bool SVMClassifier::load(const QString &path, QStringList *labelNames)
+{
+    QFile *file = new QFile(path);
+    const uchar *map = NULL;
+    if(file->open(QIODevice::ReadOnly) && file->size() >= (qint64)sizeof(SVMFileHeader))
+        map = file->map(0, file->size());
+    if(map == NULL)
+    {
+        delete file;
+        return false;
+    }
+
+    // ヘッダと区画の範囲を検査する
+    // 種類(保存できるのは分類のみ、PRECOMPUTEDはサポートベクタの値を添字に使うので読まない)と大きさは、区画の大きさを計算する前に制限する
+    const SVMFileHeader *h = (const SVMFileHeader *)map;
+    bool ok = memcmp(h->magic, SVM_FILE_MAGIC, 4) == 0
+            && h->version == SVM_FILE_VERSION
+            && h->byteOrder == SVM_FILE_BYTE_ORDER
+            && h->fileSize == (quint64)file->size()
+            && (h->svmType == C_SVC || h->svmType == NU_SVC)
+            && (h->kernelType == LINEAR || h->kernelType == POLY || h->kernelType == RBF || h->kernelType == SIGMOID)
+            && h->nrClass >= 1 && h->nrClass <= SVM_FILE_MAX_CLASS
+            && h->l >= 0 && h->l <= SVM_FILE_MAX_SV
+            && h->dimension >= 0 && h->dimension <= SVM_FILE_MAX_DIMENSION
+            && h->nameCount >= 0;
+    if(ok)
+    {
+        quint64 size[SECTION_COUNT];
+        sectionSizes(h->nrClass, h->l, h->dimension, h->flags & SVM_FILE_PROBABILITY, size);
+        size[SECTION_NAMES] = h->size[SECTION_NAMES];
+        for(int i = 0; i < SECTION_COUNT; i++)
+        {
+            // offset + sizeはあふれうるので、引き算で比べる
+            ok = ok && h->size[i] == size[i] && h->offset[i] % 8 == 0
+                    && h->offset[i] >= sizeof(SVMFileHeader) && h->offset[i] <= h->fileSize
+                    && size[i] <= h->fileSize - h->offset[i];
+        }
+    }
+    if(ok)
+    {
+        // libsvmとpredictKernel()が添字に使う値: クラスごとのサポートベクタ数は0以上で合計がl、クラスのラベルは重複しない
+        const qint32 *label = (const qint32 *)(map + h->offset[SECTION_LABEL]);
+        const qint32 *nSV = (const qint32 *)(map + h->offset[SECTION_NSV]);
+        qint64 total = 0;
+        for(int i = 0; ok && i < h->nrClass; i++)
+        {
+            ok = nSV[i] >= 0;
+            total += nSV[i];
+            for(int j = 0; ok && j < i; j++) ok = label[j] != label[i];
+        }
+        ok = ok && total == h->l;
+    }
+    if(!ok)
+    {
+        file->close();
+        delete file;
+        return false;
+    }
+
+    int k = h->nrClass, l = h->l, dimension = h->dimension;
+    SVMModel *m = new SVMModel;
+    m->file = file;
+    svm_model *sm = new svm_model();
+    m->model = sm;
+    sm->param.svm_type = h->svmType;
+    sm->param.kernel_type = h->kernelType;
+    sm->param.degree = h->degree;
+    sm->param.gamma = h->gamma;
+    sm->param.coef0 = h->coef0;
+    sm->param.probability = (h->flags & SVM_FILE_PROBABILITY) ? 1 : 0;
+    sm->nr_class = k;
+    sm->l = l;
+    sm->free_sv = 0;
+
+    // libsvmは識別中に係数を書き換えないので、マップした領域をそのまま指す
+    sm->label = (int *)(map + h->offset[SECTION_LABEL]);
+    sm->nSV = (int *)(map + h->offset[SECTION_NSV]);
+    sm->rho = (double *)(map + h->offset[SECTION_RHO]);
+    if(h->flags & SVM_FILE_PROBABILITY)
+    {
+        sm->probA = (double *)(map + h->offset[SECTION_PROBA]);
+        sm->probB = (double *)(map + h->offset[SECTION_PROBB]);
+    }
+    m->coefRows = new double *[qMax(1, k - 1)];
+    for(int j = 0; j < k - 1; j++)
+    {
+        m->coefRows[j] = (double *)(map + h->offset[SECTION_COEF]) + (quint64)l * j;
+    }
+    sm->sv_coef = m->coefRows;
+
+    // libsvmのカーネル計算はsvm_node(倍精度)の列を要求するので、サポートベクタだけは変換して持つ
+    m->sv = (const float *)(map + h->offset[SECTION_SV]);
+    m->x_space = new svm_node[(quint64)(dimension + 1) * qMax(1, l)];
+    m->svRows = new svm_node *[qMax(1, l)];
+    for(int i = 0; i < l; i++)
+    {
+        svm_node *row = m->x_space + (quint64)(dimension + 1) * i;
+        const float *v = m->sv + (quint64)dimension * i;
+        for(int j = 0; j < dimension; j++)
+        {
+            row[j].index = j + 1;
+            row[j].value = v[j];
+        }
+        row[dimension].index = -1;
+        m->svRows[i] = row;
+    }
+    sm->SV = m->svRows;
+    m->setKernel(dimension);
+
+    const float *scale = (const float *)(map + h->offset[SECTION_SCALE]);
+    m->scaleA.resize(dimension);
+    m->scaleB.resize(dimension);
+    m->scale.resize(dimension);
+    for(int i = 0; i < dimension; i++)
+    {
+        m->scaleA[i] = scale[i];
+        m->scaleB[i] = scale[dimension + i];
+        m->scale[i] = QPointF(scale[dimension * 2 + i], scale[dimension * 3 + i]);
+    }
+
+    if(labelNames != NULL)
+    {
+        labelNames->clear();
+        const char *name = (const char *)(map + h->offset[SECTION_NAMES]);
+        const char *end = name + h->size[SECTION_NAMES];
+        for(int i = 0; i < h->nameCount && name < end; i++)
+        {
+            int n = qstrnlen(name, end - name);
+            labelNames->append(QString::fromUtf8(name, n));
+            name += n + 1;
+        }
+    }
+
+    replaceModel(m);
+    return true;
+}
+
+void SVMClassifier::replaceModel(SVMModel *m)
+{
+    cancelTraining();
+    QMutexLocker locker(&modelLock);
+    current = QSharedPointer<const SVMModel>(m);
+}
+
+bool SVMClassifier::exportText(const QString &modelPath, const QString &rangePath) const
+{
+    QSharedPointer<const SVMModel> m = model();
+    if(!m) return false;
+    if(svm_save_model(QFile::encodeName(modelPath).constData(), m->model) != 0) return false;
+
+    // svm-scaleの範囲ファイル。学習データの[最小値, 最大値]を[-1, 1]に写す
+    QSaveFile f(rangePath);
+    if(!f.open(QIODevice::WriteOnly | QIODevice::Text)) return false;
+    QTextStream out(&f);
+    out << "x\n" << -1 << " " << 1 << "\n";
+    for(int i = 0; i < m->scale.size(); i++)
+    {
+        out << i + 1 << " " << QString::number(m->scale[i].y(), 'g', 9) << " " << QString::number(m->scale[i].x(), 'g', 9) << "\n";
+    }
+    out.flush();
+    return f.commit();
+}
+
+bool SVMClassifier::importText(const QString &modelPath, const QString &rangePath)
+{
+    svm_model *sm = svm_load_model(QFile::encodeName(modelPath).constData());
+    if(sm == NULL) return false;
+    SVMModel *m = new SVMModel;
+    m->model = sm;
+
+    // 次元はサポートベクタと範囲ファイルに現れる最大の番号
+    int dimension = 0;
+    for(int i = 0; i < sm->l; i++)
+    {
+        for(const svm_node *p = sm->SV[i]; p->index != -1; p++) dimension = qMax(dimension, p->index);
+    }
+
+    double lower = -1, upper = 1;
+    QMap<int, QPointF> ranges; // 番号 -> (最大値, 最小値)
+    if(!rangePath.isEmpty())
+    {
+        QFile f(rangePath);
+        if(!f.open(QIODevice::ReadOnly | QIODevice::Text))
+        {
+            delete m;
+            return false;
+        }
+        QTextStream in(&f);
+        QString line = in.readLine().trimmed();
+        if(line == "y")
+        {
+            // 目的変数の範囲(回帰用)は使わない
+            in.readLine();
+            in.readLine();
+            line = in.readLine().trimmed();
+        }
+        if(line != "x")
+        {
+            delete m;
+            return false;
+        }
+        QStringList bounds = in.readLine().split(" ", QString::SkipEmptyParts);
+        if(bounds.size() == 2)
+        {
+            lower = bounds[0].toDouble();
+            upper = bounds[1].toDouble();
+        }
+        while(!in.atEnd())
+        {
+            QStringList v = in.readLine().split(" ", QString::SkipEmptyParts);
+            if(v.size() != 3) continue;
+            int index = v[0].toInt();
+            if(index < 1) continue;
+            ranges[index] = QPointF(v[2].toDouble(), v[1].toDouble());
+            dimension = qMax(dimension, index);
+        }
+    }
+
+    m->scaleA.resize(dimension);
+    m->scaleB.resize(dimension);
+    m->scale.resize(dimension);
+    for(int i = 0; i < dimension; i++)
+    {
+        if(rangePath.isEmpty())
+        {
+            // 正規化しない
+            m->scaleA[i] = 1;
+            m->scaleB[i] = 0;
+            m->scale[i] = QPointF(upper, lower);
+            continue;
+        }
+        QPointF r = ranges.value(i + 1, QPointF(0, 0));
+        m->scale[i] = r;
+        if(r.x() > r.y())
+        {
+            m->scaleA[i] = (upper - lower) / (r.x() - r.y());
+            m->scaleB[i] = lower - m->scaleA[i] * r.y();
+        }
+        else
+        {
+            // 学習データで一定だった次元(svm-scaleは範囲を書かないか、出力を省く)は、サポートベクタと同じ値に固定する
+            m->scaleA[i] = 0;
+            m->scaleB[i] = 0;
+            for(const svm_node *p = sm->l > 0 ? sm->SV[0] : NULL; p != NULL && p->index != -1; p++)
+            {
+                if(p->index == i + 1) m->scaleB[i] = p->value;
+            }
+        }
+    }
+    m->setDenseSV(dimension);
+
+    replaceModel(m);
+    return true;
+}
+
+bool SVMClassifier::writeProblems(const QString &path, QList<QPair<double, QVector<float> > > problems)
+{
+    QSaveFile f(path);
+    if(!f.open(QIODevice::WriteOnly | QIODevice::Text)) return false;
+    QTextStream stm(&f);
+    for(int i = 0; i < problems.size(); i++)
+    {
+        const QVector<float> &vector = problems[i].second;
+        stm << problems[i].first;
+        for(int j = 0; j < vector.count(); j++)
+        {
+            stm << " " << j+1 << ":" << QString::number(vector[j], 'g', 9);
+        }
+        stm << "\n";
+    }
+    stm.flush();
+    return f.commit();
+}
+
+QList<QPair<double, QVector<float> > > SVMClassifier::readProblems(const QString &path)
+{
+    QList<QPair<double, QVector<float> > > problems;
+    QFile f(path);
+    if(!f.open(QIODevice::ReadOnly | QIODevice::Text)) return problems;
+
+    // 疎な形式なので、全ての行を読んでから最大の番号の次元に揃える(現れない番号は0)
+    int dimension = 0;
+    QTextStream t(&f);
+    while(!t.atEnd())
+    {
+        QStringList ll = t.readLine().split(" ", QString::SkipEmptyParts);
+        if(ll.isEmpty()) continue;
+        bool ok;
+        double y = ll.takeFirst().toDouble(&ok);
+        if(!ok) return QList<QPair<double, QVector<float> > >();
+        QVector<float> x;
+        foreach(QString s, ll)
+        {
+            int colon = s.indexOf(':');
+            int index = s.left(colon).toInt();
+            if(colon < 0 || index < 1) return QList<QPair<double, QVector<float> > >();
+            if(x.size() < index) x.resize(index);
+            x[index-1] = s.mid(colon+1).toFloat();
+        }
+        dimension = qMax(dimension, x.size());
+        problems.append(QPair<double, QVector<float> >(y, x));
+    }
+    for(int i = 0; i < problems.size(); i++)
+    {
+        problems[i].second.resize(dimension);
+    }
+    return problems;
+}
@@ -8,34 +8,161 @@
 #include <QPointF>
 #include <QDebug>
 #include <QTimer>
-#include <QFileDialog>
-#include <QProgressBar>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QFile>
+#include <QStringList>
+#include "classifier.h"
 
-class SVMClassifier : public QObject
+// 学習済みモデル(libsvmのモデルと、その学習データの正規化係数)。公開した後は書き換えない
+struct SVMModel
+{
+    SVMModel();
+    ~SVMModel();
+
+    svm_model *model;
+    // 学習データ(makeProblem())。学習直後のモデルのサポートベクタはx_spaceの中を指すが、compact()した後はprobは空で、
+    // x_spaceはサポートベクタの分だけになる(ファイルをマップしたモデルと同じ形)
+    svm_problem prob;
+    svm_node *x_space;
+    QVector<QPointF> scale;
+    // 正規化 -1 + 2 * (x - min) / (max - min) を a * x + b にまとめた係数(次元ごと)
+    QVector<float> scaleA, scaleB;
+    // サポートベクタ(正規化済み)を行ごとに並べた連続領域 (model->l × 次元)。保存に使う
+    const float *sv;
+    QVector<float> denseSV;   // svの実体(ファイルをマップしたモデルではsvはマップした領域を指す)
+    void setDenseSV(int dimension);
+
+    // RBFカーネルの識別(SVMClassifier::predict())用に、サポートベクタをクラス順のまま32バイト境界・kernelStride間隔に並べ直した行列
+    // (qMallocAligned(size, 32)で確保)。RBFカーネルの分類(C-SVC・nu-SVC)でなければNULLで、識別はlibsvmに任せる
+    float *kernelSV;
+    int kernelStride, kernelDimension;
+    QVector<int> svStart;     // クラスiのサポートベクタは svStart[i] 行目から model->nSV[i] 行
+    void setKernel(int dimension);
+    // サポートベクタをsvから作り直したx_spaceに移し、学習データ(probと元のx_space)を解放する(setDenseSV()の後に呼ぶ)
+    // キャッシュに残るモデルが学習データ全体を抱えたままにならないようにする
+    void compact(int dimension);
+
+    // ファイルをマップしたモデル(SVMClassifier::load())では、係数はマップした領域を直接指し、
+    // libsvmに渡すサポートベクタ(svm_node列)だけをx_spaceに変換して持つ
+    QFile *file;
+    svm_node **svRows;
+    double **coefRows;
+
+    // 学習データと学習パラメータの指紋(SVMClassifier::fingerprint())。学習したモデルのみで、読み込んだモデルは空
+    QByteArray fingerprint;
+
+private:
+    SVMModel(const SVMModel &);
+    SVMModel &operator=(const SVMModel &);
+};
+
+// パラメータの自動調整(C・gammaのグリッドサーチ)で調べた1点
+struct SVMGridPoint
+{
+    SVMGridPoint() : C(0), gamma(0), accuracy(-1), msec(0) {}
+    double C, gamma;
+    double accuracy;  // k分割交差検定の正解率[0, 1](調べていなければ-1)
+    qint64 msec;      // その点の交差検定にかかった時間[ms]
+};
+
+// RBFカーネルのSVM(libsvm)による識別器
+class SVMClassifier : public Classifier
 {
     Q_OBJECT
 public:
     explicit SVMClassifier(QObject *parent = 0);
+    // 学習中ならそれを取り消し、学習スレッドが終わるのを待つ
+    ~SVMClassifier();
+
+    // 学習データ(各行の値とラベル)と、結果に関わる学習パラメータのハッシュ。同じ指紋なら同じモデルができる
+    // tuneが真なら、自動調整の設定(folds・targetAccuracy)も含める
+    static QByteArray fingerprint(const ProblemView &problems, const svm_parameter &param,
+                                  bool tune = false, int folds = 0, double targetAccuracy = 0);
+
+    virtual Type type() const { return TYPE_SVM; }
+    virtual int labelCount() const;
+    virtual int dimension() const;
+    virtual bool isTrained() const { return !model().isNull(); }
+    // 識別に使っている学習済みモデル。受け取った側が持っている間は、学習し直しても解放されない
+    QSharedPointer<const SVMModel> model() const;
+
+    // data(size点)を正規化してworkspaceのsvm_node列に書き込み、識別する
+    virtual double predict(const float *data, int size, double *probability, ClassifierWorkspace &workspace) const;
+    using Classifier::predict;
+
+    // 学習済みモデルの保存と読み込み(独自のバイナリ形式、説明はsvmclassifier.cpp)
+    virtual bool save(const QString &path, const QStringList &labelNames = QStringList()) const;
+    // ファイルをメモリにマップし、解析せずにそのまま識別に使う(libsvmに渡すサポートベクタだけは倍精度に変換する)
+    virtual bool load(const QString &path, QStringList *labelNames = NULL);
+    // libsvmのテキスト形式との相互変換。モデルはsvm-trainの、正規化の範囲はsvm-scale(-s/-r)の形式
+    bool exportText(const QString &modelPath, const QString &rangePath) const;
+    // rangePathを省略すると正規化しない(既に正規化された入力を渡す)
+    bool importText(const QString &modelPath, const QString &rangePath = QString());
+    // 学習データのlibsvm形式(1行に「ラベル 番号:値 ...」)での書き出しと読み込み。読めなければ空を返す
+    static bool writeProblems(const QString &path, QList<QPair<double, QVector<float> > > problems);
+    static QList<QPair<double, QVector<float> > > readProblems(const QString &path);
+
+    // パラメータの自動調整。onなら学習(train・trainAsync)のたびにCとgammaをグリッドサーチし、最良の点で学習する
+    // 各点はfolds分割の交差検定の正解率で評価し、targetAccuracyに達したらそこで打ち切る
+    void setAutoTune(bool on, int folds = 5, double targetAccuracy = 1.0);
+    bool autoTune() const { return autoTuneEnabled; }
+    // 学習データでグリッドサーチし、最良のCとgammaをパラメータに設定する(呼び出したスレッドで終わるまで待つ)。調べた点を返す
+    QList<SVMGridPoint> tune(const ProblemView &problems);
+
+    using Classifier::train;
+    using Classifier::trainAsync;
 
 public slots:
+    // 最近学習したモデルと学習データ・パラメータが同じなら、学習し直さずにそれを使う(trainAsyncも同じ)
+    // 進捗はlibsvmが解いた2クラス問題の数から見積もる。libsvmの学習は途中で止められないので、取り消したものは終わった時点で破棄する
     void train(QList<QPair<double, QVector<float> > > _problems);
-    double predict(QVector<float> data, double *probability = NULL);
+    void trainAsync(QList<QPair<double, QVector<float> > > _problems);
+    // 学習中に変えないこと(自動調整の設定も同じ)
     void setParam(svm_parameter p) { param = p; }
 
-//    void loadProblems();
-//    void writeProblems();
+protected:
+    virtual bool build(const ProblemView &problems, int generation);
+
+signals:
+    // 自動調整で1点調べ終えた(交差検定の正解率[%]と、かかった時間[ms])
+    void tuningPoint(double C, double gamma, double accuracy, int msec);
 
 private:
-    svm_parameter param;
-    svm_problem prob;
-    svm_model *model;
-    QVector<QPointF> scale;
-    QList<QPair<double, QVector<float> > > problems;
+    friend struct SVMTrainProgress;
+    friend class SVMGridTask;
+    // 学習データを正規化してlibsvmの問題にする(モデルはまだない)。学習データが空ならNULL
+    static SVMModel *makeProblem(const ProblemView &problems);
+    // 学習用の問題から新しいモデルを作る(どのスレッドからでもよい)。作れなければNULL
+    static SVMModel *buildModel(const ProblemView &problems, svm_parameter param);
+    static QVector<QPointF> calcScale(const ProblemView &problems);
+    // 粗い格子の後に最良点の周りを細かく調べ、調べた点を返す(格子点は専用のスレッドプールで並列に調べる)
+    // generationが0以上なら、その学習が取り消されたら打ち切り、調べた点をtuningPointで通知する
+    QList<SVMGridPoint> gridSearch(const ProblemView &problems, svm_parameter param, int folds, double targetAccuracy, int generation, SVMGridPoint *best);
+    static void setScale(SVMModel *m, QVector<QPointF> maxmin);
+    // generation番目の学習の結果を公開する。その後に取り消されていればfalseを返す(取り消されてもキャッシュには残す)
+    bool publish(QSharedPointer<const SVMModel> m, int generation);
+    // 指紋が同じ最近のモデル(なければNULL)。見つかったものは最も新しく使ったものにする
+    QSharedPointer<const SVMModel> cachedModel(const QByteArray &key);
+    // mを最も新しく使ったモデルとしてキャッシュに入れる(modelLockを取って呼ぶ)
+    void remember(QSharedPointer<const SVMModel> m);
+    // 読み込んだモデルを公開する(学習中のものは取り消す)
+    void replaceModel(SVMModel *m);
 
 private slots:
-    svm_model *buildModel(QList<QPair<double, QVector<float> > > problems, QVector<QPointF> scale);
-    QVector<QPointF> calcScale(QList<QPair<double, QVector<float> > > _problems);
-    float scaling(float value, QPointF maxmin);
+    void reportTuningPoint(int generation, double C, double gamma, double accuracy, int msec);
+
+private:
+    svm_parameter param;
+    // 公開中のモデル(modelLockで保護)。差し替えはポインタの入れ替えだけ
+    QSharedPointer<const SVMModel> current;
+    // 最近学習したモデル(新しく使った順、SVM_MODEL_CACHE_SIZE個まで)。modelLockで保護
+    QList<QSharedPointer<const SVMModel> > cache;
+    // 自動調整の設定(学習中に変えないこと)
+    bool autoTuneEnabled;
+    int tuneFolds;
+    double tuneTarget;
 };
 
 #endif // SVMCLASSIFIER_H
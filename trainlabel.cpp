@@ -6,7 +6,7 @@ int TrainLabel::buffer_size = 20;
 bool PredictionLabel::isReg = false;
 float TrainLabel::threshold = 3;
 
-TrainLabel::TrainLabel(QString _name, QColor _color, ActiveAcousticSensor *_aas, QWidget *parent) :
+TrainLabel::TrainLabel(QString _name, QColor _color, ActiveAcousticSensor *_aas, FrameStore *_store, int _labelId, QWidget *parent) :
     QWidget(parent)
   , color(_color)
   , mode(MANUAL)
@@ -15,7 +15,10 @@ TrainLabel::TrainLabel(QString _name, QColor _color, ActiveAcousticSensor *_aas,
   , f(100)
   , aas(_aas)
   , trainCount(0)
+  , store(_store)
+  , id(_labelId)
 {
+    takeIds = store->takes(id);
 
     blinker.setInterval(30);
     connect(&blinker, SIGNAL(timeout()), SLOT(blinkTick()));
@@ -29,6 +32,7 @@ TrainLabel::TrainLabel(QString _name, QColor _color, ActiveAcousticSensor *_aas,
     dlabel = new DefinitionLabel(_name, _color);
     connect(dlabel, SIGNAL(nameChanged(QString)), &name, SLOT(setText(QString)));
     connect(dlabel, SIGNAL(nameChanged(QString)), plabel, SLOT(setName(QString)));
+    connect(dlabel, SIGNAL(nameChanged(QString)), SLOT(storeName(QString)));
     connect(dlabel, SIGNAL(deleted()), this, SIGNAL(deleted()));
     name.setText(_name);
 
@@ -43,13 +47,13 @@ TrainLabel::~TrainLabel()
 }
 
 
-QList<QVector<float> > TrainLabel::getTrainData()
+QVector<float> TrainLabel::lastFrame()
 {
-    QList<QVector<float> > out;
-    foreach(QList<QVector<float> > d, trainData)
-    {
-        out << d;
-    }
+    QVector<float> out;
+    QVector<int> rows = store->rows(id);
+    if(rows.isEmpty()) return out;
+    out.resize(store->dimension());
+    memcpy(out.data(), store->features(rows.last()), sizeof(float) * out.size());
     return out;
 }
 
@@ -111,7 +115,7 @@ void TrainLabel::paintEvent(QPaintEvent *event)
     p.fillRect(QRectF(10, 0, x, height()), Qt::white);
 
     int left = width();
-    for(int i = 0; i < trainData.count(); i++)
+    for(int i = 0; i < takeIds.count(); i++)
     {
         QRectF r = rect();
         r.setTop(height()*0.1);
@@ -125,7 +129,7 @@ void TrainLabel::paintEvent(QPaintEvent *event)
     QRectF countRect = rect();
     countRect.setLeft(left - 15);
     p.setPen(QPen(Qt::darkGray, 4));
-    p.drawText(countRect, Qt::AlignVCenter, QString::number(trainData.count()));
+    p.drawText(countRect, Qt::AlignVCenter, QString::number(takeIds.count()));
 
 
     QFont f("Helvetica", 18);
@@ -144,7 +148,24 @@ bool TrainLabel::updateTraining(QVector<float> data)
     trainBuf.append(data);
     if(trainBuf.count() == buffer_size)
     {
-        trainData.append(trainBuf);
+        // 1テイク揃ったらストアに書き込む(特徴ベクトルの次元がストアと違えば書き込めない)
+        if(store->dimension() != 0 && store->dimension() != data.size()) emit featureSizeChanged(data.size());
+        int take = store->nextTake(id);
+        bool stored = true;
+        foreach(QVector<float> d, trainBuf)
+        {
+            stored = stored && store->append(id, take, d.constData(), d.size());
+        }
+        if(stored)
+        {
+            takeIds.append(take);
+        }
+        else
+        {
+            store->removeTake(id, take);
+            emit takeRejected(data.size());
+        }
+        emit dataChanged();
         if(mode == FORCE) finishTraining();
     }
     return true;
@@ -179,7 +200,7 @@ void TrainLabel::suspendTraining()
 void TrainLabel::mouseMoveEvent(QMouseEvent *event)
 {
     mouse_over_data = -1;
-    for(int i = 0; i < trainData.count(); i++)
+    for(int i = 0; i < takeIds.count(); i++)
     {
         QRectF r = rect();
         r.setTop(height()*0.1);
@@ -208,7 +229,11 @@ void TrainLabel::mousePressEvent(QMouseEvent *event)
         else if(mouse_over_data == -1)
             trainer.start();
         else
-            trainData.removeAt(mouse_over_data);
+        {
+            store->removeTake(id, takeIds.takeAt(mouse_over_data));
+            mouse_over_data = -1;
+            emit dataChanged();
+        }
     }
 }
 
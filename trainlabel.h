@@ -5,6 +5,8 @@
 #include <math.h>
 #include "activeacousticsensor.h"
 #include "svmclassifier.h"
+#include "framestore.h"
+#include "latencyprobe.h"
 
 
 
@@ -139,6 +141,9 @@ protected:
         QString t;
         t = t.sprintf("%.4f", prob);
         p.drawText(probRect, Qt::AlignVCenter, t);
+
+        // 識別されたラベルが画面に出た時点を、そのフレームの遅延の終わりとする
+        if(result) LatencyProbe::instance()->framePainted();
     }
 public:
     static bool isReg;
@@ -175,7 +180,8 @@ class TrainLabel : public QWidget
 {
     Q_OBJECT
 public:
-    explicit TrainLabel(QString _name, QColor _color, ActiveAcousticSensor *_aas, QWidget *parent = 0);
+    // 学習データはstoreのlabelId番のラベルとして書き込む(既にある行はそのまま表示する)
+    explicit TrainLabel(QString _name, QColor _color, ActiveAcousticSensor *_aas, FrameStore *_store, int _labelId, QWidget *parent = 0);
     ~TrainLabel();
 
     typedef enum {
@@ -191,13 +197,22 @@ signals:
     void deleted();
     void defaultPressed();
     void trainFinished();
+    // テイクを足すか消して、学習データが変わった
+    void dataChanged();
+    // 特徴ベクトルの次元がストアの次元と違う(テイクを書き込む直前に通知する。受け取った側はストアを作り直してよい)
+    void featureSizeChanged(int size);
+    // テイクをストアに書き込めなかった
+    void takeRejected(int size);
 
 public slots:
     void setDefault(bool b) { isDefault = b; update(); }
     void setTrain(TRAIN_MODE _mode = FORCE, QVector<float> _thresholdVector = QVector<float>());
     void resetTrainCount() { trainCount = 0; }
     int getTrainCount() { return trainCount; }
-    QList<QVector<float> > getTrainData();
+    int labelId() { return id; }
+    bool hasTrainData() { return !takeIds.isEmpty(); }
+    // 最後のテイクの最後のフレーム(なければ空)
+    QVector<float> lastFrame();
     QColor Color() { return color; }
     QString Name() { return name.text(); }
     DefinitionLabel *getDefinitionLabel() { return dlabel; }
@@ -214,6 +229,7 @@ private slots:
     bool updateTraining(QVector<float> data);
     void finishTraining();
     void suspendTraining();
+    void storeName(QString s) { store->renameLabel(id, s); }
 
 protected:
     void paintEvent(QPaintEvent *event);
@@ -240,7 +256,10 @@ private:
     bool isDefault;
     int mouse_over_data;
 
-    QList<QList<QVector<float> > > trainData;
+    // 学習データはFrameStoreに置き、ここではテイク番号(古い順)だけを持つ
+    FrameStore *store;
+    int id;
+    QList<int> takeIds;
     QList<QVector<float> > trainBuf;
     QVector<float> thresholdVector;
 
@@ -0,0 +1,127 @@
+#include "workerpool.h"
+
+WorkerPool::WorkerPool(int threads)
+    : next(0)
+    , queued(0)
+    , pending(0)
+    , stealCount(0)
+    , stopping(0)
+{
+    if(threads <= 0) threads = qMax(1, QThread::idealThreadCount());
+    for(int i = 0; i < threads; i++)
+    {
+        queues.append(new TaskQueue);
+        workers.append(new PoolWorker(this, i));
+    }
+    foreach(PoolWorker *w, workers) w->start();
+}
+
+WorkerPool::~WorkerPool()
+{
+    waitForDone();
+    stopping.store(1);
+    idleLock.lock();
+    workAvailable.wakeAll();
+    idleLock.unlock();
+    foreach(PoolWorker *w, workers) w->wait();
+    qDeleteAll(workers);
+    qDeleteAll(queues);
+}
+
+WorkerPool *WorkerPool::globalInstance()
+{
+    static WorkerPool pool;
+    return &pool;
+}
+
+void WorkerPool::submit(QRunnable *task)
+{
+    int index = -1;
+    QThread *current = QThread::currentThread();
+    for(int i = 0; i < workers.size(); i++)
+    {
+        if(workers[i] == current) index = i;
+    }
+    if(index < 0) index = (next.fetchAndAddRelaxed(1) & 0x7fffffff) % queues.size();
+
+    pending.ref();
+    TaskQueue *q = queues[index];
+    q->lock.lock();
+    q->tasks.append(task);
+    q->lock.unlock();
+    queued.ref();
+
+    // 眠っているスレッドを1本起こす(ロックを取ってから起こすので、待機に入る直前の取りこぼしがない)
+    idleLock.lock();
+    workAvailable.wakeOne();
+    idleLock.unlock();
+}
+
+// index番目のスレッドが次に実行するタスクを取る。なければNULL
+QRunnable *WorkerPool::take(int index)
+{
+    TaskQueue *own = queues[index];
+    own->lock.lock();
+    QRunnable *task = own->tasks.isEmpty() ? NULL : own->tasks.takeLast();
+    own->lock.unlock();
+    if(task)
+    {
+        queued.deref();
+        return task;
+    }
+
+    // 隣のスレッドから順に盗む
+    for(int i = 1; i < queues.size(); i++)
+    {
+        TaskQueue *victim = queues[(index + i) % queues.size()];
+        if(!victim->lock.tryLock()) continue;
+        task = victim->tasks.isEmpty() ? NULL : victim->tasks.takeFirst();
+        victim->lock.unlock();
+        if(task)
+        {
+            queued.deref();
+            stealCount.ref();
+            return task;
+        }
+    }
+    return NULL;
+}
+
+void WorkerPool::runTask(QRunnable *task)
+{
+    bool autoDelete = task->autoDelete();
+    task->run();
+    if(autoDelete) delete task;
+
+    if(!pending.deref())
+    {
+        idleLock.lock();
+        allDone.wakeAll();
+        idleLock.unlock();
+    }
+}
+
+void WorkerPool::waitForDone()
+{
+    idleLock.lock();
+    while(pending.load() > 0) allDone.wait(&idleLock, 100);
+    idleLock.unlock();
+}
+
+void PoolWorker::run()
+{
+    while(!pool->stopping.load())
+    {
+        QRunnable *task = pool->take(index);
+        if(task)
+        {
+            pool->runTask(task);
+            continue;
+        }
+        // 盗む際にtryLockで諦めたキューがあり得るので、積まれているタスクがある間は眠らない
+        pool->idleLock.lock();
+        if(pool->queued.load() == 0 && !pool->stopping.load())
+            pool->workAvailable.wait(&pool->idleLock, 50);
+        pool->idleLock.unlock();
+    }
+}
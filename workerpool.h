@@ -0,0 +1,81 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <QThread>
+#include <QRunnable>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QList>
+
+class WorkerPool;
+
+// WorkerPoolの作業スレッド
+class PoolWorker : public QThread
+{
+    Q_OBJECT
+public:
+    PoolWorker(WorkerPool *pool, int index) : pool(pool), index(index) {}
+
+protected:
+    void run();
+
+private:
+    WorkerPool *pool;
+    int index;
+};
+
+// ワークスティーリング方式の固定サイズのスレッドプール
+// スレッドごとにタスクの両端キューを持ち、自分のキューは後ろから(LIFO: 直前に積んだキャッシュの温かいタスクから)取り、
+// 空になったら他のスレッドのキューの前から(FIFO: 古いタスクから)盗む。キューごとのロックしか取らないので、
+// 全スレッドが1つのキューを奪い合うQThreadPoolよりもコア数が多いときに競合しにくい
+class WorkerPool
+{
+    friend class PoolWorker;
+public:
+    // threadsが0以下ならコア数(QThread::idealThreadCount())
+    explicit WorkerPool(int threads = 0);
+    ~WorkerPool();
+
+    int threadCount() const { return workers.size(); }
+
+    // タスクを積む。作業スレッドから呼ばれたらそのスレッドのキューに、それ以外からは順番に各キューへ積む
+    // task->autoDelete()がtrueなら実行後にdeleteする(QThreadPoolと同じ)
+    void submit(QRunnable *task);
+    // 積んだタスクが全て終わるまで待つ。作業スレッドから呼んではいけない
+    void waitForDone();
+    // 未完了(待ち+実行中)のタスク数
+    int pendingTasks() const { return pending.load(); }
+    // 他のスレッドのキューから盗んだ回数(統計用)
+    int steals() const { return stealCount.load(); }
+
+    // アプリケーション全体で共有するプール(最初の呼び出しで生成)
+    static WorkerPool *globalInstance();
+
+private:
+    QRunnable *take(int index);
+    void runTask(QRunnable *task);
+
+private:
+    struct TaskQueue
+    {
+        QMutex lock;
+        QList<QRunnable *> tasks;
+    };
+    QList<PoolWorker *> workers;
+    QList<TaskQueue *> queues;
+    QAtomicInt next;       // 作業スレッド以外から積むときの振り分け先
+    QAtomicInt queued;     // キューに積まれているタスク数
+    QAtomicInt pending;    // 未完了のタスク数
+    QAtomicInt stealCount;
+    QAtomicInt stopping;
+    // 仕事がないときの待機と、waitForDone()の待機
+    QMutex idleLock;
+    QWaitCondition workAvailable;
+    QWaitCondition allDone;
+
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+};
+
+#endif // WORKERPOOL_H